@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <new>
+
+namespace keyvadb
+{
+// A monotonic arena for memory which lives no longer than a single flush.
+// Allocation bumps a pointer through fixed size blocks and deallocation does
+// nothing, so everything is released at once by Reset. Not threadsafe.
+class Arena
+{
+    enum
+    {
+        BlockSize = 64 * 1024
+    };
+
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char* pos_ = nullptr;
+    char* end_ = nullptr;
+    std::size_t allocated_ = 0;
+
+   public:
+    Arena() = default;
+    Arena(Arena const&) = delete;
+    Arena& operator=(Arena const&) = delete;
+
+    void* Allocate(std::size_t const size, std::size_t const align)
+    {
+        auto p = align_up(pos_, align);
+        if (!p || p + size > end_)
+        {
+            // Oversized allocations get a block of their own
+            auto const blockSize =
+                std::max<std::size_t>(BlockSize, size + align);
+            blocks_.emplace_back(new char[blockSize]);
+            pos_ = blocks_.back().get();
+            end_ = pos_ + blockSize;
+            p = align_up(pos_, align);
+        }
+        pos_ = p + size;
+        allocated_ += size;
+        return p;
+    }
+
+    // Releases every allocation, keeping the first block for reuse
+    void Reset()
+    {
+        if (blocks_.size() > 1)
+            blocks_.resize(1);
+        if (!blocks_.empty())
+        {
+            pos_ = blocks_.front().get();
+            end_ = pos_ + BlockSize;
+        }
+        allocated_ = 0;
+    }
+
+    // Bytes handed out since the last Reset
+    std::size_t Allocated() const { return allocated_; }
+    std::size_t Blocks() const { return blocks_.size(); }
+
+   private:
+    static char* align_up(char* p, std::size_t const align)
+    {
+        auto const n = reinterpret_cast<std::uintptr_t>(p);
+        return reinterpret_cast<char*>((n + align - 1) & ~(align - 1));
+    }
+};
+
+// A standard allocator which allocates from an Arena, for containers which
+// are discarded at the end of a flush.
+template <class T>
+class ArenaAllocator
+{
+    template <class U>
+    friend class ArenaAllocator;
+
+    Arena* arena_;
+
+   public:
+    using value_type = T;
+
+    explicit ArenaAllocator(Arena& arena) : arena_(&arena) {}
+
+    template <class U>
+    ArenaAllocator(ArenaAllocator<U> const& other)
+        : arena_(other.arena_)
+    {
+    }
+
+    T* allocate(std::size_t const n)
+    {
+        return static_cast<T*>(arena_->Allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T*, std::size_t) {}
+
+    template <class U>
+    bool operator==(ArenaAllocator<U> const& other) const
+    {
+        return arena_ == other.arena_;
+    }
+
+    template <class U>
+    bool operator!=(ArenaAllocator<U> const& other) const
+    {
+        return arena_ != other.arena_;
+    }
+};
+}  // namespace keyvadb
@@ -0,0 +1,528 @@
+#pragma once
+
+#include <aio.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define KEYVADB_IO_URING 1
+#endif
+#endif
+
+namespace keyvadb
+{
+// Reads which are started without waiting for them, and called back from
+// Poll once they complete, so that a single thread can keep many of them
+// in flight. At most depth reads are in flight at once, and the rest wait
+// for one of them to complete. Not threadsafe: Read and Poll must only be
+// called from one thread at a time, which is the thread the callbacks run
+// on. Destroying a reader waits for its reads in flight and calls them
+// back.
+class AsyncReader
+{
+   public:
+    using read_callback =
+        std::function<void(std::size_t, std::error_condition)>;
+
+    virtual ~AsyncReader() = default;
+
+    // Starts reading size bytes at pos of fd into data, which must stay
+    // valid until done is called with the number of bytes read.
+    virtual void Read(int const fd, std::uint64_t const pos, char* data,
+                      std::size_t const size, read_callback done) = 0;
+
+    // Calls done from the next Poll, for a read that has already been made
+    void Complete(read_callback done, std::size_t const bytesRead,
+                  std::error_condition const err)
+    {
+        ready_.push_back(completion{std::move(done), bytesRead, err});
+    }
+
+    // Calls back every read which has completed, first waiting for one if
+    // wait is set and there are none. Reads started by the callbacks are
+    // called back by a later Poll. Returns the number called back.
+    std::size_t Poll(bool const wait = false)
+    {
+        reap(wait && ready_.empty());
+        std::deque<completion> ready;
+        ready.swap(ready_);
+        for (auto& c : ready) c.done(c.bytesRead, c.err);
+        return ready.size();
+    }
+
+    // Reads started and not yet called back
+    std::size_t Pending() const { return inFlight() + ready_.size(); }
+
+    // Which system interface makes the reads
+    virtual char const* Name() const = 0;
+
+   protected:
+    struct completion
+    {
+        read_callback done;
+        std::size_t bytesRead;
+        std::error_condition err;
+    };
+
+    // Reads which are waiting for Poll to call them back
+    std::deque<completion> ready_;
+
+    // Moves the reads that have completed to ready_, first waiting for
+    // one if wait is set and any are in flight
+    virtual void reap(bool const wait) = 0;
+
+    // Reads which have been started, or are waiting to be, and haven't
+    // completed
+    virtual std::size_t inFlight() const = 0;
+
+    void fail(read_callback done, int const error)
+    {
+        Complete(std::move(done), 0,
+                 std::generic_category().default_error_condition(error));
+    }
+};
+
+// POSIX AIO, which is available everywhere. glibc makes the reads with
+// threads of its own, so io_uring is used instead where it can be.
+class AioReader : public AsyncReader
+{
+    struct request
+    {
+        int fd;
+        std::uint64_t pos;
+        char* data;
+        std::size_t size;
+        read_callback done;
+    };
+
+    std::size_t const depth_;
+    // A slot for each read in flight, as aio_error and aio_return find a
+    // read by the address of its aiocb
+    std::vector<aiocb> cbs_;
+    std::vector<read_callback> done_;
+    std::vector<std::size_t> free_;
+    std::vector<std::size_t> started_;
+    std::deque<request> waiting_;
+    std::vector<aiocb const*> list_;
+
+   public:
+    explicit AioReader(std::size_t const depth)
+        : depth_(std::max<std::size_t>(depth, 1)),
+          cbs_(depth_),
+          done_(depth_)
+    {
+        for (std::size_t i = depth_; i > 0; i--) free_.push_back(i - 1);
+    }
+    AioReader(AioReader const&) = delete;
+    AioReader& operator=(AioReader const&) = delete;
+
+    ~AioReader()
+    {
+        while (Pending() > 0) Poll(true);
+    }
+
+    void Read(int const fd, std::uint64_t const pos, char* data,
+              std::size_t const size, read_callback done) override
+    {
+        request r{fd, pos, data, size, std::move(done)};
+        if (free_.empty())
+            return waiting_.push_back(std::move(r));
+        start(std::move(r));
+    }
+
+    char const* Name() const override { return "aio"; }
+
+   protected:
+    void reap(bool const wait) override
+    {
+        for (;;)
+        {
+            for (std::size_t j = 0; j < started_.size();)
+            {
+                auto const i = started_[j];
+                int const error = ::aio_error(&cbs_[i]);
+                if (error == EINPROGRESS)
+                {
+                    j++;
+                    continue;
+                }
+                ssize_t const ret = ::aio_return(&cbs_[i]);
+                if (ret < 0)
+                    fail(std::move(done_[i]), error);
+                else
+                    Complete(std::move(done_[i]), ret,
+                             std::error_condition());
+                started_[j] = started_.back();
+                started_.pop_back();
+                free_.push_back(i);
+            }
+            while (!waiting_.empty() && !free_.empty())
+            {
+                auto r = std::move(waiting_.front());
+                waiting_.pop_front();
+                if (!start(std::move(r)))
+                    break;
+            }
+            if (!wait || !ready_.empty() || started_.empty())
+                return;
+            list_.clear();
+            for (auto const i : started_) list_.push_back(&cbs_[i]);
+            // Interrupted or not, the reads are checked again
+            ::aio_suspend(list_.data(), list_.size(), nullptr);
+        }
+    }
+
+    std::size_t inFlight() const override
+    {
+        return started_.size() + waiting_.size();
+    }
+
+   private:
+    // Returns false if the read has to wait for another to complete
+    bool start(request r)
+    {
+        auto const i = free_.back();
+        auto& cb = cbs_[i];
+        std::memset(&cb, 0, sizeof(cb));
+        cb.aio_fildes = r.fd;
+        cb.aio_offset = r.pos;
+        cb.aio_buf = r.data;
+        cb.aio_nbytes = r.size;
+        cb.aio_sigevent.sigev_notify = SIGEV_NONE;
+        if (::aio_read(&cb) == 0)
+        {
+            free_.pop_back();
+            done_[i] = std::move(r.done);
+            started_.push_back(i);
+            return true;
+        }
+        // Out of resources, so wait for a read to complete
+        if (errno == EAGAIN && !started_.empty())
+        {
+            waiting_.push_front(std::move(r));
+            return false;
+        }
+        fail(std::move(r.done), errno);
+        return true;
+    }
+};
+
+#ifdef KEYVADB_IO_URING
+namespace detail
+{
+// The parts of the io_uring ABI that UringReader uses, from
+// linux/io_uring.h. That header includes linux/fs.h, whose BLOCK_SIZE
+// macro would break every includer which uses the name.
+namespace uring
+{
+struct sqring_offsets
+{
+    std::uint32_t head, tail, ring_mask, ring_entries, flags, dropped, array,
+        resv1;
+    std::uint64_t resv2;
+};
+
+struct cqring_offsets
+{
+    std::uint32_t head, tail, ring_mask, ring_entries, overflow, cqes, flags,
+        resv1;
+    std::uint64_t resv2;
+};
+
+struct params
+{
+    std::uint32_t sq_entries, cq_entries, flags, sq_thread_cpu,
+        sq_thread_idle, features, wq_fd, resv[3];
+    sqring_offsets sq_off;
+    cqring_offsets cq_off;
+};
+
+struct sqe
+{
+    std::uint8_t opcode;
+    std::uint8_t flags;
+    std::uint16_t ioprio;
+    std::int32_t fd;
+    std::uint64_t off;
+    std::uint64_t addr;
+    std::uint32_t len;
+    std::uint32_t rw_flags;
+    std::uint64_t user_data;
+    std::uint16_t buf_index;
+    std::uint16_t personality;
+    std::int32_t splice_fd_in;
+    std::uint64_t pad[2];
+};
+
+struct cqe
+{
+    std::uint64_t user_data;
+    std::int32_t res;
+    std::uint32_t flags;
+};
+
+static_assert(sizeof(params) == 120, "io_uring_params");
+static_assert(sizeof(sqe) == 64, "io_uring_sqe");
+static_assert(sizeof(cqe) == 16, "io_uring_cqe");
+
+constexpr std::uint64_t OffSqRing = 0;
+constexpr std::uint64_t OffCqRing = 0x8000000;
+constexpr std::uint64_t OffSqes = 0x10000000;
+constexpr std::uint8_t OpReadv = 1;
+constexpr unsigned EnterGetEvents = 1;
+}  // namespace uring
+}  // namespace detail
+
+// Linux io_uring, made with system calls directly so that liburing isn't
+// needed. Each read is submitted as Read is called, and completions are
+// collected from the shared ring without a system call unless Poll has to
+// wait. Open fails where the kernel doesn't support io_uring or doesn't
+// allow it, as container sandboxes often don't.
+class UringReader : public AsyncReader
+{
+    struct request
+    {
+        int fd;
+        std::uint64_t pos;
+        // The kernel reads the iovec of a READV when it is submitted, as
+        // IORING_OP_READ needs Linux 5.6
+        iovec iov;
+        read_callback done;
+    };
+
+    struct mapping
+    {
+        void* base = MAP_FAILED;
+        std::size_t length = 0;
+    };
+
+    std::size_t const depth_;
+    int fd_;
+    mapping sqRing_;
+    mapping cqRing_;
+    mapping sqes_;
+    unsigned* sqTail_;
+    unsigned* sqMask_;
+    unsigned* sqArray_;
+    unsigned* cqHead_;
+    unsigned* cqTail_;
+    unsigned* cqMask_;
+    detail::uring::cqe* cqes_;
+    // Reads in flight by their index, which is the user_data of their
+    // submission
+    std::vector<request> started_;
+    std::vector<std::uint32_t> free_;
+    std::deque<request> waiting_;
+    // Submissions queued in the ring which the kernel hasn't yet taken
+    unsigned toSubmit_;
+    // Why the ring can no longer be used, after which every read fails
+    int broken_;
+
+   public:
+    explicit UringReader(std::size_t const depth)
+        : depth_(std::min<std::size_t>(std::max<std::size_t>(depth, 1),
+                                       4096)),
+          fd_(-1),
+          toSubmit_(0),
+          broken_(0)
+    {
+    }
+    UringReader(UringReader const&) = delete;
+    UringReader& operator=(UringReader const&) = delete;
+
+    ~UringReader()
+    {
+        while (Pending() > 0) Poll(true);
+        unmap(sqes_);
+        unmap(cqRing_);
+        unmap(sqRing_);
+        if (fd_ >= 0)
+            ::close(fd_);
+    }
+
+    std::error_condition Open()
+    {
+        detail::uring::params p;
+        std::memset(&p, 0, sizeof(p));
+        fd_ = ::syscall(__NR_io_uring_setup, unsigned(depth_), &p);
+        if (fd_ < 0)
+            return std::generic_category().default_error_condition(errno);
+        sqRing_.length = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqRing_.length = p.cq_off.cqes + p.cq_entries * sizeof(detail::uring::cqe);
+        sqes_.length = p.sq_entries * sizeof(detail::uring::sqe);
+        if (auto err = map(sqRing_, detail::uring::OffSqRing))
+            return err;
+        if (auto err = map(cqRing_, detail::uring::OffCqRing))
+            return err;
+        if (auto err = map(sqes_, detail::uring::OffSqes))
+            return err;
+        auto sq = static_cast<char*>(sqRing_.base);
+        auto cq = static_cast<char*>(cqRing_.base);
+        sqTail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sqMask_ = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sqArray_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        cqHead_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cqTail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cqMask_ = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<detail::uring::cqe*>(cq + p.cq_off.cqes);
+        // The completion ring is at least as big as the submission ring,
+        // so it can't overflow with no more than sq_entries in flight
+        started_.resize(std::min<std::size_t>(depth_, p.sq_entries));
+        for (std::size_t i = started_.size(); i > 0; i--)
+            free_.push_back(i - 1);
+        return std::error_condition();
+    }
+
+    void Read(int const fd, std::uint64_t const pos, char* data,
+              std::size_t const size, read_callback done) override
+    {
+        if (broken_)
+            return fail(std::move(done), broken_);
+        request r{fd, pos, iovec{data, size}, std::move(done)};
+        if (free_.empty())
+            return waiting_.push_back(std::move(r));
+        start(std::move(r));
+        submit(0);
+    }
+
+    char const* Name() const override { return "io_uring"; }
+
+   protected:
+    void reap(bool const wait) override
+    {
+        while (!broken_)
+        {
+            unsigned head = *cqHead_;
+            unsigned const tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++)
+            {
+                auto const& cqe = cqes_[head & *cqMask_];
+                auto const i = static_cast<std::uint32_t>(cqe.user_data);
+                if (cqe.res < 0)
+                    fail(std::move(started_[i].done), -cqe.res);
+                else
+                    Complete(std::move(started_[i].done), cqe.res,
+                             std::error_condition());
+                free_.push_back(i);
+            }
+            __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+            while (!waiting_.empty() && !free_.empty())
+            {
+                start(std::move(waiting_.front()));
+                waiting_.pop_front();
+            }
+            if (!wait || !ready_.empty() || started_.size() == free_.size())
+                return submit(0);
+            submit(1);
+        }
+    }
+
+    std::size_t inFlight() const override
+    {
+        return started_.size() - free_.size() + waiting_.size();
+    }
+
+   private:
+    std::error_condition map(mapping& m, off_t const offset)
+    {
+        m.base = ::mmap(nullptr, m.length, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd_, offset);
+        if (m.base == MAP_FAILED)
+            return std::generic_category().default_error_condition(errno);
+        return std::error_condition();
+    }
+
+    static void unmap(mapping& m)
+    {
+        if (m.base != MAP_FAILED)
+            ::munmap(m.base, m.length);
+        m.base = MAP_FAILED;
+    }
+
+    // Queues a read in the ring, which has room for every free slot
+    void start(request r)
+    {
+        auto const i = free_.back();
+        free_.pop_back();
+        started_[i] = std::move(r);
+        auto const& s = started_[i];
+        unsigned const tail = *sqTail_;
+        unsigned const index = tail & *sqMask_;
+        auto& sqe = static_cast<detail::uring::sqe*>(sqes_.base)[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = detail::uring::OpReadv;
+        sqe.fd = s.fd;
+        sqe.off = s.pos;
+        sqe.addr = reinterpret_cast<std::uint64_t>(&s.iov);
+        sqe.len = 1;
+        sqe.user_data = i;
+        sqArray_[index] = index;
+        __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+        toSubmit_++;
+    }
+
+    // Hands the queued reads to the kernel, waiting for minComplete of
+    // those in flight to complete
+    void submit(unsigned const minComplete)
+    {
+        if (toSubmit_ == 0 && minComplete == 0)
+            return;
+        int const ret = ::syscall(__NR_io_uring_enter, fd_, toSubmit_,
+                                  minComplete,
+                                  minComplete ? detail::uring::EnterGetEvents : 0,
+                                  nullptr, 0);
+        if (ret >= 0)
+            toSubmit_ -= std::min<unsigned>(ret, toSubmit_);
+        // Busy with completions, or interrupted, so reap and try again
+        else if (errno != EAGAIN && errno != EBUSY && errno != EINTR)
+            breakRing(errno);
+    }
+
+    // Fails every read in flight with error, as the ring can't be used to
+    // submit or wait for them any more
+    void breakRing(int const error)
+    {
+        broken_ = error;
+        std::vector<bool> idle(started_.size());
+        for (auto const i : free_) idle[i] = true;
+        for (std::uint32_t i = 0; i < started_.size(); i++)
+            if (!idle[i])
+            {
+                fail(std::move(started_[i].done), error);
+                free_.push_back(i);
+            }
+        for (auto& r : waiting_) fail(std::move(r.done), error);
+        waiting_.clear();
+        toSubmit_ = 0;
+    }
+};
+#endif
+
+// The reader used for the reads of GetAsync: io_uring where it can be
+// used, and POSIX AIO otherwise.
+inline std::unique_ptr<AsyncReader> CreateAsyncReader(std::size_t const depth)
+{
+#ifdef KEYVADB_IO_URING
+    auto uring = std::make_unique<UringReader>(depth);
+    if (!uring->Open())
+        return uring;
+#endif
+    return std::make_unique<AioReader>(depth);
+}
+}  // namespace keyvadb
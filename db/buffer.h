@@ -1,7 +1,5 @@
 #pragma once
 
-#include <boost/optional.hpp>
-#include <boost/optional/optional_io.hpp>
 #include <boost/algorithm/hex.hpp>
 #include <boost/bimap.hpp>
 #include <boost/bimap/set_of.hpp>
@@ -11,26 +9,34 @@
 #include <limits>
 #include <string>
 #include <map>
+#include <memory>
 #include <ostream>
 #include <mutex>
 #include <algorithm>
 #include "db/key.h"
+#include "db/slice.h"
 #include "db/error.h"
+#include "db/crc32c.h"
 
 namespace keyvadb
 {
 // A threadsafe container for storing keys and values for the period before they
-// are committed to disk.
+// are committed to disk. Values are shared, so Get can hand them out without
+// copying and they stay valid after the buffer has moved on.
 template <std::uint32_t BITS>
 class Buffer
 {
    public:
+    using value_ptr = std::shared_ptr<std::string const>;
+
     enum class ValueState : std::uint8_t
     {
         Unprocessed,
+        Deleted,
         Evicted,
         NeedsCommitting,
         Committed,
+        Removed,
     };
 
     struct Value
@@ -42,7 +48,7 @@ class Buffer
 
         std::uint64_t offset;
         std::uint32_t length;
-        std::string value;
+        value_ptr value;
         ValueState status;
 
         bool ReadyForWriting() const
@@ -53,7 +59,7 @@ class Buffer
         friend bool operator<(Value const &lhs, Value const &rhs)
         {
             if (lhs.status == rhs.status && lhs.offset == rhs.offset)
-                return lhs.value < rhs.value;
+                return *lhs.value < *rhs.value;
             if (lhs.status == rhs.status)
                 return lhs.offset < rhs.offset;
             return lhs.status < rhs.status;
@@ -63,46 +69,67 @@ class Buffer
    private:
     using util = detail::KeyUtil<BITS>;
     using key_type = typename util::key_type;
-    using value_type = boost::optional<std::string>;
     using map_type = boost::bimap<boost::bimaps::set_of<key_type>,
                                   boost::bimaps::multiset_of<Value>>;
     using left_value_type = typename map_type::left_value_type;
-    using candidate_type = std::set<KeyValue<BITS>>;
+    using pending_type = std::map<key_type, Value>;
 
-    static const std::string emptyBufferValue;
+    static const value_ptr emptyBufferValue;
     static const std::map<ValueState, std::string> valueStates;
     static const std::uint32_t maxValueLength;
 
     map_type buf_;
+    // Puts and deletes for keys that are part of an ongoing flush.
+    // They are moved into buf_ by Purge.
+    pending_type pending_;
+    // Set once a flush has taken candidates, after which the values of
+    // keys in buf_ must not change until Purge.
+    bool flushing_ = false;
     mutable std::mutex mtx_;
 
    public:
-    value_type Get(std::string const &key) const
+    // A deleted key is returned as an empty value, as zero length values
+    // can't be added. Returns null if the key isn't in the buffer.
+    value_ptr Get(Slice const key) const
+    {
+        return Get(util::FromBytes(key));
+    }
+
+    value_ptr Get(key_type const &key) const
     {
         std::lock_guard<std::mutex> lock(mtx_);
-        auto v = buf_.left.find(util::FromBytes(key));
+        auto p = pending_.find(key);
+        if (p != pending_.end())
+            return p->second.value;
+        auto v = buf_.left.find(key);
         if (v != buf_.left.end() && v->second.status != ValueState::Evicted)
             // An Evicted key won't have an associated value
             return v->second.value;
-        return boost::none;
+        return value_ptr();
     }
 
-    std::size_t Add(std::string const &key, std::string const &value)
+    // Overwrites any existing value for key. The value is copied once, into
+    // the shared string the buffer keeps.
+    std::size_t Add(Slice const key, Slice const value)
     {
+        assert(value.length() <= maxValueLength);
+        // The length of the whole record in the values file
+        std::uint32_t length =
+            value.size() + 2 * sizeof(std::uint32_t) + (BITS / 8);
         auto k = util::FromBytes(key);
+        auto v = std::make_shared<std::string const>(value.data(),
+                                                     value.size());
         std::lock_guard<std::mutex> lock(mtx_);
+        return set(k, Value{0, length, std::move(v), ValueState::Unprocessed});
+    }
 
-        // Don't overwrite an existing key that might not be Unprocessed
-        if (buf_.left.find(k) == buf_.left.end())
-        {
-            assert(value.length() <= maxValueLength);
-            std::uint32_t length =
-                value.size() + sizeof(std::uint32_t) + (BITS / 8);
-            auto v = left_value_type(
-                k, Value{0, length, value, ValueState::Unprocessed});
-            buf_.left.insert(v);
-        }
-        return buf_.size();
+    // Adds a tombstone for key which is applied to the tree by the next
+    // flush.
+    std::size_t Delete(Slice const key)
+    {
+        auto k = util::FromBytes(key);
+        std::lock_guard<std::mutex> lock(mtx_);
+        return set(k, Value{0, 0, emptyBufferValue, ValueState::Deleted});
     }
 
     std::size_t AddEvictee(key_type const &key, std::uint64_t const offset,
@@ -116,12 +143,6 @@ class Buffer
         return buf_.size();
     }
 
-    void RemoveDuplicate(key_type const &key)
-    {
-        std::lock_guard<std::mutex> lock(mtx_);
-        buf_.left.erase(key);
-    }
-
     void SetOffset(key_type const &key, std::uint64_t const offset)
     {
         std::lock_guard<std::mutex> lock(mtx_);
@@ -133,6 +154,32 @@ class Buffer
             throw std::runtime_error("Bad SetOffset");
     }
 
+    // Marks a tombstone as applied to the tree, or as not applicable
+    // because the key doesn't exist.
+    void SetRemoved(key_type const &key)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = buf_.left.find(key);
+        assert(it != buf_.left.end() &&
+               it->second.status == ValueState::Deleted);
+        auto v = Value{0, 0, emptyBufferValue, ValueState::Removed};
+        if (!buf_.left.modify_data(it, boost::bimaps::_data = v))
+            throw std::runtime_error("Bad SetRemoved");
+    }
+
+    // Marks all tombstones greater than first and less than last as removed.
+    void RemoveTombstones(key_type const &first, key_type const &last)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (auto it = buf_.left.upper_bound(first),
+                  end = buf_.left.lower_bound(last);
+             it != end; ++it)
+            if (it->second.status == ValueState::Deleted)
+                buf_.left.modify_data(
+                    it, boost::bimaps::_data = Value{0, 0, emptyBufferValue,
+                                                     ValueState::Removed});
+    }
+
     bool Write(std::size_t const batchSize, std::vector<std::uint8_t> &wb)
     {
         std::lock_guard<std::mutex> lock(mtx_);
@@ -144,15 +191,21 @@ class Buffer
         // Add at least one key and value to the buffer.
         do
         {
+            // Length, CRC32C of the key and value, key, value
             wb.resize(pos + it->first.length);
             std::memcpy(&wb[pos], &it->first.length, sizeof(it->first.length));
             pos += sizeof(it->first.length);
-            auto b = util::ToBytes(it->second);
-            std::memcpy(&wb[pos], b.data(), b.size());
-            pos += b.size();
-            std::memcpy(&wb[pos], it->first.value.data(),
-                        it->first.value.size());
-            pos += it->first.value.size();
+            auto const crcPos = pos;
+            pos += sizeof(std::uint32_t);
+            util::ToBytes(it->second, reinterpret_cast<char *>(&wb[pos]));
+            pos += util::Bytes;
+            std::memcpy(&wb[pos], it->first.value->data(),
+                        it->first.value->size());
+            pos += it->first.value->size();
+            auto const crc = detail::Crc32c::Value(
+                &wb[crcPos + sizeof(std::uint32_t)],
+                pos - crcPos - sizeof(std::uint32_t));
+            std::memcpy(&wb[crcPos], &crc, sizeof(crc));
             auto v = Value{it->first.offset, it->first.length, it->first.value,
                            ValueState::Committed};
             if (!buf_.right.modify_key(it, boost::bimaps::_key = v))
@@ -164,6 +217,19 @@ class Buffer
         return true;
     }
 
+    // Calls f with the key of every value written by the current flush
+    template <class F>
+    void EachCommitted(F f) const
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::for_each(first(ValueState::NeedsCommitting),
+                      first(ValueState::Removed),
+                      [&f](typename map_type::right_value_type const &kv)
+                      {
+            f(kv.second);
+        });
+    }
+
     void Purge()
     {
         std::lock_guard<std::mutex> lock(mtx_);
@@ -172,28 +238,60 @@ class Buffer
             check->first.status == ValueState::NeedsCommitting)
             throw std::runtime_error("Bad Buffer Purge");
         buf_.right.erase(first(ValueState::Evicted), buf_.right.end());
+        for (auto const &kv : pending_)
+        {
+            auto it = buf_.left.find(kv.first);
+            if (it == buf_.left.end())
+                buf_.left.insert(left_value_type(kv.first, kv.second));
+            else if (!buf_.left.modify_data(it,
+                                            boost::bimaps::_data = kv.second))
+                throw std::runtime_error("Bad Buffer Purge");
+        }
+        pending_.clear();
+        flushing_ = false;
     }
 
+    // Appends to each sequence of KeyValue<BITS> in key order
+    template <class Sequence>
     void GetCandidates(key_type const &firstKey, key_type const &lastKey,
-                       candidate_type &candidates, candidate_type &evictions)
+                       Sequence &candidates, Sequence &evictions,
+                       Sequence &tombstones)
     {
         std::lock_guard<std::mutex> lock(mtx_);
-        std::for_each(lower(firstKey), upper(lastKey),
-                      [&candidates, &evictions](left_value_type const &kv)
-                      {
+        flushing_ = true;
+        std::for_each(
+            lower(firstKey), upper(lastKey),
+            [&candidates, &evictions, &tombstones](left_value_type const &kv)
+            {
+                auto keyValue = KeyValue<BITS>{kv.first, kv.second.offset,
+                                               kv.second.length};
+                if (kv.second.status == ValueState::Unprocessed)
+                    candidates.push_back(keyValue);
+                else if (kv.second.status == ValueState::Evicted)
+                    evictions.push_back(keyValue);
+                else if (kv.second.status == ValueState::Deleted)
+                    tombstones.push_back(keyValue);
+            });
+    }
 
-            if (kv.second.status == ValueState::Unprocessed)
-                candidates.emplace(KeyValue<BITS>{kv.first, kv.second.offset,
-                                                  kv.second.length});
-            else if (kv.second.status == ValueState::Evicted)
-                evictions.emplace(KeyValue<BITS>{kv.first, kv.second.offset,
-                                                 kv.second.length});
+    // Returns true if there are values or tombstones greater than first and
+    // less than last
+    bool ContainsRange(key_type const &first, key_type const &last) const
+    {
+        assert(first <= last);
+        std::lock_guard<std::mutex> lock(mtx_);
+        return std::any_of(lower(first), upper(last),
+                           [](left_value_type const &kv)
+                           {
+            return kv.second.status == ValueState::Unprocessed ||
+                   kv.second.status == ValueState::Evicted ||
+                   kv.second.status == ValueState::Deleted;
         });
     }
 
     // Returns true if there are values greater than first and less than
-    // last
-    bool ContainsRange(key_type const &first, key_type const &last) const
+    // last that need a place in the tree
+    bool ContainsInsertions(key_type const &first, key_type const &last) const
     {
         assert(first <= last);
         std::lock_guard<std::mutex> lock(mtx_);
@@ -209,12 +307,14 @@ class Buffer
     {
         std::lock_guard<std::mutex> lock(mtx_);
         buf_.clear();
+        pending_.clear();
+        flushing_ = false;
     }
 
     std::size_t Size() const
     {
         std::lock_guard<std::mutex> lock(mtx_);
-        return buf_.size();
+        return buf_.size() + pending_.size();
     }
 
     std::size_t ReadyForCommitting() const
@@ -237,6 +337,24 @@ class Buffer
     }
 
    private:
+    // Must be called with mtx_ held
+    std::size_t set(key_type const &key, Value const &value)
+    {
+        auto it = buf_.left.find(key);
+        if (it == buf_.left.end())
+            buf_.left.insert(left_value_type(key, value));
+        else if (!flushing_ && (it->second.status == ValueState::Unprocessed ||
+                                it->second.status == ValueState::Deleted))
+        {
+            if (!buf_.left.modify_data(it, boost::bimaps::_data = value))
+                throw std::runtime_error("Bad Buffer set");
+        }
+        else
+            // Key is being flushed, wait for the next one
+            pending_[key] = value;
+        return buf_.size() + pending_.size();
+    }
+
     typename map_type::left_const_iterator lower(key_type const &first) const
     {
         return buf_.left.upper_bound(first);
@@ -259,20 +377,23 @@ class Buffer
 };
 
 template <std::uint32_t BITS>
-const std::string Buffer<BITS>::emptyBufferValue;
+const typename Buffer<BITS>::value_ptr Buffer<BITS>::emptyBufferValue =
+    std::make_shared<std::string const>();
 
 template <std::uint32_t BITS>
 const std::uint32_t Buffer<BITS>::maxValueLength =
-    std::numeric_limits<std::uint32_t>::max() - sizeof(std::uint32_t) -
+    std::numeric_limits<std::uint32_t>::max() - 2 * sizeof(std::uint32_t) -
     (BITS / 8);
 
 template <std::uint32_t BITS>
 const std::map<typename Buffer<BITS>::ValueState, std::string>
     Buffer<BITS>::valueStates{
         {Buffer<BITS>::ValueState::Unprocessed, "Unprocessed"},
+        {Buffer<BITS>::ValueState::Deleted, "Deleted"},
         {Buffer<BITS>::ValueState::Evicted, "Evicted"},
         {Buffer<BITS>::ValueState::NeedsCommitting, "NeedsCommitting"},
         {Buffer<BITS>::ValueState::Committed, "Committed"},
+        {Buffer<BITS>::ValueState::Removed, "Removed"},
     };
 
 }  // namespace keyvadb
@@ -7,12 +7,13 @@
 #include <utility>
 #include <algorithm>
 #include <mutex>
+#include <atomic>
 #include "db/key.h"
 #include "db/node.h"
 
 namespace keyvadb
 {
-template <std::uint32_t BITS>
+template <std::uint32_t BITS, std::uint32_t BLOCK_SIZE = 0>
 class NodeCache
 {
     using util = detail::KeyUtil<BITS>;
@@ -31,18 +32,20 @@ class NodeCache
         }
     };
 
-    using node_type = Node<BITS>;
+    using node_type = Node<BITS, BLOCK_SIZE>;
     using node_ptr = std::shared_ptr<node_type>;
     using store_type = boost::bimaps::bimap<boost::bimaps::set_of<CacheKey>,
                                             boost::bimaps::list_of<node_ptr>>;
     using store_value = typename store_type::value_type;
     using index_type = std::unordered_map<std::uint64_t, CacheKey>;
 
+    // Counters are atomic so that they can be read without the lock
     std::uint64_t maxSize_ = 0;
-    std::uint64_t hits_ = 0;
-    std::uint64_t misses_ = 0;
-    std::uint64_t inserts_ = 0;
-    std::uint64_t updates_ = 0;
+    std::atomic_uint_fast64_t size_{0};
+    std::atomic_uint_fast64_t hits_{0};
+    std::atomic_uint_fast64_t misses_{0};
+    std::atomic_uint_fast64_t inserts_{0};
+    std::atomic_uint_fast64_t updates_{0};
     store_type nodes_;
     index_type index_;
     std::mutex lock_;
@@ -63,6 +66,7 @@ class NodeCache
         updates_ = 0;
         nodes_.clear();
         index_.clear();
+        size_ = 0;
     }
 
     void Add(node_ptr const& node)
@@ -70,28 +74,28 @@ class NodeCache
         if (maxSize_ == 0)
             return;
         std::lock_guard<std::mutex> lock(lock_);
-        auto keyPair = CacheKey{node->Level(), node->First()};
-        auto it = nodes_.left.find(keyPair);
-        if (it != nodes_.left.end())
-        {
-            updates_++;
-            assert(it->second->Id() == node->Id());
-            it->second = node;
-            nodes_.right.relocate(nodes_.right.end(), nodes_.project_right(it));
-        }
-        else
-        {
-            inserts_++;
-            if (nodes_.size() == maxSize_)
-            {
-                auto evictee = nodes_.right.begin();
-                index_.erase(evictee->first->Id());
-                nodes_.right.erase(evictee);
-            }
-            assert(nodes_.size() <= maxSize_ && index_.size() <= maxSize_);
-            nodes_.insert(store_value(keyPair, node));
-            index_[node->Id()] = keyPair;
-        }
+        add(node);
+    }
+
+    // Adds a node read from the store, unless its id is already cached or
+    // version has changed since expected was taken as the read started.
+    // version is odd while nodes are being written, and is changed before
+    // they are added, so a node written since the read is never replaced
+    // by the older one read. Returns the cached node if there was one, or
+    // node.
+    node_ptr AddRead(node_ptr const& node,
+                     std::atomic_uint_fast64_t const& version,
+                     std::uint64_t const expected)
+    {
+        if (maxSize_ == 0)
+            return node;
+        std::lock_guard<std::mutex> lock(lock_);
+        auto found = index_.find(node->Id());
+        if (found != index_.end())
+            return nodes_.left.at(found->second);
+        if (expected % 2 == 0 && version == expected)
+            add(node);
+        return node;
     }
 
     node_ptr GetById(std::uint64_t const id)
@@ -130,6 +134,21 @@ class NodeCache
         return node_ptr();
     }
 
+    // Calls f with every node, least recently used first
+    template <class F>
+    void Each(F f)
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        for (auto const& node : nodes_.right) f(node.first);
+    }
+
+    std::uint64_t MaxSize() const { return maxSize_; }
+    std::uint64_t Size() const { return size_; }
+    std::uint64_t Hits() const { return hits_; }
+    std::uint64_t Misses() const { return misses_; }
+    std::uint64_t Inserts() const { return inserts_; }
+    std::uint64_t Updates() const { return updates_; }
+
     std::string ToString()
     {
         std::stringstream ss;
@@ -150,5 +169,34 @@ class NodeCache
         stream << cache.ToString();
         return stream;
     }
+
+   private:
+    // Must be called with lock_ held
+    void add(node_ptr const& node)
+    {
+        auto keyPair = CacheKey{node->Level(), node->First()};
+        auto it = nodes_.left.find(keyPair);
+        if (it != nodes_.left.end())
+        {
+            updates_++;
+            assert(it->second->Id() == node->Id());
+            it->second = node;
+            nodes_.right.relocate(nodes_.right.end(), nodes_.project_right(it));
+        }
+        else
+        {
+            inserts_++;
+            if (nodes_.size() == maxSize_)
+            {
+                auto evictee = nodes_.right.begin();
+                index_.erase(evictee->first->Id());
+                nodes_.right.erase(evictee);
+            }
+            assert(nodes_.size() <= maxSize_ && index_.size() <= maxSize_);
+            nodes_.insert(store_value(keyPair, node));
+            index_[node->Id()] = keyPair;
+            size_ = nodes_.size();
+        }
+    }
 };
 }  // namespace keyvadb
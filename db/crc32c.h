@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <array>
+
+namespace keyvadb
+{
+namespace detail
+{
+// CRC32C (Castagnoli), the checksum used for the on-disk formats. Uses the
+// SSE4.2 crc32 instruction when the CPU has it, which checksums a 4KB node
+// in under a microsecond, and a table otherwise.
+class Crc32c
+{
+    using table_type = std::array<std::uint32_t, 256>;
+
+   public:
+    static std::uint32_t Extend(std::uint32_t crc, void const* data,
+                                std::size_t const length)
+    {
+        auto p = static_cast<std::uint8_t const*>(data);
+#if defined(__x86_64__) && defined(__GNUC__)
+        static const bool hardware = __builtin_cpu_supports("sse4.2");
+        if (hardware)
+            return ~extendHardware(~crc, p, length);
+#endif
+        return ~extendTable(~crc, p, length);
+    }
+
+    static std::uint32_t Value(void const* data, std::size_t const length)
+    {
+        return Extend(0, data, length);
+    }
+
+    // Only for testing the fallback against the hardware
+    static std::uint32_t TableValue(void const* data, std::size_t const length)
+    {
+        return ~extendTable(~0U, static_cast<std::uint8_t const*>(data),
+                            length);
+    }
+
+   private:
+    static std::uint32_t extendTable(std::uint32_t crc, std::uint8_t const* p,
+                                     std::size_t const length)
+    {
+        static const table_type table = makeTable();
+        for (std::size_t i = 0; i < length; i++)
+            crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+        return crc;
+    }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    __attribute__((target("sse4.2"))) static std::uint32_t extendHardware(
+        std::uint32_t const crc, std::uint8_t const* p, std::size_t length)
+    {
+        std::uint64_t c = crc;
+        for (; length >= sizeof(std::uint64_t);
+             length -= sizeof(std::uint64_t), p += sizeof(std::uint64_t))
+        {
+            std::uint64_t word;
+            std::memcpy(&word, p, sizeof(word));
+            c = __builtin_ia32_crc32di(c, word);
+        }
+        auto c32 = static_cast<std::uint32_t>(c);
+        for (; length > 0; length--, p++)
+            c32 = __builtin_ia32_crc32qi(c32, *p);
+        return c32;
+    }
+#endif
+
+    static table_type makeTable()
+    {
+        table_type table;
+        for (std::uint32_t i = 0; i < table.size(); i++)
+        {
+            std::uint32_t crc = i;
+            for (int j = 0; j < 8; j++)
+                crc = (crc >> 1) ^ (0x82F63B78 & (0U - (crc & 1)));
+            table[i] = crc;
+        }
+        return table;
+    }
+};
+}  // namespace detail
+}  // namespace keyvadb
@@ -1,30 +1,75 @@
 #pragma once
 
-#include <boost/optional.hpp>
-#include <boost/algorithm/hex.hpp>
 #include <string>
 #include <map>
+#include <vector>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
 #include <system_error>
+#include "db/slice.h"
 #include "db/store.h"
 #include "db/buffer.h"
 #include "db/tree.h"
 #include "db/journal.h"
 #include "db/log.h"
+#include "db/stats.h"
+#include "db/trace.h"
+#include "db/async.h"
+#include "db/warmup.h"
+#include "db/value_cache.h"
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#define KEYVADB_COROUTINES 1
+#endif
 
 namespace keyvadb
 {
+// Which reads from disk verify the CRC32C stored with what they read
+enum class ChecksumPolicy
+{
+    None,
+    // Nodes are verified when read into the cache
+    Nodes,
+    // Values are verified on every Get from the values file
+    All
+};
+
 struct Options
 {
-    // Size of a node on disk, which determines the degree of the node.
+    // Size of a node on disk, which determines the degree of the node. A
+    // DB whose BLOCK_SIZE template argument isn't zero can only use that.
     std::uint32_t blockSize = 4096;
 
+    // Size of a node on disk for each level of the tree, starting at the
+    // root, with deeper levels using the last size. Larger interior nodes
+    // make the tree shallower. Empty uses blockSize for every level. Only
+    // used when creating a keys file, an existing file keeps its own sizes.
+    std::vector<std::uint32_t> levelBlockSizes;
+
+    // Checksums are always written, this chooses which are verified on read.
+    ChecksumPolicy verifyChecksums = ChecksumPolicy::All;
+
+    // Read and write the keys file with O_DIRECT, bypassing the page cache,
+    // so that nodes are only cached once, decoded, and the memory used is
+    // just cacheSize nodes. Block sizes should be multiples of 4096 or
+    // every node write has to read its pages first.
+    bool directIO = false;
+
+    // Read values through a read-only mapping of the values file, saving
+    // a pread per Get. Best for read-mostly DBs whose values file fits in
+    // the address space, which is mapped 1GB at a time.
+    bool mmapValues = false;
+
     // Number of nodes to cache in memory.
     // Default is 1GB of memory for default blockSize.
     std::uint64_t cacheSize = 1024 * 1024 * 1024 / 4096;
 
+    // Bytes of values to cache in memory, by their offset in the values
+    // file. Zero disables the value cache.
+    std::uint64_t valueCacheSize = 0;
+
     // Approximate maximum size of each write in the flush process.
     std::uint64_t writeBufferSize = 1024 * 1024;
 
@@ -36,21 +81,87 @@ struct Options
 
     // Path and name of the file to store the keys and values.
     std::string valueFileName = "db.values";
+
+    // Path and name of the file to save the key filter to on close.
+    std::string filterFileName = "db.filter";
+
+    // Path and name of the file to save the ids of the cached nodes to on
+    // close. They are read back into the cache by a background thread after
+    // open. Empty disables this.
+    std::string cacheFileName = "db.cache";
+
+    // Bits of memory per committed key used by the filter which answers
+    // most lookups for missing keys without reading the tree. Zero disables
+    // the filter.
+    std::uint32_t filterBitsPerKey = 10;
+
+    // Called from the flush thread after every flush, including those with
+    // nothing to do, with a breakdown of where the time went.
+    std::function<void(FlushReport const &)> flushCallback;
+
+    // If not empty, every flush which does some work is written to this
+    // file in the Chrome trace event format.
+    std::string traceFileName;
+
+    // A PartitionedDB splits the key space into 2^partitionBits partitions
+    // by the top bits of each key, with one DB per partition. A DB only
+    // accepts keys from its own partition. At most 8 bits are supported.
+    std::uint32_t partitionBits = 0;
+    std::uint32_t partition = 0;
+
+    // The most reads that GetAsync has in flight at once, with io_uring
+    // where the kernel allows it and POSIX AIO otherwise. Zero makes
+    // GetAsync call Get on the calling thread. A PartitionedDB shares one
+    // reader between its partitions.
+    std::uint32_t asyncDepth = 256;
 };
 
-template <std::uint32_t BITS, class Log = NullLog>
+namespace detail
+{
+// Keys are big-endian, so the partition is the top bits of the first byte
+inline std::uint32_t PartitionOf(Slice const key,
+                                 std::uint32_t const partitionBits)
+{
+    if (partitionBits == 0)
+        return 0;
+    return static_cast<std::uint8_t>(key[0]) >> (8 - partitionBits);
+}
+}  // namespace detail
+
+// A non-zero BLOCK_SIZE fixes the size of every node at compile time, so
+// that the nodes hold their arrays inline and are searched to a constant
+// bound. Open fails with wrong_block_size if the options or an existing
+// keys file have any other block size. Zero takes them from the options.
+template <std::uint32_t BITS, class Log = NullLog,
+          std::uint32_t BLOCK_SIZE = 0>
 class DB
 {
     using util = detail::KeyUtil<BITS>;
-    using key_store_ptr = std::unique_ptr<KeyStore<BITS>>;
+    using key_type = typename util::key_type;
+    using key_store_ptr = std::unique_ptr<KeyStore<BITS, BLOCK_SIZE>>;
     using value_store_ptr = std::unique_ptr<ValueStore<BITS>>;
     using key_value_type = KeyValue<BITS>;
     using buffer_type = Buffer<BITS>;
-    using journal_type = Journal<BITS>;
-    using tree_type = Tree<BITS>;
-    using cache_type = NodeCache<BITS>;
+    using journal_type = Journal<BITS, BLOCK_SIZE>;
+    using tree_type = Tree<BITS, BLOCK_SIZE>;
+    using cache_type = NodeCache<BITS, BLOCK_SIZE>;
+    using filter_type = KeyFilter<BITS>;
+    using node_ptr = typename tree_type::node_ptr;
+    using file_ptr = std::unique_ptr<RandomAccessFile>;
     using key_value_func =
-        std::function<void(std::string const &, std::string const &)>;
+        std::function<void(Slice, Slice)>;
+    using get_callback =
+        std::function<void(std::error_condition, std::string const &)>;
+    using clock = StatsRecorder::clock;
+
+    // A GetAsync waiting for a read
+    struct lookup
+    {
+        key_type key;
+        get_callback callback;
+        clock::time_point start;
+    };
+    using lookup_ptr = std::shared_ptr<lookup>;
 
     enum
     {
@@ -62,45 +173,109 @@ class DB
     key_store_ptr keys_;
     value_store_ptr values_;
     cache_type cache_;
+    ValueCache valueCache_;
     tree_type tree_;
     buffer_type buffer_;
-    std::atomic_uint_fast64_t buffer_hits_;
-    std::atomic_uint_fast64_t key_misses_;
-    std::atomic_uint_fast64_t value_hits_;
-    std::atomic_uint_fast64_t value_misses_;
+    filter_type filter_;
+    file_ptr filterFile_;
+    bool filterOpen_;
+    file_ptr cacheFile_;
+    bool cacheOpen_;
+    StatsRecorder stats_;
+    std::unique_ptr<TraceWriter> trace_;
+    std::uint64_t flushes_;
+    // Odd while a flush is writing nodes, so that GetAsync never caches a
+    // node it read before a flush rewrote it
+    std::atomic_uint_fast64_t nodeWrites_;
+    // Held by each flush, and by the warm-up thread while it reads nodes,
+    // so that it never reads a node which is being written
+    std::mutex flushMutex_;
     std::atomic<bool> close_;
     std::thread thread_;
+    std::shared_ptr<AsyncReader> reads_;
+    // Whether reads_ was made by this DB, and so is drained by it
+    bool ownsReads_;
+    std::atomic<bool> stopWarmup_;
+    std::thread warmup_;
 
    public:
+    // A value which stays valid for as long as it is held, whatever
+    // happens to the DB
+    using value_ptr = ValueCache::value_ptr;
+
     DB(Options const &options)
+        : DB(options, options.asyncDepth > 0
+                          ? CreateAsyncReader(options.asyncDepth)
+                          : nullptr)
+    {
+        ownsReads_ = reads_ != nullptr;
+    }
+
+    // Uses reads, which may be shared with other DBs, for GetAsync. Its
+    // owner must poll it until nothing is pending before destroying the DB.
+    DB(Options const &options, std::shared_ptr<AsyncReader> reads)
         : options_(options),
           log_(Log{}),
-          keys_(CreateKeyStore<BITS>(options.keyFileName, options.blockSize)),
-          values_(CreateValueStore<BITS>(options.valueFileName)),
+          keys_(CreateKeyStore<BITS, BLOCK_SIZE>(
+              options.keyFileName, levelBlockSizes(options),
+              options.verifyChecksums != ChecksumPolicy::None,
+              options.directIO)),
+          values_(CreateValueStore<BITS>(
+              options.valueFileName,
+              options.verifyChecksums == ChecksumPolicy::All,
+              options.mmapValues)),
           cache_(),
-          tree_(*keys_, cache_),
-          buffer_hits_(0),
-          key_misses_(0),
-          value_hits_(0),
-          value_misses_(0),
+          tree_(*keys_, cache_, firstKey(options), lastKey(options)),
+          filter_(options.filterBitsPerKey),
+          filterFile_(std::make_unique<PosixRandomAccessFile>(
+              options.filterFileName)),
+          filterOpen_(false),
+          cacheFile_(std::make_unique<PosixRandomAccessFile>(
+              options.cacheFileName)),
+          cacheOpen_(false),
+          trace_(options.traceFileName.empty()
+                     ? nullptr
+                     : std::make_unique<TraceWriter>(options.traceFileName)),
+          flushes_(0),
+          nodeWrites_(0),
           close_(false),
-          thread_(&DB::flushThread, this)
+          reads_(std::move(reads)),
+          ownsReads_(false),
+          stopWarmup_(false)
     {
         cache_.SetMaxSize(options.cacheSize);
+        valueCache_.SetMaxBytes(options.valueCacheSize);
+        // Started last, as it flushes using every other member
+        thread_ = std::thread(&DB::flushThread, this);
     }
     DB(DB const &) = delete;
     DB &operator=(DB const &) = delete;
 
     ~DB()
     {
+        // Finish every outstanding GetAsync first
+        if (ownsReads_)
+            while (reads_->Pending() > 0) reads_->Poll(true);
+        stopWarmup();
         close_ = true;
         thread_.join();
+        if (filterOpen_)
+            if (auto err = saveFilter())
+                if (log_.error)
+                    log_.error << "Saving filter: " << err.message();
+        if (cacheOpen_)
+            if (auto err = saveCache())
+                if (log_.error)
+                    log_.error << "Saving cache: " << err.message();
+        auto start = clock::now();
         if (auto err = values_->Close())
             if (log_.error)
                 log_.error << "Closing values: " << err.message();
+        start = stats_.RecordSince(StatsRecorder::SyncLatency, start);
         if (auto err = keys_->Close())
             if (log_.error)
                 log_.error << "Closing keys: " << err.message();
+        stats_.RecordSince(StatsRecorder::SyncLatency, start);
     }
 
     // Not threadsafe
@@ -110,13 +285,30 @@ class DB
             return err;
         if (auto err = tree_.Init(true))
             return err;
-        return values_->Open();
+        if (auto err = values_->Open())
+            return err;
+        if (values_->Size() < keys_->CommittedValuesSize())
+            return make_error_condition(db_error::truncated);
+        if (log_.info &&
+            (keys_->Size() != keys_->CommittedSize() ||
+             values_->Size() != keys_->CommittedValuesSize()))
+            log_.info << "Files have changed since flush "
+                      << keys_->FlushSequence();
+        if (filter_.Enabled())
+            if (auto err = loadFilter())
+                return err;
+        if (!options_.cacheFileName.empty())
+            return startWarmup();
+        return std::error_condition();
     }
 
     // Not threadsafe
     std::error_condition Clear()
     {
+        stopWarmup();
         buffer_.Clear();
+        filter_.Clear();
+        valueCache_.Clear();
         if (auto err = keys_->Clear())
             return err;
         if (auto err = tree_.Init(true))
@@ -124,39 +316,93 @@ class DB
         return values_->Clear();
     }
 
-    std::error_condition Get(std::string const &key, std::string *value)
+    std::error_condition Get(Slice const key, std::string *value)
     {
         if (key.length() != key_length)
             return db_error::key_wrong_length;
-        if (auto v = buffer_.Get(key))
-        {
-            if (v->length() == 0)
-                throw std::runtime_error("Bad Get");
-            value->assign(*v);
-            buffer_hits_++;
-            return std::error_condition();
-        }
-        // Value must be on disk
-        key_value_type kv;
+        auto start = clock::now();
+        auto const k = util::FromBytes(key);
         std::error_condition err;
-        std::tie(kv, err) = tree_.Get(util::FromBytes(key));
-        if (err)
+        value_ptr found;
+        if (getFromMemory(k, found, err))
         {
-            key_misses_++;
-            return err;
+            if (found)
+                value->assign(*found);
         }
-        if (kv.length == 0)
-            throw std::runtime_error("Bad length for: " +
-                                     boost::algorithm::hex(key));
-        err = values_->Get(kv.offset, kv.length, value);
-        if (err)
-            value_misses_++;
         else
-            value_hits_++;
+            err = getFromDisk(k, value);
+        recordGet(start);
         return err;
     }
 
-    std::error_condition Put(std::string const &key, std::string const &value)
+    // As Get, but without copying the value. It points into the buffer,
+    // the value cache or a fresh read, and is released by the caller.
+    std::error_condition Get(Slice const key, value_ptr *value)
+    {
+        if (key.length() != key_length)
+            return db_error::key_wrong_length;
+        auto start = clock::now();
+        auto const k = util::FromBytes(key);
+        std::error_condition err;
+        if (!getFromMemory(k, *value, err))
+            err = getFromDisk(k, value);
+        recordGet(start);
+        return err;
+    }
+
+    // Calls callback with what Get would return, without the caller
+    // waiting for disk reads. Keys in the buffer or rejected by the filter
+    // call back before GetAsync returns. For the rest, the lookup descends
+    // through the cached nodes, and each node or value it has to read from
+    // disk is read without waiting, the lookup carrying on from Poll when
+    // the read completes. So one thread can keep many lookups in flight,
+    // up to asyncDepth reads at once. GetAsync and Poll must only be called
+    // from one thread at a time, which is the thread that the callbacks
+    // run on, while Get, Put and Delete can still be called from any
+    // thread. The DB finishes outstanding lookups when it is destroyed.
+    void GetAsync(Slice const key, get_callback callback)
+    {
+        std::string value;
+        if (!reads_)
+        {
+            auto err = Get(key, &value);
+            return callback(err, value);
+        }
+        if (key.length() != key_length)
+            return callback(make_error_condition(db_error::key_wrong_length),
+                            value);
+        auto start = clock::now();
+        auto const k = util::FromBytes(key);
+        std::error_condition err;
+        value_ptr found;
+        if (getFromMemory(k, found, err))
+        {
+            recordGet(start);
+            return callback(err, found ? *found : value);
+        }
+        auto l =
+            std::make_shared<lookup>(lookup{k, std::move(callback), start});
+        auto node = cache_.Get(k);
+        // Only found by its id, as no key is strictly inside its bounds
+        if (!node)
+            node = cache_.GetById(keys_->RootId());
+        if (node)
+            return descend(l, node);
+        readNodeAsync(l, keys_->RootId(), 0);
+    }
+
+    // Calls back the GetAsync lookups whose reads have completed, first
+    // waiting for one if wait is set and there are none. Returns the
+    // number of reads completed, and zero once nothing is pending.
+    std::size_t Poll(bool const wait = false)
+    {
+        return reads_ ? reads_->Poll(wait) : 0;
+    }
+
+    // GetAsync lookups waiting for a read
+    std::size_t Pending() const { return reads_ ? reads_->Pending() : 0; }
+
+    std::error_condition Put(Slice const key, Slice const value)
     {
         if (key.length() != key_length)
             return db_error::key_wrong_length;
@@ -164,32 +410,445 @@ class DB
             return db_error::value_too_long;
         if (value.size() == 0)
             return db_error::zero_length_value;
-        buffer_.Add(key, value);
+        if (!inPartition(key))
+            return db_error::wrong_partition;
+        auto start = clock::now();
+        auto size = buffer_.Add(key, value);
         // if ( buffer_.Add(key, value) >10000)
         // naive rate limiter to stop the buffer growing too fast
         // Consider: http://en.wikipedia.org/wiki/Token_bucket
         // std::this_thread::sleep_for(std::chrono::microseconds(10));
+        stats_.RecordSince(StatsRecorder::PutLatency, start);
+        stats_.Record(StatsRecorder::BufferOccupancy, size);
+        stats_.Add(StatsRecorder::Puts);
+        return std::error_condition();
+    }
+
+    // Deletes are as cheap as puts. The key is removed from the tree by the
+    // next flush.
+    std::error_condition Delete(Slice const key)
+    {
+        if (key.length() != key_length)
+            return db_error::key_wrong_length;
+        if (!inPartition(key))
+            return db_error::wrong_partition;
+        stats_.Record(StatsRecorder::BufferOccupancy, buffer_.Delete(key));
+        stats_.Add(StatsRecorder::Deletes);
         return std::error_condition();
     }
 
-    // Returns keys and values in insertion order
+    // Returns keys and values in insertion order, including values which
+    // have since been overwritten or deleted.
     std::error_condition Each(key_value_func f) { return values_->Each(f); }
 
+    // Bytes in the values file which are no longer referenced and could be
+    // reclaimed by compaction. Not persisted across restarts.
+    std::uint64_t FreedBytes() const
+    {
+        return stats_.Get(StatsRecorder::FreedBytes);
+    }
+
+    // Cheap enough to be called every second from a monitoring thread.
+    Stats GetStats() const
+    {
+        Stats stats;
+        stats_.Snapshot(stats);
+        stats.bufferSize = buffer_.Size();
+        stats.cacheSize = cache_.Size();
+        stats.cacheHits = cache_.Hits();
+        stats.cacheMisses = cache_.Misses();
+        stats.cacheInserts = cache_.Inserts();
+        stats.cacheUpdates = cache_.Updates();
+        stats.valueCacheSize = valueCache_.Bytes();
+        stats.valueCacheHits = valueCache_.Hits();
+        stats.valueCacheMisses = valueCache_.Misses();
+        stats.valueCacheRejections = valueCache_.Rejections();
+        return stats;
+    }
+
    private:
+    static void checkPartition(Options const &options)
+    {
+        if (options.partitionBits > 8 ||
+            options.partition >= (1U << options.partitionBits))
+            throw std::invalid_argument("Bad partition");
+    }
+
+    // The root of a partition spans just its share of the key space. Root
+    // keys must lie strictly between first and last, so the bounds of
+    // adjacent partitions overlap.
+    static key_type firstKey(Options const &options)
+    {
+        checkPartition(options);
+        if (options.partition == 0)
+            return tree_type::FirstRootKey();
+        return (key_type(options.partition)
+                << (BITS - options.partitionBits)) - 1;
+    }
+
+    static key_type lastKey(Options const &options)
+    {
+        checkPartition(options);
+        if (options.partition + 1 == (1U << options.partitionBits))
+            return tree_type::LastRootKey();
+        return key_type(options.partition + 1)
+               << (BITS - options.partitionBits);
+    }
+
+    static std::vector<std::uint32_t> levelBlockSizes(Options const &options)
+    {
+        if (options.levelBlockSizes.empty())
+            return {options.blockSize};
+        return options.levelBlockSizes;
+    }
+
+    bool inPartition(Slice const key) const
+    {
+        return detail::PartitionOf(key, options_.partitionBits) ==
+               options_.partition;
+    }
+
+    void recordGet(clock::time_point const start)
+    {
+        stats_.RecordSince(StatsRecorder::GetLatency, start);
+        stats_.Add(StatsRecorder::Gets);
+    }
+
+    // True if the buffer or the filter answered, with the result in err
+    // and any value found in value
+    bool getFromMemory(key_type const &key, value_ptr &value,
+                       std::error_condition &err)
+    {
+        if (auto v = buffer_.Get(key))
+        {
+            stats_.Add(StatsRecorder::BufferHits);
+            // Key has been deleted
+            if (v->length() == 0)
+                err = db_error::key_not_found;
+            else
+                value = std::move(v);
+            return true;
+        }
+        if (!filter_.MayContain(key))
+        {
+            stats_.Add(StatsRecorder::FilterNegatives);
+            stats_.Add(StatsRecorder::KeyMisses);
+            err = db_error::key_not_found;
+            return true;
+        }
+        return false;
+    }
+
+    std::error_condition getFromDisk(key_type const &key, std::string *value)
+    {
+        key_value_type kv;
+        if (auto err = find(key, kv))
+            return err;
+        if (valueCache_.Enabled())
+        {
+            value_ptr v;
+            auto err = readValue(kv, v);
+            if (!err)
+                value->assign(*v);
+            return err;
+        }
+        auto err = values_->Get(kv.offset, kv.length, value);
+        stats_.Add(err ? StatsRecorder::ValueMisses : StatsRecorder::ValueHits);
+        return err;
+    }
+
+    std::error_condition getFromDisk(key_type const &key, value_ptr *value)
+    {
+        key_value_type kv;
+        if (auto err = find(key, kv))
+            return err;
+        return readValue(kv, *value);
+    }
+
+    // Looks up where key's value is in the values file
+    std::error_condition find(key_type const &key, key_value_type &kv)
+    {
+        std::error_condition err;
+        std::tie(kv, err) = tree_.Get(key);
+        if (err)
+        {
+            stats_.Add(StatsRecorder::KeyMisses);
+            return err;
+        }
+        if (kv.length == 0)
+            throw std::runtime_error("Bad length for: " + util::ToHex(key));
+        return err;
+    }
+
+    // Reads through the value cache
+    std::error_condition readValue(key_value_type const &kv, value_ptr &value)
+    {
+        value = valueCache_.Get(kv.offset);
+        if (value)
+        {
+            stats_.Add(StatsRecorder::ValueHits);
+            return std::error_condition();
+        }
+        auto str = std::make_shared<std::string>();
+        if (auto err = values_->Get(kv.offset, kv.length, str.get()))
+        {
+            stats_.Add(StatsRecorder::ValueMisses);
+            return err;
+        }
+        stats_.Add(StatsRecorder::ValueHits);
+        value = std::move(str);
+        valueCache_.Add(kv.offset, value);
+        return std::error_condition();
+    }
+
+    // Carries a lookup down from node until it needs a node which isn't
+    // cached, or the value, and starts reading it
+    void descend(lookup_ptr const &l, node_ptr node)
+    {
+        for (;;)
+        {
+            key_value_type kv;
+            std::uint64_t cid;
+            if (auto err = tree_.Search(node, l->key, kv, cid))
+            {
+                stats_.Add(StatsRecorder::KeyMisses);
+                return finish(*l, err, std::string());
+            }
+            if (cid == EmptyChild)
+            {
+                if (kv.length == 0)
+                    throw std::runtime_error("Bad length for: " +
+                                             util::ToHex(l->key));
+                return readValueAsync(l, kv);
+            }
+            auto const level = node->Level() + 1;
+            node = cache_.GetById(cid);
+            if (!node)
+                return readNodeAsync(l, cid, level);
+        }
+    }
+
+    void readNodeAsync(lookup_ptr const &l, std::uint64_t const id,
+                       std::uint32_t const level)
+    {
+        std::uint64_t const writes = nodeWrites_;
+        keys_->GetAsync(*reads_, id, level,
+                        [this, l, writes](
+                            std::pair<node_ptr, std::error_condition> result)
+                        {
+                            if (result.second)
+                            {
+                                stats_.Add(StatsRecorder::KeyMisses);
+                                return finish(*l, result.second,
+                                              std::string());
+                            }
+                            // A node cached since, or read from before a
+                            // flush, carries on this lookup but isn't
+                            // cached over what the flush wrote
+                            descend(l, cache_.AddRead(result.first,
+                                                      nodeWrites_, writes));
+                        });
+    }
+
+    void readValueAsync(lookup_ptr const &l, key_value_type const &kv)
+    {
+        if (auto v = valueCache_.Get(kv.offset))
+        {
+            stats_.Add(StatsRecorder::ValueHits);
+            return finish(*l, std::error_condition(), *v);
+        }
+        auto const offset = kv.offset;
+        auto value = std::make_shared<std::string>();
+        values_->GetAsync(*reads_, offset, kv.length, value.get(),
+                          [this, l, offset, value](std::error_condition err)
+                          {
+                              stats_.Add(err ? StatsRecorder::ValueMisses
+                                             : StatsRecorder::ValueHits);
+                              if (!err && valueCache_.Enabled())
+                                  valueCache_.Add(offset, value);
+                              if (err)
+                                  value->clear();
+                              finish(*l, err, *value);
+                          });
+    }
+
+    void finish(lookup const &l, std::error_condition const err,
+                std::string const &value)
+    {
+        recordGet(l.start);
+        l.callback(err, value);
+    }
+
     std::error_condition flush()
     {
-        journal_type journal(buffer_, *values_);
+        std::lock_guard<std::mutex> lock(flushMutex_);
+        journal_type journal(buffer_, *values_,
+                             filter_.Enabled() ? &filter_ : nullptr);
+        auto &report = journal.Report();
+        report.sequence = flushes_++;
         if (auto err = journal.Process(tree_))
             return err;
+        if (auto err = journal.WriteValues(options_.writeBufferSize))
+            return err;
+        nodeWrites_++;
+        auto err = journal.WriteNodes(tree_);
+        nodeWrites_++;
+        if (err)
+            return err;
+        if (!report.Empty())
+        {
+            {
+                ScopedTimer timer(report, "ValueStore::Sync");
+                if (auto err = values_->Sync())
+                    return err;
+            }
+            ScopedTimer timer(report, "KeyStore::Commit");
+            if (auto err = keys_->Commit(values_->Size()))
+                return err;
+        }
+        journal.Finish();
+        record(report);
+        if (log_.info && !report.Empty())
+            log_.info << report.ToString();
+        if (log_.debug && !report.Empty())
+            log_.debug << GetStats().ToString();
+        if (trace_ && !report.Empty())
+            trace_->Write(report);
+        if (options_.flushCallback)
+            options_.flushCallback(report);
+        return std::error_condition();
+    }
+
+    std::error_condition loadFilter()
+    {
+        if (auto err = filterFile_->Open())
+            return err;
+        filterOpen_ = true;
+        bool loaded;
+        std::error_condition err;
+        std::tie(loaded, err) =
+            filter_.Load(*filterFile_, keys_->Size(), values_->Size());
+        if (err || loaded)
+            return err;
+        // Stale or missing, so rebuild from every key in the tree
         if (log_.info)
-            log_.info << "Flushing: " << buffer_.ReadyForCommitting() << "/"
-                      << buffer_.Size() << " keys into " << journal.Size()
-                      << " nodes Buffer hits: " << buffer_hits_
-                      << " Key misses: " << key_misses_
-                      << " Value Hits: " << value_hits_
-                      << " Value Misses: " << value_misses_ << " Cache "
-                      << cache_.ToString();
-        return journal.Commit(tree_, options_.writeBufferSize);
+            log_.info << "Rebuilding filter";
+        filter_.Clear();
+        return tree_.Walk([this](node_ptr const &node, std::uint32_t)
+                          {
+                              for (std::size_t i = node->EmptyKeyCount();
+                                   i < node->MaxKeys(); i++)
+                                  if (!node->IsSynthetic(i))
+                                      filter_.Add(node->GetKey(i));
+                              return std::error_condition();
+                          });
+    }
+
+    std::error_condition saveFilter()
+    {
+        if (auto err =
+                filter_.Save(*filterFile_, keys_->Size(), values_->Size()))
+            return err;
+        return filterFile_->Close();
+    }
+
+    // Reads the nodes that were cached when the DB was last closed, unless
+    // the keys file has changed since.
+    std::error_condition startWarmup()
+    {
+        if (auto err = cacheFile_->Open())
+            return err;
+        cacheOpen_ = true;
+        CacheSnapshot snapshot;
+        bool loaded;
+        std::error_condition err;
+        std::tie(loaded, err) = snapshot.Load(*cacheFile_, keys_->Size());
+        if (err || !loaded || cache_.MaxSize() == 0)
+            return err;
+        warmup_ = std::thread(&DB::warmup, this,
+                              snapshot.Plan(cache_.MaxSize()));
+        return std::error_condition();
+    }
+
+    void stopWarmup()
+    {
+        stopWarmup_ = true;
+        if (warmup_.joinable())
+            warmup_.join();
+        stopWarmup_ = false;
+    }
+
+    void warmup(std::vector<CacheSnapshot::Entry> const plan)
+    {
+        // Neighbouring nodes of a level are read together, up to this much
+        const std::uint64_t maxRead = 1024 * 1024;
+        auto start = clock::now();
+        std::vector<node_ptr> nodes;
+        std::size_t i = 0;
+        while (i < plan.size() && !stopWarmup_ && !close_)
+        {
+            auto const id = plan[i].id;
+            auto const level = plan[i].level;
+            std::uint64_t const blockSize = keys_->BlockSize(level);
+            std::size_t n = 1;
+            while (i + n < plan.size() && plan[i + n].level == level &&
+                   plan[i + n].id == id + n * blockSize &&
+                   (n + 1) * blockSize <= maxRead)
+                n++;
+            nodes.clear();
+            std::lock_guard<std::mutex> lock(flushMutex_);
+            if (auto err = keys_->GetRun(id, level, n, nodes))
+            {
+                if (log_.error)
+                    log_.error << "Warming cache: " << err.message();
+                return;
+            }
+            for (auto const &node : nodes) cache_.Add(node);
+            i += n;
+        }
+        if (log_.info)
+            log_.info << "Warmed cache with " << i << " nodes in "
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(
+                             clock::now() - start).count() << "ms";
+    }
+
+    std::error_condition saveCache()
+    {
+        CacheSnapshot snapshot;
+        cache_.Each([&snapshot](node_ptr const &node)
+                    {
+                        snapshot.entries.push_back(
+                            CacheSnapshot::Entry{node->Id(), node->Level()});
+                    });
+        if (auto err = snapshot.Save(*cacheFile_, keys_->Size()))
+            return err;
+        return cacheFile_->Close();
+    }
+
+    void record(FlushReport const &report)
+    {
+        stats_.Record(StatsRecorder::FlushProcessLatency,
+                      report.Elapsed("Journal::process").count());
+        stats_.Record(StatsRecorder::FlushValuesLatency,
+                      (report.Elapsed("Buffer::Write") +
+                       report.Elapsed("ValueStore::Append")).count());
+        stats_.Record(StatsRecorder::FlushNodesLatency,
+                      report.Elapsed("KeyStore::Set").count());
+        if (!report.Empty())
+        {
+            stats_.Record(StatsRecorder::SyncLatency,
+                          report.Elapsed("ValueStore::Sync").count());
+            stats_.Record(StatsRecorder::SyncLatency,
+                          report.Elapsed("KeyStore::Commit").count());
+        }
+        stats_.Add(StatsRecorder::Flushes);
+        stats_.Add(StatsRecorder::FlushedNodes, report.Nodes());
+        stats_.Add(StatsRecorder::Insertions, report.insertions);
+        stats_.Add(StatsRecorder::Evictions, report.evictions);
+        stats_.Add(StatsRecorder::Synthetics, report.synthetics);
+        stats_.Add(StatsRecorder::Updates, report.updates);
+        stats_.Add(StatsRecorder::Deletions, report.deletions);
+        stats_.Add(StatsRecorder::FreedBytes, report.freedBytes);
     }
 
     void flushThread()
@@ -200,13 +859,71 @@ class DB
                 std::chrono::milliseconds(options_.flushInterval));
             bool stop = close_;
             if (auto err = flush())
+            {
+                stats_.Add(StatsRecorder::FlushErrors);
                 if (log_.error)
                     log_.error << "Flushing Error: " << err.message() << ":"
                                << err.category().name();
+            }
             if (stop)
                 break;
         }
         // thread exits
     }
 };
+
+#ifdef KEYVADB_COROUTINES
+// Lets a coroutine running on the thread which polls db wait for a
+// GetAsync, with what Get would return:
+//
+//     std::string value;
+//     if (auto err = co_await AwaitGet(db, key, &value))
+//
+// The coroutine carries on from the Poll which completes the lookup, or
+// straight away if the lookup didn't need to read from disk. Works with a
+// DB or a PartitionedDB.
+template <class DBType>
+class GetAwaiter
+{
+    DBType &db_;
+    std::string const key_;
+    std::string *value_;
+    std::error_condition err_;
+    std::coroutine_handle<> handle_;
+    bool done_ = false;
+    bool suspended_ = false;
+
+   public:
+    GetAwaiter(DBType &db, Slice const key, std::string *value)
+        : db_(db), key_(key.data(), key.size()), value_(value)
+    {
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        handle_ = handle;
+        db_.GetAsync(key_, [this](std::error_condition err,
+                                  std::string const &value)
+                     {
+                         err_ = err;
+                         value_->assign(value);
+                         if (suspended_)
+                             return handle_.resume();
+                         done_ = true;
+                     });
+        suspended_ = !done_;
+        return suspended_;
+    }
+
+    std::error_condition await_resume() const { return err_; }
+};
+
+template <class DBType>
+GetAwaiter<DBType> AwaitGet(DBType &db, Slice const key, std::string *value)
+{
+    return GetAwaiter<DBType>(db, key, value);
+}
+#endif
 }  // namespace keyvadb
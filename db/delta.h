@@ -2,37 +2,76 @@
 
 #include <cstdint>
 #include <cstddef>
-#include <set>
+#include <vector>
+#include <iterator>
+#include <limits>
 #include <algorithm>
 #include "db/buffer.h"
+#include "db/arena.h"
 
 namespace keyvadb
 {
-template <std::uint32_t BITS>
+template <std::uint32_t BITS, std::uint32_t BLOCK_SIZE = 0>
 class Delta
 {
     using util = detail::KeyUtil<BITS>;
     using key_type = typename util::key_type;
-    using node_type = Node<BITS>;
+    using node_type = Node<BITS, BLOCK_SIZE>;
     using node_ptr = std::shared_ptr<node_type>;
     using buffer_type = Buffer<BITS>;
+    using key_value_type = KeyValue<BITS>;
+    using vector_type =
+        std::vector<key_value_type, ArenaAllocator<key_value_type>>;
+
+    enum Origin
+    {
+        Insertion,
+        Eviction,
+        Existing,
+        Update
+    };
+
+    // A key competing for a place in an overflowing node
+    struct Combined
+    {
+        key_value_type kv;
+        Origin origin;
+        // The new length of an updated key
+        std::uint32_t length;
+        bool placed;
+    };
+
+    using combined_type = std::vector<Combined, ArenaAllocator<Combined>>;
+
+    static constexpr std::size_t Unplaced =
+        std::numeric_limits<std::size_t>::max();
 
    private:
+    Arena* arena_;
     std::uint64_t existing_;
     std::uint64_t insertions_;
     std::uint64_t evictions_;
     std::uint64_t synthetics_;
     std::uint64_t children_;
+    std::uint64_t updates_;
+    std::uint64_t deletions_;
+    std::uint64_t freed_;
     node_ptr current_;
     node_ptr previous_;
 
    public:
-    explicit Delta(node_ptr const& node)
-        : existing_(0),
+    // The working sets of AddKeys are allocated from arena, which must
+    // outlive the call.
+    Delta(node_ptr const& node, Arena& arena)
+        : arena_(&arena),
+          existing_(0),
           insertions_(0),
           evictions_(0),
           synthetics_(0),
           children_(0),
+          updates_(0),
+          deletions_(0),
+          freed_(0),
           current_(node)
     {
     }
@@ -53,6 +92,10 @@ class Delta
     {
         return insertions_ - evictions_;
     }
+    constexpr std::uint64_t Evictions() const { return evictions_; }
+    constexpr std::uint64_t Synthetics() const { return synthetics_; }
+    constexpr std::uint64_t Updates() const { return updates_; }
+    constexpr std::uint64_t Deletions() const { return deletions_; }
 
     bool CheckSanity() { return current_->IsSane(); }
 
@@ -63,104 +106,128 @@ class Delta
         current_->SetChild(i, cid);
     }
 
+    // Every working array is sorted by key, so each step is a linear merge.
     std::uint64_t AddKeys(buffer_type& buffer, std::uint64_t offset)
     {
         auto N = current_->MaxKeys();
-        std::set<KeyValue<BITS>> candidates;
-        std::set<KeyValue<BITS>> evictions;
+        ArenaAllocator<key_value_type> alloc(*arena_);
+        vector_type candidates(alloc);
+        vector_type evictions(alloc);
+        vector_type tombstones(alloc);
         buffer.GetCandidates(current_->First(), current_->Last(), candidates,
-                             evictions);
-        if (candidates.size() + evictions.size() == 0)
+                             evictions, tombstones);
+        if (candidates.size() + evictions.size() + tombstones.size() == 0)
         {
             // Nothing to do, this is the root node being checked for work
             return offset;
         }
-        std::set<KeyValue<BITS>> existing(current_->NonZeroBegin(),
-                                          current_->keys.cend());
-
+        removeKeys(buffer, tombstones);
+        vector_type existing(alloc);
+        existing.reserve(N);
+        for (auto i = current_->EmptyKeyCount(); i < N; i++)
+            existing.push_back(current_->GetKeyValue(i));
         existing_ = existing.size();
 
-        std::vector<KeyValue<BITS>> dupes;
-        std::set_intersection(candidates.cbegin(), candidates.cend(),
-                              existing.cbegin(), existing.cend(),
-                              std::back_inserter(dupes));
-        // Remove dupes
-        for (auto const& kv : dupes)
-        {
-            buffer.RemoveDuplicate(kv.key);
-            candidates.erase(kv);
-        }
+        // Candidates which are already present overwrite the existing value
+        // in place. Their offsets are assigned once it is known whether
+        // they stay in this node.
+        vector_type updates(alloc);
+        splitUpdates(candidates, existing, updates);
+        if (updates.size() > 0)
+            Flip();
         if ((candidates.size() == 0 && evictions.size() == 0) ||
             current_->EmptyKeyCount() == 0)
-            // Nothing to do
-            return offset;
+            return applyUpdates(buffer, updates, offset);
 
         Flip();
         if (existing.size() + candidates.size() + evictions.size() <= N)
         {
-            // Won't overflow copy and sort
-            insertions_ = candidates.size();
-            auto lastCandidate = std::copy(
-                candidates.cbegin(), candidates.cend(), current_->keys.begin());
-            std::copy(evictions.cbegin(), evictions.cend(), lastCandidate);
-            for (auto it = current_->keys.begin(); it != lastCandidate; ++it)
+            // Won't overflow, so merge everything after the empty keys
+            for (auto& kv : candidates)
             {
                 insertions_++;
-                buffer.SetOffset(it->key, offset);
-                it->offset = offset;
-                offset += it->length;
+                buffer.SetOffset(kv.key, offset);
+                kv.offset = offset;
+                offset += kv.length;
             }
-            std::sort(current_->keys.begin(), current_->keys.end());
-            return offset;
+            vector_type additions(alloc);
+            additions.reserve(candidates.size() + evictions.size());
+            std::merge(candidates.cbegin(), candidates.cend(),
+                       evictions.cbegin(), evictions.cend(),
+                       std::back_inserter(additions));
+            vector_type merged(alloc);
+            merged.reserve(existing.size() + additions.size());
+            std::merge(additions.cbegin(), additions.cend(),
+                       existing.cbegin(), existing.cend(),
+                       std::back_inserter(merged));
+            current_->Clear();
+            setFrom(N - merged.size(), merged);
+            return applyUpdates(buffer, updates, offset);
         }
 
-        // Handle overflowing node
-        std::set<KeyValue<BITS>> combined(candidates);
-        std::copy(evictions.cbegin(), evictions.cend(),
-                  std::inserter(combined, combined.end()));
-        std::copy(existing.cbegin(), existing.cend(),
-                  std::inserter(combined, combined.end()));
+        // Handle overflowing node by placing the key nearest to each stride
+        auto combined = combine(candidates, evictions, existing, updates);
+        std::vector<std::size_t, ArenaAllocator<std::size_t>> slots(
+            N, std::size_t(Unplaced), alloc);
         current_->Clear();
-        auto stride = current_->Stride();
+        typename util::StrideDivider const divider(
+            current_->First(), current_->Stride(), current_->Degree());
         std::size_t index = 0;
         auto best = util::Max();
-        for (auto const& kv : combined)
+        for (std::size_t i = 0; i < combined.size(); i++)
         {
             std::uint32_t nearest;
             key_type distance;
-            util::NearestStride(current_->First(), stride, kv.key, distance,
-                                nearest);
+            divider.Nearest(combined[i].kv.key, distance, nearest);
             if ((nearest == index && distance < best) || (nearest != index))
             {
-                current_->SetKeyValue(nearest, kv);
+                current_->SetKeyValue(nearest, combined[i].kv);
+                slots.at(nearest) = i;
                 best = distance;
             }
             index = nearest;
         }
         synthetics_ = current_->AddSyntheticKeyValues();
-        for (auto& kv : current_->keys)
+        for (std::size_t slot = 0; slot < N; slot++)
         {
-            if (kv.IsSynthetic())
+            if (slots[slot] == Unplaced)
                 continue;
-            if (candidates.count(kv) > 0)
+            auto& placed = combined[slots[slot]];
+            placed.placed = true;
+            if (current_->IsSynthetic(slot))
+                continue;
+            if (placed.origin == Insertion)
             {
+                auto const& kv = placed.kv;
                 insertions_++;
                 buffer.SetOffset(kv.key, offset);
-                kv.offset = offset;
+                current_->SetValue(slot, offset, kv.length);
                 offset += kv.length;
             }
-            existing.erase(kv);
+            else if (placed.origin == Update)
+                offset = updateKey(buffer, placed.length, slot, offset);
         }
-        for (auto const& kv : existing)
+        for (auto const& c : combined)
         {
-            if (kv.IsSynthetic())
+            if (c.placed || c.kv.IsSynthetic())
                 continue;
-            evictions_++;
-            buffer.AddEvictee(kv.key, kv.offset, kv.length);
+            if (c.origin == Update)
+            {
+                // The new value is still Unprocessed in the buffer and will
+                // be placed further down the tree.
+                freed_ += c.kv.length;
+            }
+            else if (c.origin == Existing)
+            {
+                evictions_++;
+                buffer.AddEvictee(c.kv.key, c.kv.offset, c.kv.length);
+            }
         }
         return offset;
     }
 
+    constexpr std::uint64_t FreedBytes() const { return freed_; }
+
     friend std::ostream& operator<<(std::ostream& stream, const Delta& delta)
     {
         stream << "Id: " << std::setw(12) << delta.current_->Id()
@@ -168,8 +235,148 @@ class Delta
                << " Insertions: " << std::setw(3) << delta.insertions_
                << " Evictions: " << std::setw(3) << delta.evictions_
                << " Synthetics: " << std::setw(3) << delta.synthetics_
-               << " Children: " << std::setw(3) << delta.children_;
+               << " Children: " << std::setw(3) << delta.children_
+               << " Updates: " << std::setw(3) << delta.updates_
+               << " Deletions: " << std::setw(3) << delta.deletions_;
         return stream;
     }
+
+   private:
+    // Moves candidates which match an existing key into updates, leaving
+    // only insertions.
+    static void splitUpdates(vector_type& candidates,
+                             vector_type const& existing, vector_type& updates)
+    {
+        auto e = existing.cbegin();
+        auto out = candidates.begin();
+        for (auto const& kv : candidates)
+        {
+            while (e != existing.cend() && *e < kv) ++e;
+            if (e != existing.cend() && *e == kv)
+                updates.push_back(kv);
+            else
+                *out++ = kv;
+        }
+        candidates.erase(out, candidates.end());
+    }
+
+    // Merges the sorted and disjoint candidates, evictions and existing
+    // keys, remembering where each came from.
+    combined_type combine(vector_type const& candidates,
+                          vector_type const& evictions,
+                          vector_type const& existing,
+                          vector_type const& updates) const
+    {
+        combined_type combined{ArenaAllocator<Combined>(*arena_)};
+        combined.reserve(candidates.size() + evictions.size() +
+                         existing.size());
+        auto c = candidates.cbegin();
+        auto v = evictions.cbegin();
+        auto e = existing.cbegin();
+        auto u = updates.cbegin();
+        for (;;)
+        {
+            bool const hasC = c != candidates.cend();
+            bool const hasV = v != evictions.cend();
+            bool const hasE = e != existing.cend();
+            if (hasC && (!hasV || *c < *v) && (!hasE || *c < *e))
+                combined.push_back(Combined{*c++, Insertion, 0, false});
+            else if (hasV && (!hasE || *v < *e))
+                combined.push_back(Combined{*v++, Eviction, 0, false});
+            else if (hasE)
+            {
+                while (u != updates.cend() && *u < *e) ++u;
+                if (u != updates.cend() && *u == *e)
+                    combined.push_back(Combined{*e, Update, u->length, false});
+                else
+                    combined.push_back(Combined{*e, Existing, 0, false});
+                ++e;
+            }
+            else
+                break;
+        }
+        return combined;
+    }
+
+    std::uint64_t applyUpdates(buffer_type& buffer,
+                               vector_type const& updates, std::uint64_t offset)
+    {
+        auto u = updates.cbegin();
+        for (std::size_t i = 0; i < current_->MaxKeys(); i++)
+        {
+            if (u == updates.cend())
+                break;
+            auto const key = current_->GetKey(i);
+            while (u != updates.cend() && u->key < key) ++u;
+            if (u != updates.cend() && u->key == key)
+                offset = updateKey(buffer, (u++)->length, i, offset);
+        }
+        return offset;
+    }
+
+    // Assigns a new offset to the existing i'th key, which has been
+    // overwritten.
+    std::uint64_t updateKey(buffer_type& buffer, std::uint32_t const length,
+                            std::size_t const i, std::uint64_t offset)
+    {
+        auto const kv = current_->GetKeyValue(i);
+        if (!kv.IsSynthetic())
+            freed_ += kv.length;
+        updates_++;
+        buffer.SetOffset(kv.key, offset);
+        current_->SetValue(i, offset, length);
+        return offset + length;
+    }
+
+    // Sets the keys from index first onwards to kvs
+    void setFrom(std::size_t const first, vector_type const& kvs)
+    {
+        for (std::size_t i = 0; i < kvs.size(); i++)
+            current_->SetKeyValue(first + i, kvs[i]);
+    }
+
+    // Applies tombstones without restructuring the node. A node without
+    // children has the key emptied, otherwise it is replaced by a synthetic
+    // key so that the child ranges are unchanged. Tombstones for keys that
+    // can't be in or below this node are dropped.
+    void removeKeys(buffer_type& buffer, vector_type const& tombstones)
+    {
+        if (tombstones.empty())
+            return;
+        bool const leaf = current_->EmptyChildCount() == current_->Degree();
+        bool removed = false;
+        std::size_t i = 0;
+        auto const N = current_->MaxKeys();
+        for (auto const& tombstone : tombstones)
+        {
+            while (i < N && current_->GetKey(i) < tombstone.key) i++;
+            bool const found = i < N && current_->GetKey(i) == tombstone.key;
+            if (found && !current_->IsSynthetic(i))
+            {
+                Flip();
+                auto const kv = current_->GetKeyValue(i);
+                freed_ += kv.length;
+                deletions_++;
+                if (leaf)
+                    current_->SetKeyValue(i, key_value_type{0, EmptyValue, 0});
+                else
+                    current_->SetValue(i, SyntheticValue, 0);
+                removed = true;
+            }
+            if (found || leaf)
+                buffer.SetRemoved(tombstone.key);
+        }
+        if (removed && leaf)
+        {
+            // Slide the remaining keys up past the new empty keys
+            ArenaAllocator<key_value_type> alloc(*arena_);
+            vector_type remaining(alloc);
+            for (std::size_t j = 0; j < N; j++)
+                if (!current_->IsZero(j))
+                    remaining.push_back(current_->GetKeyValue(j));
+            current_->Clear();
+            setFrom(N - remaining.size(), remaining);
+        }
+    }
 };
 }  // namespace keyvadb
@@ -1,16 +1,31 @@
 #pragma once
 
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
 #include <atomic>
+#include "db/async.h"
 
 namespace keyvadb
 {
+enum class AccessPattern
+{
+    Normal,
+    Random,
+    Sequential
+};
+
 class RandomAccessFile
 {
    public:
@@ -21,6 +36,11 @@ class RandomAccessFile
     virtual std::error_condition Truncate() const = 0;
     virtual std::pair<std::size_t, std::error_condition> ReadAt(
         std::uint64_t const pos, std::string& str) const = 0;
+    // As ReadAt, but made through reader, which calls done from its Poll.
+    // str must stay valid until then.
+    virtual void ReadAtAsync(AsyncReader& reader, std::uint64_t const pos,
+                             std::string& str,
+                             AsyncReader::read_callback done) const = 0;
     virtual std::pair<std::size_t, std::error_condition> Write(
         std::vector<std::uint8_t> const&) = 0;
     virtual std::pair<std::size_t, std::error_condition> WriteAt(
@@ -29,19 +49,61 @@ class RandomAccessFile
         std::atomic_uint_fast64_t& size) const = 0;
     virtual std::error_condition Close() = 0;
     virtual std::error_condition Sync() const = 0;
+    // Hints that a range will be read soon, without waiting for it.
+    // Returns false if no read was started.
+    virtual bool Prefetch(std::uint64_t const pos,
+                          std::size_t const length) const = 0;
+    // Hints how the file will be read from now on
+    virtual void Advise(AccessPattern const pattern) const = 0;
 };
 
+// With direct set, reads and writes bypass the page cache using O_DIRECT.
+// They go through a page aligned buffer, so any position and length work,
+// but a write which doesn't cover whole pages has to read them first.
+//
+// With mapped set, and not direct, reads copy from a shared read-only
+// mapping of the file rather than calling pread. The file is mapped in
+// chunks as reads reach them. A chunk stays at the same address until
+// Close, so a read only takes a lock to map a new chunk, and reads of a
+// chunk see later writes to the file. A read which crosses two chunks
+// falls back to pread.
 class PosixRandomAccessFile : public RandomAccessFile
 {
    private:
+    enum
+    {
+        PageSize = 4096
+    };
+
+    static constexpr std::uint64_t ChunkSize = std::uint64_t(1) << 30;
+    // Enough for a 1TB file
+    static constexpr std::size_t MaxChunks = 1024;
+
+    struct free_deleter
+    {
+        void operator()(char* p) const { std::free(p); }
+    };
+    using aligned_buffer = std::unique_ptr<char, free_deleter>;
+
     std::string filename_;
     std::int32_t fd_;
+    bool const direct_;
+    bool const mapped_;
+    // The file length as written through this object, which bounds reads
+    // of the mapping as reading a page past the end of the file faults
+    mutable std::atomic_uint_fast64_t length_{0};
+    mutable std::array<std::atomic<char*>, MaxChunks> chunks_{};
+    mutable std::mutex mapLock_;
+    mutable AccessPattern pattern_ = AccessPattern::Normal;
 
    public:
-    explicit PosixRandomAccessFile(std::string const& filename)
-        : filename_(filename)
+    explicit PosixRandomAccessFile(std::string const& filename,
+                                   bool const direct = false,
+                                   bool const mapped = false)
+        : filename_(filename), direct_(direct), mapped_(mapped && !direct)
     {
     }
+    ~PosixRandomAccessFile() { unmap(); }
     PosixRandomAccessFile(const PosixRandomAccessFile&) = delete;
     PosixRandomAccessFile& operator=(const PosixRandomAccessFile&) = delete;
 
@@ -59,33 +121,96 @@ class PosixRandomAccessFile : public RandomAccessFile
 
     std::error_condition Truncate() const override
     {
+        length_ = 0;
         return check_error(::ftruncate(fd_, 0));
     }
 
     std::pair<std::size_t, std::error_condition> ReadAt(
         std::uint64_t const pos, std::string& str) const override
     {
+        if (direct_)
+            return directRead(pos, &str[0], str.size());
+        if (mapped_)
+            if (auto chunk = chunkFor(pos, str.size()))
+            {
+                std::uint64_t const length = length_;
+                std::size_t const n =
+                    pos < length ? std::min<std::uint64_t>(str.size(),
+                                                           length - pos)
+                                 : 0;
+                std::memcpy(&str[0], chunk + pos % ChunkSize, n);
+                return std::make_pair(n, std::error_condition());
+            }
         ssize_t ret = ::pread(fd_, &str[0], str.size(), pos);
         if (ret < 0)
             return std::make_pair(0, check_error(ret));
         return std::make_pair(ret, std::error_condition());
     };
 
+    // A direct read goes through a page aligned buffer of its own, and a
+    // read of a mapped chunk is copied at once.
+    void ReadAtAsync(AsyncReader& reader, std::uint64_t const pos,
+                     std::string& str,
+                     AsyncReader::read_callback done) const override
+    {
+        if (direct_)
+        {
+            auto const start = alignDown(pos);
+            auto const length = alignUp(pos + str.size()) - start;
+            std::shared_ptr<char> buf(allocate(length));
+            char* data = &str[0];
+            std::size_t const size = str.size();
+            std::uint64_t const skip = pos - start;
+            return reader.Read(
+                fd_, start, buf.get(), length,
+                [buf, data, size, skip, done](std::size_t const ret,
+                                              std::error_condition const err)
+                {
+                    std::size_t const bytesRead =
+                        !err && ret > skip
+                            ? std::min<std::uint64_t>(size, ret - skip)
+                            : 0;
+                    std::memcpy(data, buf.get() + skip, bytesRead);
+                    done(bytesRead, err);
+                });
+        }
+        if (mapped_ && chunkFor(pos, str.size()))
+        {
+            auto const result = ReadAt(pos, str);
+            return reader.Complete(std::move(done), result.first,
+                                   result.second);
+        }
+        reader.Read(fd_, pos, &str[0], str.size(), std::move(done));
+    }
+
     std::pair<std::size_t, std::error_condition> Write(
         std::vector<std::uint8_t> const& buf) override
     {
+        if (direct_)
+        {
+            struct stat sb;
+            if (auto err = check_error(::fstat(fd_, &sb)))
+                return std::make_pair(0, err);
+            return directWrite(reinterpret_cast<char const*>(buf.data()),
+                               buf.size(), sb.st_size);
+        }
         ssize_t ret = ::write(fd_, buf.data(), buf.size());
         if (ret < 0)
             return std::make_pair(0, check_error(ret));
+        length_ += ret;
         return std::make_pair(ret, std::error_condition());
     }
 
     std::pair<std::size_t, std::error_condition> WriteAt(
         std::string const& str, std::uint64_t const pos) override
     {
+        if (direct_)
+            return directWrite(str.data(), str.size(), pos);
         ssize_t ret = ::pwrite(fd_, str.data(), str.size(), pos);
         if (ret < 0)
             return std::make_pair(0, check_error(ret));
+        if (pos + ret > length_)
+            length_ = pos + ret;
         return std::make_pair(ret, std::error_condition());
     };
 
@@ -100,6 +225,7 @@ class PosixRandomAccessFile : public RandomAccessFile
 
     std::error_condition Close() override
     {
+        unmap();
         if (auto err = Sync())
             return err;
         return check_error(::close(fd_));
@@ -110,11 +236,176 @@ class PosixRandomAccessFile : public RandomAccessFile
         return check_error(::fsync(fd_));
     };
 
+    // Starts reading the range into the page cache. Does nothing for a
+    // direct file, which has no page cache to read into.
+    bool Prefetch(std::uint64_t const pos,
+                  std::size_t const length) const override
+    {
+#ifdef POSIX_FADV_WILLNEED
+        if (direct_)
+            return false;
+        return ::posix_fadvise(fd_, pos, length, POSIX_FADV_WILLNEED) == 0;
+#else
+        (void)pos;
+        (void)length;
+        return false;
+#endif
+    }
+
+    // Applied to the whole file, and to every chunk that is or will be
+    // mapped
+    void Advise(AccessPattern const pattern) const override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mapLock_);
+            pattern_ = pattern;
+            for (auto const& chunk : chunks_)
+                if (char* base = chunk)
+                    adviseChunk(base);
+        }
+#ifdef POSIX_FADV_NORMAL
+        if (!direct_)
+            ::posix_fadvise(fd_, 0, 0,
+                            pattern == AccessPattern::Random
+                                ? POSIX_FADV_RANDOM
+                                : pattern == AccessPattern::Sequential
+                                      ? POSIX_FADV_SEQUENTIAL
+                                      : POSIX_FADV_NORMAL);
+#endif
+    }
+
    private:
-    std::error_condition open(std::int32_t const flags)
+    std::error_condition open(std::int32_t flags)
     {
+        // Direct writes always give their position, which O_APPEND ignores
+        if (direct_)
+            flags &= ~O_APPEND;
+#ifdef O_DIRECT
+        if (direct_)
+            flags |= O_DIRECT;
+#endif
         fd_ = ::open(filename_.c_str(), flags, 0644);
-        return check_error(fd_);
+        if (auto err = check_error(fd_))
+            return err;
+        struct stat sb;
+        if (auto err = check_error(::fstat(fd_, &sb)))
+            return err;
+        length_ = sb.st_size;
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+        if (direct_)
+            return check_error(::fcntl(fd_, F_NOCACHE, 1));
+#endif
+        return std::error_condition();
+    }
+
+    // The mapped chunk holding the whole of a read, or null if there isn't
+    // one and the read should use pread
+    char const* chunkFor(std::uint64_t const pos, std::size_t const size) const
+    {
+        auto const i = pos / ChunkSize;
+        if (i >= MaxChunks || pos % ChunkSize + size > ChunkSize)
+            return nullptr;
+        if (char* base = chunks_[i].load(std::memory_order_acquire))
+            return base;
+        std::lock_guard<std::mutex> lock(mapLock_);
+        if (char* base = chunks_[i].load(std::memory_order_relaxed))
+            return base;
+        // Mapping past the end of the file is allowed, and the pages
+        // become readable as the file grows
+        void* p = ::mmap(nullptr, ChunkSize, PROT_READ, MAP_SHARED, fd_,
+                         i * ChunkSize);
+        if (p == MAP_FAILED)
+            return nullptr;
+        char* base = static_cast<char*>(p);
+        adviseChunk(base);
+        chunks_[i].store(base, std::memory_order_release);
+        return base;
+    }
+
+    // Must be called with mapLock_ held
+    void adviseChunk(char* base) const
+    {
+        ::madvise(base, ChunkSize,
+                  pattern_ == AccessPattern::Random
+                      ? MADV_RANDOM
+                      : pattern_ == AccessPattern::Sequential ? MADV_SEQUENTIAL
+                                                              : MADV_NORMAL);
+    }
+
+    void unmap()
+    {
+        std::lock_guard<std::mutex> lock(mapLock_);
+        for (auto& chunk : chunks_)
+            if (char* base = chunk.exchange(nullptr))
+                ::munmap(base, ChunkSize);
+    }
+
+    static std::uint64_t alignDown(std::uint64_t const n)
+    {
+        return n & ~std::uint64_t(PageSize - 1);
+    }
+
+    static std::uint64_t alignUp(std::uint64_t const n)
+    {
+        return alignDown(n + PageSize - 1);
+    }
+
+    static aligned_buffer allocate(std::size_t const size)
+    {
+        void* p = nullptr;
+        if (::posix_memalign(&p, PageSize, size) != 0)
+            throw std::bad_alloc();
+        return aligned_buffer(static_cast<char*>(p));
+    }
+
+    std::pair<std::size_t, std::error_condition> directRead(
+        std::uint64_t const pos, char* data, std::size_t const size) const
+    {
+        auto const start = alignDown(pos);
+        auto const length = alignUp(pos + size) - start;
+        auto buf = allocate(length);
+        ssize_t ret = ::pread(fd_, buf.get(), length, start);
+        if (ret < 0)
+            return std::make_pair(0, check_error(ret));
+        auto const skip = pos - start;
+        std::size_t const bytesRead =
+            std::uint64_t(ret) > skip
+                ? std::min<std::uint64_t>(size, std::uint64_t(ret) - skip)
+                : 0;
+        std::memcpy(data, buf.get() + skip, bytesRead);
+        return std::make_pair(bytesRead, std::error_condition());
+    }
+
+    std::pair<std::size_t, std::error_condition> directWrite(
+        char const* data, std::size_t const size, std::uint64_t const pos)
+    {
+        auto const start = alignDown(pos);
+        auto const end = alignUp(pos + size);
+        auto const length = end - start;
+        auto buf = allocate(length);
+        bool const partial = start != pos || end != pos + size;
+        struct stat sb;
+        if (partial)
+        {
+            // Keep the rest of the pages, and the file length
+            if (auto err = check_error(::fstat(fd_, &sb)))
+                return std::make_pair(0, err);
+            std::memset(buf.get(), 0, length);
+            ssize_t ret = ::pread(fd_, buf.get(), length, start);
+            if (ret < 0)
+                return std::make_pair(0, check_error(ret));
+        }
+        std::memcpy(buf.get() + (pos - start), data, size);
+        ssize_t ret = ::pwrite(fd_, buf.get(), length, start);
+        if (ret < 0)
+            return std::make_pair(0, check_error(ret));
+        if (std::uint64_t(ret) != length)
+            return std::make_pair(0, std::error_condition());
+        if (partial && end > std::uint64_t(sb.st_size))
+            if (auto err = check_error(::ftruncate(
+                    fd_, std::max<std::uint64_t>(sb.st_size, pos + size))))
+                return std::make_pair(0, err);
+        return std::make_pair(size, std::error_condition());
     }
 
     std::error_condition check_error(ssize_t err) const
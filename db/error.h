@@ -15,6 +15,11 @@ enum db_error
     short_read,
     short_write,
     bad_commit,
+    wrong_partition,
+    bad_header,
+    truncated,
+    checksum_mismatch,
+    wrong_block_size,
 };
 
 class db_category : public std::error_category
@@ -41,6 +46,16 @@ class db_category : public std::error_category
             return "Short Write";
         case db_error::bad_commit:
             return "Bad Commit";
+        case db_error::wrong_partition:
+            return "Wrong Partition";
+        case db_error::bad_header:
+            return "Bad Header";
+        case db_error::truncated:
+            return "Truncated File";
+        case db_error::checksum_mismatch:
+            return "Checksum Mismatch";
+        case db_error::wrong_block_size:
+            return "Wrong Block Size";
         default:
             return "Unknown error";
         }
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <cmath>
+#include "db/key.h"
+#include "db/env.h"
+#include "db/encoding.h"
+#include "db/error.h"
+#include "db/crc32c.h"
+
+namespace keyvadb
+{
+// A scalable bloom filter over every key committed to the tree, used to
+// answer most lookups for missing keys without reading any nodes. Each
+// level is a blocked bloom filter, where all the probes for a key fall into
+// one cache line. When a level is full a new one with twice the capacity is
+// added, so the false positive rate stays bounded as the tree grows.
+//
+// Keys are only ever added, so deleted keys stay in the filter until it is
+// rebuilt. Add must only be called from one thread at a time, but
+// MayContain can be called concurrently with it.
+template <std::uint32_t BITS>
+class KeyFilter
+{
+    using util = detail::KeyUtil<BITS>;
+    using key_type = typename util::key_type;
+    using word_type = std::atomic<std::uint64_t>;
+
+    enum
+    {
+        MaxLevels = 48,
+        BlockWords = 8,
+        BlockBits = BlockWords * 64,
+        MaxProbes = 7,
+        Magic = 0x4642564B,  // KVBF
+        Version = 2
+    };
+
+    struct Level
+    {
+        std::uint64_t capacity;
+        std::uint64_t blocks;
+        std::atomic<std::uint64_t> count;
+        std::unique_ptr<word_type[]> words;
+
+        Level(std::uint64_t const cap, std::uint32_t const bitsPerKey)
+            : capacity(cap),
+              blocks(Blocks(cap, bitsPerKey)),
+              count(0),
+              words(new word_type[blocks * BlockWords]())
+        {
+        }
+
+        static std::uint64_t Blocks(std::uint64_t const cap,
+                                    std::uint32_t const bitsPerKey)
+        {
+            return std::max<std::uint64_t>(
+                1, (cap * bitsPerKey + BlockBits - 1) / BlockBits);
+        }
+
+        bool MayContain(std::uint64_t const h1, std::uint64_t const h2,
+                        std::uint32_t const probes) const
+        {
+            auto block = &words[(h1 % blocks) * BlockWords];
+            for (std::uint32_t i = 0; i < probes; i++)
+            {
+                auto bit = (h2 >> (9 * i)) & (BlockBits - 1);
+                if (!(block[bit / 64].load(std::memory_order_relaxed) &
+                      (1ULL << (bit % 64))))
+                    return false;
+            }
+            return true;
+        }
+
+        void Add(std::uint64_t const h1, std::uint64_t const h2,
+                 std::uint32_t const probes)
+        {
+            auto block = &words[(h1 % blocks) * BlockWords];
+            for (std::uint32_t i = 0; i < probes; i++)
+            {
+                auto bit = (h2 >> (9 * i)) & (BlockBits - 1);
+                block[bit / 64].fetch_or(1ULL << (bit % 64),
+                                         std::memory_order_relaxed);
+            }
+            count.fetch_add(1, std::memory_order_relaxed);
+        }
+    };
+
+    std::uint32_t const bitsPerKey_;
+    std::uint32_t const probes_;
+    std::uint64_t const initialCapacity_;
+    std::array<std::unique_ptr<Level>, MaxLevels> levels_;
+    std::atomic<std::size_t> size_;
+
+   public:
+    // A bitsPerKey of zero disables the filter, and MayContain always
+    // returns true.
+    explicit KeyFilter(std::uint32_t const bitsPerKey,
+                       std::uint64_t const initialCapacity = 1 << 16)
+        : bitsPerKey_(bitsPerKey),
+          probes_(std::min<std::uint32_t>(
+              MaxProbes, std::max(1.0, std::round(bitsPerKey * 0.69)))),
+          initialCapacity_(initialCapacity),
+          size_(0)
+    {
+    }
+    KeyFilter(KeyFilter const&) = delete;
+    KeyFilter& operator=(KeyFilter const&) = delete;
+
+    constexpr bool Enabled() const { return bitsPerKey_ > 0; }
+
+    bool MayContain(key_type const& key) const
+    {
+        if (!Enabled())
+            return true;
+        std::uint64_t h1, h2;
+        hash(key, h1, h2);
+        auto const size = size_.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i < size; i++)
+            if (levels_[i]->MayContain(h1, h2, probes_))
+                return true;
+        return false;
+    }
+
+    void Add(key_type const& key)
+    {
+        if (!Enabled())
+            return;
+        std::uint64_t h1, h2;
+        hash(key, h1, h2);
+        auto size = size_.load(std::memory_order_relaxed);
+        for (std::size_t i = 0; i < size; i++)
+            if (levels_[i]->MayContain(h1, h2, probes_))
+                return;
+        if (size == 0 || levels_[size - 1]->count >= levels_[size - 1]->capacity)
+        {
+            if (size == MaxLevels)
+                throw std::overflow_error("Filter has too many levels");
+            auto capacity = size == 0 ? initialCapacity_
+                                      : levels_[size - 1]->capacity * 2;
+            levels_[size] = std::make_unique<Level>(capacity, bitsPerKey_);
+            // Publish the new level only once it is constructed
+            size_.store(++size, std::memory_order_release);
+        }
+        levels_[size - 1]->Add(h1, h2, probes_);
+    }
+
+    // Not threadsafe
+    void Clear()
+    {
+        size_ = 0;
+        for (auto& level : levels_) level.reset();
+    }
+
+    std::uint64_t Count() const
+    {
+        std::uint64_t total = 0;
+        for (std::size_t i = 0; i < size_; i++) total += levels_[i]->count;
+        return total;
+    }
+
+    std::uint64_t MemoryUsage() const
+    {
+        std::uint64_t total = 0;
+        for (std::size_t i = 0; i < size_; i++)
+            total += levels_[i]->blocks * BlockWords * sizeof(std::uint64_t);
+        return total;
+    }
+
+    // The lengths of the keys and values files are stored alongside the
+    // filter. If either has changed when it is loaded then keys might have
+    // been committed without being saved to the filter. The last four
+    // bytes are a CRC32C of the rest.
+    std::error_condition Save(RandomAccessFile& file,
+                              std::uint64_t const keysLength,
+                              std::uint64_t const valuesLength) const
+    {
+        std::string str(headerSize() + MemoryUsage() +
+                            size_ * 3 * sizeof(std::uint64_t) +
+                            sizeof(std::uint32_t),
+                        '\0');
+        std::size_t pos = 0;
+        pos += string_replace<std::uint32_t>(Magic, pos, str);
+        pos += string_replace<std::uint32_t>(Version, pos, str);
+        pos += string_replace<std::uint32_t>(bitsPerKey_, pos, str);
+        pos += string_replace<std::uint32_t>(size_, pos, str);
+        pos += string_replace<std::uint64_t>(keysLength, pos, str);
+        pos += string_replace<std::uint64_t>(valuesLength, pos, str);
+        for (std::size_t i = 0; i < size_; i++)
+        {
+            auto const& level = *levels_[i];
+            pos += string_replace<std::uint64_t>(level.capacity, pos, str);
+            pos += string_replace<std::uint64_t>(level.count, pos, str);
+            pos += string_replace<std::uint64_t>(level.blocks, pos, str);
+            for (std::size_t w = 0; w < level.blocks * BlockWords; w++)
+                pos += string_replace<std::uint64_t>(level.words[w], pos, str);
+        }
+        string_replace(detail::Crc32c::Value(str.data(), pos), pos, str);
+        if (auto err = file.Truncate())
+            return err;
+        std::size_t bytesWritten;
+        std::error_condition err;
+        std::tie(bytesWritten, err) = file.WriteAt(str, 0);
+        if (err)
+            return err;
+        if (bytesWritten != str.size())
+            return make_error_condition(db_error::short_write);
+        return std::error_condition();
+    }
+
+    // Returns false if the file is missing, corrupt or out of date, in
+    // which case the filter must be rebuilt.
+    std::pair<bool, std::error_condition> Load(RandomAccessFile& file,
+                                               std::uint64_t const keysLength,
+                                               std::uint64_t const valuesLength)
+    {
+        Clear();
+        std::atomic_uint_fast64_t length;
+        if (auto err = file.Size(length))
+            return std::make_pair(false, err);
+        if (length < headerSize() + sizeof(std::uint32_t))
+            return std::make_pair(false, std::error_condition());
+        std::string str(length, '\0');
+        std::size_t bytesRead;
+        std::error_condition err;
+        std::tie(bytesRead, err) = file.ReadAt(0, str);
+        if (err)
+            return std::make_pair(false, err);
+        if (bytesRead != str.size())
+            return std::make_pair(false,
+                                  make_error_condition(db_error::short_read));
+        // Nothing is trusted until the checksum matches
+        auto const end = str.size() - sizeof(std::uint32_t);
+        std::uint32_t crc;
+        string_read(str, end, crc);
+        if (crc != detail::Crc32c::Value(str.data(), end))
+            return std::make_pair(false, std::error_condition());
+        std::uint32_t magic, version, bitsPerKey, levels;
+        std::uint64_t savedKeysLength, savedValuesLength;
+        std::size_t pos = 0;
+        pos += string_read<std::uint32_t>(str, pos, magic);
+        pos += string_read<std::uint32_t>(str, pos, version);
+        pos += string_read<std::uint32_t>(str, pos, bitsPerKey);
+        pos += string_read<std::uint32_t>(str, pos, levels);
+        pos += string_read<std::uint64_t>(str, pos, savedKeysLength);
+        pos += string_read<std::uint64_t>(str, pos, savedValuesLength);
+        if (magic != Magic || version != Version || bitsPerKey == 0 ||
+            bitsPerKey != bitsPerKey_ || levels > MaxLevels ||
+            savedKeysLength != keysLength || savedValuesLength != valuesLength)
+            return std::make_pair(false, std::error_condition());
+        for (std::size_t i = 0; i < levels; i++)
+        {
+            std::uint64_t capacity, count, blocks;
+            if (pos + 3 * sizeof(std::uint64_t) > end)
+                return invalid();
+            pos += string_read<std::uint64_t>(str, pos, capacity);
+            pos += string_read<std::uint64_t>(str, pos, count);
+            pos += string_read<std::uint64_t>(str, pos, blocks);
+            // Checked before allocating, so that the sizes can't overflow
+            // or ask for more memory than the file holds
+            auto const blockBytes = BlockWords * sizeof(std::uint64_t);
+            if (blocks > (end - pos) / blockBytes ||
+                capacity > (blocks * BlockBits) / bitsPerKey_ ||
+                Level::Blocks(capacity, bitsPerKey_) != blocks ||
+                count > capacity)
+                return invalid();
+            auto level = std::make_unique<Level>(capacity, bitsPerKey_);
+            level->count = count;
+            for (std::size_t w = 0; w < blocks * BlockWords; w++)
+            {
+                std::uint64_t word;
+                pos += string_read<std::uint64_t>(str, pos, word);
+                level->words[w] = word;
+            }
+            levels_[i] = std::move(level);
+        }
+        size_ = levels;
+        return std::make_pair(true, std::error_condition());
+    }
+
+   private:
+    static constexpr std::size_t headerSize()
+    {
+        return 4 * sizeof(std::uint32_t) + 2 * sizeof(std::uint64_t);
+    }
+
+    std::pair<bool, std::error_condition> invalid()
+    {
+        Clear();
+        return std::make_pair(false, std::error_condition());
+    }
+
+    static std::uint64_t mix(std::uint64_t z)
+    {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    // Keys are usually hashes already, but are mixed anyway so that
+    // structured keys don't all land in the same block.
+    static void hash(key_type const& key, std::uint64_t& h1, std::uint64_t& h2)
+    {
+        std::uint64_t a = 0, b = 0;
+        auto limbs = key.backend().limbs();
+        for (std::size_t i = 0; i < key.backend().size(); i++)
+            (i % 2 == 0 ? a : b) ^= std::uint64_t(limbs[i]);
+        h1 = mix(a);
+        h2 = mix(b ^ h1);
+    }
+};
+}  // namespace keyvadb
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <system_error>
+#include "db/node.h"
+#include "db/encoding.h"
+#include "db/error.h"
+#include "db/crc32c.h"
+
+namespace keyvadb
+{
+// The first Size bytes of the keys file, describing how the nodes which
+// follow it are laid out. Nodes at each level of the tree can have a
+// different block size, so that the always cached upper levels can have a
+// much higher degree than the sparse leaves. Levels deeper than
+// blockSizes.size() use the last block size.
+//
+// It is rewritten after each flush to record the lengths of the keys and
+// values files that the flush committed, and is protected by a checksum.
+// There are two copies, written alternately, so that a torn write leaves
+// the previous flush's copy intact. The valid copy with the highest flush
+// sequence is the current one.
+template <std::uint32_t BITS>
+struct KeyFileHeader
+{
+    enum
+    {
+        Magic = 0x4B44564B,  // KVDK
+        Version = 5,
+        // A whole page for each copy, so nodes stay page aligned
+        Size = 4096,
+        Copies = 2,
+        Length = Copies * Size,
+        MaxLevels = 64,
+        // Room for the level, first and last keys and three entries
+        MinBlockSize = 2 * (BITS / 8) + 12 + 3 * (BITS / 8 + 20)
+    };
+
+    std::vector<std::uint32_t> blockSizes;
+    // Number of flushes committed since the file was created
+    std::uint64_t flushSequence = 0;
+    // File lengths after the last committed flush
+    std::uint64_t keysLength = 0;
+    std::uint64_t valuesLength = 0;
+
+    std::uint32_t BlockSize(std::uint32_t const level) const
+    {
+        return blockSizes[std::min<std::size_t>(level, blockSizes.size() - 1)];
+    }
+
+    std::uint32_t Degree(std::uint32_t const level) const
+    {
+        return Node<BITS>::CalculateDegree(BlockSize(level));
+    }
+
+    bool IsValid() const
+    {
+        if (blockSizes.empty() || blockSizes.size() > MaxLevels)
+            return false;
+        // Every node must have room for at least two keys
+        return std::all_of(blockSizes.cbegin(), blockSizes.cend(),
+                           [](std::uint32_t const blockSize)
+                           {
+                               return blockSize >= MinBlockSize &&
+                                      blockSize < (1U << 30) &&
+                                      Node<BITS>::CalculateDegree(blockSize) >=
+                                          3;
+                           });
+    }
+
+    std::string Write() const
+    {
+        std::string str(Size, '\0');
+        std::size_t pos = 0;
+        pos += string_replace<std::uint32_t>(Magic, pos, str);
+        pos += string_replace<std::uint32_t>(Version, pos, str);
+        pos += string_replace<std::uint32_t>(BITS, pos, str);
+        pos += string_replace<std::uint32_t>(blockSizes.size(), pos, str);
+        pos += string_replace(flushSequence, pos, str);
+        pos += string_replace(keysLength, pos, str);
+        pos += string_replace(valuesLength, pos, str);
+        for (auto const blockSize : blockSizes)
+            pos += string_replace<std::uint32_t>(blockSize, pos, str);
+        string_replace(checksum(str), checksumOffset, str);
+        return str;
+    }
+
+    std::error_condition Read(std::string const& str)
+    {
+        if (str.size() < Size)
+            return make_error_condition(db_error::bad_header);
+        std::uint32_t magic, version, bits, levels, crc;
+        string_read(str, checksumOffset, crc);
+        if (crc != checksum(str))
+            return make_error_condition(db_error::bad_header);
+        std::size_t pos = 0;
+        pos += string_read<std::uint32_t>(str, pos, magic);
+        pos += string_read<std::uint32_t>(str, pos, version);
+        pos += string_read<std::uint32_t>(str, pos, bits);
+        pos += string_read<std::uint32_t>(str, pos, levels);
+        if (magic != Magic || version != Version || bits != BITS ||
+            levels == 0 || levels > MaxLevels)
+            return make_error_condition(db_error::bad_header);
+        pos += string_read(str, pos, flushSequence);
+        pos += string_read(str, pos, keysLength);
+        pos += string_read(str, pos, valuesLength);
+        blockSizes.resize(levels);
+        for (auto& blockSize : blockSizes)
+            pos += string_read<std::uint32_t>(str, pos, blockSize);
+        if (!IsValid())
+            return make_error_condition(db_error::bad_header);
+        return std::error_condition();
+    }
+
+   private:
+    // The checksum is the last four bytes and covers everything before it
+    static const std::size_t checksumOffset = Size - sizeof(std::uint32_t);
+
+    static std::uint32_t checksum(std::string const& str)
+    {
+        return detail::Crc32c::Value(str.data(), checksumOffset);
+    }
+};
+}  // namespace keyvadb
@@ -3,6 +3,7 @@
 #include <cstdint>
 #include <cstddef>
 #include <map>
+#include <vector>
 #include <cassert>
 #include <system_error>
 #include "db/key.h"
@@ -11,32 +12,59 @@
 #include "db/buffer.h"
 #include "db/store.h"
 #include "db/delta.h"
+#include "db/trace.h"
+#include "db/filter.h"
+#include "db/arena.h"
 
 namespace keyvadb
 {
 // Journal is the where all changes to the keys and values occur
 // and the rollback file is created.
-template <std::uint32_t BITS>
+template <std::uint32_t BITS, std::uint32_t BLOCK_SIZE = 0>
 class Journal
 {
     using util = detail::KeyUtil<BITS>;
     using key_type = typename util::key_type;
     using value_store_type = ValueStore<BITS>;
     using key_value_type = KeyValue<BITS>;
-    using delta_type = Delta<BITS>;
-    using node_ptr = std::shared_ptr<Node<BITS>>;
-    using tree_type = Tree<BITS>;
+    using delta_type = Delta<BITS, BLOCK_SIZE>;
+    using node_ptr = std::shared_ptr<Node<BITS, BLOCK_SIZE>>;
+    using tree_type = Tree<BITS, BLOCK_SIZE>;
     using buffer_type = Buffer<BITS>;
+    using filter_type = KeyFilter<BITS>;
+    // A child of a node which has keys in the buffer to add
+    struct child_type
+    {
+        std::size_t index;
+        key_type first;
+        key_type last;
+        std::uint64_t id;
+    };
+    using delta_map_type = std::multimap<
+        std::uint32_t, delta_type, std::less<std::uint32_t>,
+        ArenaAllocator<std::pair<std::uint32_t const, delta_type>>>;
 
    private:
     buffer_type& buffer_;
     value_store_type& values_;
-    std::multimap<std::uint32_t, delta_type> deltas_;
+    filter_type* filter_;
+    // Everything allocated while processing a flush is released at once
+    // by Finish.
+    Arena arena_;
+    delta_map_type deltas_;
     std::uint64_t offset_;
+    std::uint64_t freed_;
+    FlushReport report_;
 
    public:
-    Journal(buffer_type& buffer, value_store_type& values)
-        : buffer_(buffer), values_(values)
+    // Committed keys are added to filter, if there is one
+    Journal(buffer_type& buffer, value_store_type& values,
+            filter_type* filter = nullptr)
+        : buffer_(buffer),
+          values_(values),
+          filter_(filter),
+          deltas_(ArenaAllocator<typename delta_map_type::value_type>(arena_)),
+          freed_(0)
     {
     }
 
@@ -48,40 +76,113 @@ class Journal
         std::tie(root, err) = tree.Root();
         if (err)
             return err;
-        return process(tree, root);
+        {
+            ScopedTimer timer(report_, "Journal::process");
+            if (auto err = process(tree, root))
+                return err;
+        }
+        report_.keys = buffer_.ReadyForCommitting();
+        for (auto const& kv : deltas_) report_.levels[kv.first]++;
+        report_.insertions = TotalInsertions();
+        report_.evictions = TotalEvictions();
+        report_.synthetics = TotalSynthetics();
+        report_.updates = TotalUpdates();
+        report_.deletions = TotalDeletions();
+        report_.freedBytes = freed_;
+        return std::error_condition();
     }
 
     std::error_condition Commit(tree_type& tree, std::size_t const batchSize)
     {
         // This is where the rollback file creation should go!
         // -->
+        if (auto err = WriteValues(batchSize))
+            return err;
+        if (auto err = WriteNodes(tree))
+            return err;
+        Finish();
+        return std::error_condition();
+    }
 
+    // The phases of Commit, exposed so that each can be timed.
+    std::error_condition WriteValues(std::size_t const batchSize)
+    {
         // This should build an iovec and use writev instead
         std::vector<std::uint8_t> writeBuffer;
         writeBuffer.reserve(batchSize);
-        while (buffer_.Write(batchSize, writeBuffer))
+        for (;;)
         {
+            {
+                ScopedTimer timer(report_, "Buffer::Write");
+                if (!buffer_.Write(batchSize, writeBuffer))
+                    break;
+            }
+            ScopedTimer timer(report_, "ValueStore::Append");
             if (auto err = values_.Append(writeBuffer))
                 return err;
+            report_.valueBytes += writeBuffer.size();
         }
+        return std::error_condition();
+    }
+
+    std::error_condition WriteNodes(tree_type& tree)
+    {
+        ScopedTimer timer(report_, "KeyStore::Set");
         // write deepest nodes first so that no parent can refer
         // to a non-existent child
         for (auto it = deltas_.crbegin(), end = deltas_.crend(); it != end;
              ++it)
+        {
             if (auto err = tree.Update(it->second.Current()))
                 return err;
+            report_.nodeBytes += tree.BlockSize(it->first);
+        }
+        return std::error_condition();
+    }
+
+    void Finish()
+    {
+        if (filter_)
+        {
+            // Must happen before the keys leave the buffer, so that a
+            // concurrent Get never misses a committed key.
+            ScopedTimer timer(report_, "KeyFilter::Add");
+            buffer_.EachCommitted([this](key_type const& key)
+                                  {
+                                      filter_->Add(key);
+                                  });
+        }
+        ScopedTimer timer(report_, "Buffer::Purge");
         buffer_.Purge();
         deltas_.clear();
-        return std::error_condition();
+        arena_.Reset();
     }
 
+    // Where the time went in each phase, filled in as the flush progresses.
+    FlushReport& Report() { return report_; }
+
     constexpr std::size_t Size() const { return deltas_.size(); }
 
+    // Bytes in the values file no longer referenced by the tree, because of
+    // overwrites and deletions.
+    constexpr std::uint64_t FreedBytes() const { return freed_; }
+
     std::uint64_t TotalInsertions() const
     {
-        std::uint64_t total = 0;
-        for (auto const& kv : deltas_) total += kv.second.Insertions();
-        return total;
+        return total(&delta_type::Insertions);
+    }
+    std::uint64_t TotalEvictions() const
+    {
+        return total(&delta_type::Evictions);
+    }
+    std::uint64_t TotalSynthetics() const
+    {
+        return total(&delta_type::Synthetics);
+    }
+    std::uint64_t TotalUpdates() const { return total(&delta_type::Updates); }
+    std::uint64_t TotalDeletions() const
+    {
+        return total(&delta_type::Deletions);
     }
 
     friend std::ostream& operator<<(std::ostream& stream,
@@ -97,43 +198,69 @@ class Journal
     }
 
    private:
+    std::uint64_t total(std::uint64_t (delta_type::*f)() const) const
+    {
+        std::uint64_t total = 0;
+        for (auto const& kv : deltas_) total += (kv.second.*f)();
+        return total;
+    }
+
     std::error_condition process(tree_type& tree, node_ptr const& node)
     {
-        delta_type delta(node);
+        delta_type delta(node, arena_);
         offset_ = delta.AddKeys(buffer_, offset_);
         assert(delta.CheckSanity());
         if (delta.Current()->EmptyKeyCount() == 0)
         {
-            auto err = delta.Current()->EachChild(
+            // Find the children with keys to add first, so that reads of all
+            // of them can be started before waiting for the first.
+            std::vector<child_type, ArenaAllocator<child_type>> children{
+                ArenaAllocator<child_type>(arena_)};
+            delta.Current()->EachChild(
                 [&](const std::size_t i, const key_type& first,
                     const key_type& last, const std::uint64_t cid)
                 {
-                    if (!buffer_.ContainsRange(first, last))
-                        return std::error_condition();
-                    if (cid == EmptyChild)
-                    {
-                        auto child =
-                            tree.CreateNode(node->Level() + 1, first, last);
-                        delta.SetChild(i, child->Id());
-                        return process(tree, child);
-                    }
-                    else
+                    if (buffer_.ContainsRange(first, last))
                     {
-                        node_ptr child;
-                        std::error_condition err;
-                        std::tie(child, err) = tree.GetNode(cid);
-                        if (err)
-                            return err;
-                        return process(tree, child);
+                        children.push_back(child_type{i, first, last, cid});
+                        if (cid != EmptyChild &&
+                            tree.Prefetch(cid, node->Level() + 1))
+                            report_.prefetches++;
                     }
+                    return std::error_condition();
                 });
-            if (err)
-                return err;
+            for (auto const& c : children)
+                if (auto err = processChild(tree, node, delta, c))
+                    return err;
         }
         assert(delta.CheckSanity());
+        freed_ += delta.FreedBytes();
         if (delta.Dirty())
             deltas_.emplace(node->Level(), delta);
         return std::error_condition();
     }
+
+    std::error_condition processChild(tree_type& tree, node_ptr const& node,
+                                      delta_type& delta, child_type const& c)
+    {
+        if (c.id == EmptyChild)
+        {
+            // Deleted keys can't exist below an empty child
+            if (!buffer_.ContainsInsertions(c.first, c.last))
+            {
+                buffer_.RemoveTombstones(c.first, c.last);
+                return std::error_condition();
+            }
+            auto child = tree.CreateNode(node->Level() + 1, c.first, c.last);
+            delta.SetChild(c.index, child->Id());
+            return process(tree, child);
+        }
+        node_ptr child;
+        std::error_condition err;
+        std::tie(child, err) = tree.GetNode(c.id, node->Level() + 1);
+        if (err)
+            return err;
+        return process(tree, child);
+    }
 };
 }  // namespace keyvadb
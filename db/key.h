@@ -5,9 +5,13 @@
 #include <boost/math/tools/precision.hpp>
 #include <cstdint>
 #include <cstddef>
+#include <cstring>
 #include <vector>
 #include <string>
 #include <limits>
+#include <algorithm>
+#include <type_traits>
+#include "db/slice.h"
 
 namespace keyvadb
 {
@@ -51,45 +55,98 @@ struct KeyUtil
 
     static key_type FromHex(std::string const& s) { return key_type("0x" + s); }
 
+    // Writes HexChars upper case hex digits to out
+    static void ToHex(key_type const& key, char* out)
+    {
+        static char const digits[] = "0123456789ABCDEF";
+        char bytes[Bytes];
+        ToBytes(key, bytes);
+        for (std::size_t i = 0; i < Bytes; i++)
+        {
+            auto const b = static_cast<unsigned char>(bytes[i]);
+            out[2 * i] = digits[b >> 4];
+            out[2 * i + 1] = digits[b & 0xf];
+        }
+    }
+
     static std::string ToHex(key_type const& key)
     {
-        std::stringstream ss;
-        ss << std::setw(BITS / 4) << std::setfill('0') << std::setbase(16)
-           << key;
-        return ss.str();
+        std::string str(HexChars, '\0');
+        ToHex(key, &str[0]);
+        return str;
+    }
+
+    // Writes the key to out as Bytes big endian bytes, a limb at a time.
+    // When Bytes isn't a whole number of limbs the top limb is partial.
+    static void ToBytes(key_type const& key, char* out)
+    {
+        auto const& backend = key.backend();
+        auto const limbs = backend.limbs();
+        std::size_t const size = backend.size();
+        std::size_t const limbBytes = sizeof(*limbs);
+        std::size_t i = 0;
+        for (; i < size && (i + 1) * limbBytes <= Bytes; i++)
+            storeBigEndian(limbs[i], out + Bytes - (i + 1) * limbBytes);
+        std::size_t const rest = Bytes - i * limbBytes;
+        if (i < size && rest > 0)
+        {
+            char limb[sizeof(*limbs)];
+            storeBigEndian(limbs[i], limb);
+            std::memcpy(out, limb + limbBytes - rest, rest);
+        }
+        else
+            std::memset(out, 0, rest);
     }
 
     static std::string ToBytes(key_type const& key)
     {
-        auto bytes = key.backend().limbs();
-        auto length = key.backend().size() * sizeof(*key.backend().limbs());
-        auto str = std::string(reinterpret_cast<const char*>(bytes), length);
-        std::reverse(str.begin(), str.end());
+        std::string str(Bytes, '\0');
+        ToBytes(key, &str[0]);
         return str;
     }
 
-    static key_type FromBytes(std::string const& str)
+    // Reads a key from length big endian bytes, of which the top limb may
+    // be partial
+    static key_type FromBytes(char const* data, std::size_t const length)
     {
         key_type key;
-        auto length = str.size() / sizeof(*key.backend().limbs());
-        key.backend().resize(length, length);
-        auto bytes = key.backend().limbs();
-        std::reverse_copy(str.cbegin(), str.cend(),
-                          reinterpret_cast<char*>(bytes));
-        key.backend().normalize();
+        auto& backend = key.backend();
+        using limb_type = std::remove_reference_t<decltype(*backend.limbs())>;
+        std::size_t const limbBytes = sizeof(limb_type);
+        std::size_t const whole = length / limbBytes;
+        std::size_t const rest = length % limbBytes;
+        std::size_t const size = whole + (rest > 0);
+        backend.resize(size, size);
+        auto limbs = backend.limbs();
+        for (std::size_t i = 0; i < whole; i++)
+            limbs[i] = loadBigEndian<limb_type>(data + length -
+                                                (i + 1) * limbBytes);
+        if (rest > 0)
+        {
+            char limb[sizeof(limb_type)] = {};
+            std::memcpy(limb + limbBytes - rest, data, rest);
+            limbs[whole] = loadBigEndian<limb_type>(limb);
+        }
+        backend.normalize();
         return key;
     }
 
+    static key_type FromBytes(Slice const str)
+    {
+        return FromBytes(str.data(), str.size());
+    }
+
+    // Writes Bytes bytes of the limbs as they are in memory, probably not
+    // portable
     static std::size_t WriteBytes(key_type const& key, const std::size_t pos,
                                   std::string& str)
     {
-        static const auto maxLength = MaxSize();
         auto bytes = key.backend().limbs();
-        auto limbLength = key.backend().size() * sizeof(*key.backend().limbs());
-        // Copy limbs into rightmost position, probably not portable
-        auto offset = maxLength - limbLength;
-        std::memcpy(&str[pos], bytes, maxLength - offset);
-        return maxLength;
+        std::size_t const limbLength =
+            key.backend().size() * sizeof(*key.backend().limbs());
+        std::memset(&str[pos], 0, Bytes);
+        std::memcpy(&str[pos], bytes, std::min<std::size_t>(limbLength, Bytes));
+        return Bytes;
     }
 
     static std::size_t ReadBytes(std::string const& str, const std::size_t pos,
@@ -100,10 +157,54 @@ struct KeyUtil
         // Make sure we have enough limbs for largest possible value
         key.backend().resize(limbLength, limbLength);
         auto bytes = key.backend().limbs();
-        std::memcpy(bytes, &str[pos], maxLength);
+        // The top limb is partial when Bytes isn't a whole number of limbs
+        std::memset(bytes, 0, maxLength);
+        std::memcpy(bytes, &str[pos], Bytes);
         // TODO(DH) Find out why this is necessary
         key.backend().normalize();
-        return maxLength;
+        return Bytes;
+    }
+
+    template <class T>
+    static void storeBigEndian(T value, char* out)
+    {
+        value = byteSwap(value, std::integral_constant<std::size_t,
+                                                       sizeof(T)>());
+        std::memcpy(out, &value, sizeof(T));
+    }
+
+    template <class T>
+    static T loadBigEndian(char const* in)
+    {
+        T value;
+        std::memcpy(&value, in, sizeof(T));
+        return byteSwap(value, std::integral_constant<std::size_t,
+                                                      sizeof(T)>());
+    }
+
+    // Keys are stored big endian, and limbs are little endian
+    template <class T>
+    static T byteSwap(T value, std::integral_constant<std::size_t, 1>)
+    {
+        return value;
+    }
+
+    template <class T>
+    static T byteSwap(T value, std::integral_constant<std::size_t, 2>)
+    {
+        return __builtin_bswap16(value);
+    }
+
+    template <class T>
+    static T byteSwap(T value, std::integral_constant<std::size_t, 4>)
+    {
+        return __builtin_bswap32(value);
+    }
+
+    template <class T>
+    static T byteSwap(T value, std::integral_constant<std::size_t, 8>)
+    {
+        return __builtin_bswap64(value);
     }
 
     static key_type Distance(key_type const& a, key_type const& b)
@@ -135,6 +236,90 @@ struct KeyUtil
         nearest--;
     }
 
+    // Does the work of NearestStride for many values with the same start
+    // and stride, without multiprecision division. Each quotient is
+    // estimated by dividing the top bits of the value's offset from start
+    // by the top 32 bits of the stride, which is out by at most one, and
+    // corrected by comparing against the boundaries start + i * stride
+    // either side of it.
+    class StrideDivider
+    {
+        key_type start_;
+        key_type stride_;
+        std::uint32_t shift_;
+        std::uint64_t divisor_;
+        // Strides from start to end_, the last boundary which fits in a key
+        std::uint32_t steps_;
+        key_type end_;
+
+       public:
+        // Values more than count strides from start fall back to
+        // NearestStride.
+        StrideDivider(key_type const& start, key_type const& stride,
+                      std::uint32_t const count)
+            : start_(start), stride_(stride), shift_(0), divisor_(0),
+              steps_(0), end_(start)
+        {
+            if (stride.is_zero())
+                return;
+            auto const bits = msb(stride) + 1;
+            shift_ = bits > 32 ? bits - 32 : 0;
+            divisor_ = static_cast<std::uint64_t>(stride >> shift_);
+            auto const room = Max() - start;
+            steps_ = count + 1;
+            // Only divides when the strides would run past Max
+            if (room / steps_ < stride)
+                steps_ = static_cast<std::uint32_t>(room / stride);
+            end_ = start + stride * steps_;
+        }
+
+        void Nearest(key_type const& value, key_type& distance,
+                     std::uint32_t& nearest) const
+        {
+            if (divisor_ == 0 || value < start_ || value >= end_)
+                return NearestStride(start_, stride_, value, distance,
+                                     nearest);
+            // The difference of the shifted value and start is out by at
+            // most one more, and fits in 64 bits as the offset is less than
+            // count + 1 strides.
+            auto q = (topBits(value) - topBits(start_)) / divisor_;
+            q = std::min<std::uint64_t>(q, steps_ - 1);
+            key_type lower = start_ + stride_ * q;
+            for (; lower > value; q--) lower -= stride_;
+            for (; value - lower >= stride_; q++) lower += stride_;
+            nearest = static_cast<std::uint32_t>(q);
+            // Round up first, as NearestStride does
+            if (nearest == 0)
+            {
+                distance = lower + stride_ - value;
+                return;
+            }
+            distance = value - lower;
+            nearest--;
+        }
+
+       private:
+        // The low 64 bits of key >> shift_, read straight from the limbs
+        std::uint64_t topBits(key_type const& key) const
+        {
+            auto const& backend = key.backend();
+            using limb_type = std::remove_const_t<
+                std::remove_pointer_t<decltype(backend.limbs())>>;
+            if (sizeof(limb_type) != sizeof(std::uint64_t))
+                return static_cast<std::uint64_t>(key >> shift_);
+            auto const limbs = backend.limbs();
+            auto const size = backend.size();
+            auto const index = shift_ / 64;
+            auto const bit = shift_ % 64;
+            std::uint64_t bits = 0;
+            if (index < size)
+                bits = std::uint64_t(limbs[index]) >> bit;
+            if (bit > 0 && index + 1 < size)
+                bits |= std::uint64_t(limbs[index + 1]) << (64 - bit);
+            return bits;
+        }
+    };
+
     static const key_type Max()
     {
         return boost::math::tools::max_value<key_type>();
@@ -2,10 +2,14 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <cstring>
+#include <array>
 #include <vector>
 #include <string>
 #include <system_error>
+#include <stdexcept>
 #include <algorithm>
+#include <cassert>
 #include <cmath>
 #include "db/key.h"
 #include "db/encoding.h"
@@ -14,27 +18,76 @@ namespace keyvadb
 {
 static const std::uint64_t EmptyChild = 0;
 
+namespace detail
+{
+// Always leaves room at the end of the block for the store's checksum
+template <std::uint32_t BITS>
+constexpr std::uint32_t NodeDegree(std::uint32_t const blockSize)
+{
+    return (blockSize - 2 * (BITS / 8) - 12) / (BITS / 8 + 20);
+}
+
+// An array of a node, of N entries when the degree is fixed at compile
+// time and sized at construction when N is zero
+template <class T, std::size_t N>
+struct NodeArray
+{
+    using type = std::array<T, N>;
+    static type Make(std::size_t const, T const& value)
+    {
+        type a;
+        a.fill(value);
+        return a;
+    }
+};
+
+template <class T>
+struct NodeArray<T, 0>
+{
+    using type = std::vector<T>;
+    static type Make(std::size_t const n, T const& value)
+    {
+        return type(n, value);
+    }
+};
+}  // namespace detail
+
 // Node invariants:
 // 1. keys must always be in sorted order,lowest to highest
 // 2. each key is unique, not including zero
 // 3. first_ must be lower than last_
 // 4. each non-zero key must be greater than first_ and less than last_
 // 5. no children must exist unless all keys are populated
-template <std::uint32_t BITS>
+//
+// A non-zero BLOCK_SIZE fixes the degree at compile time, so the arrays are
+// held in the node itself and the searches run to a constant bound. Such a
+// node can only be created with the degree of that block size.
+template <std::uint32_t BITS, std::uint32_t BLOCK_SIZE = 0>
 class Node
 {
    public:
     using util = detail::KeyUtil<BITS>;
     using key_type = typename util::key_type;
     using key_value_type = KeyValue<BITS>;
-    using key_values_type = std::vector<key_value_type>;
-    using children_type = std::vector<std::uint64_t>;
+    enum
+    {
+        Words = (util::Bytes + sizeof(std::uint64_t) - 1) /
+                sizeof(std::uint64_t),
+        // Zero if the degree is only known at run time
+        FixedDegree =
+            BLOCK_SIZE != 0 ? detail::NodeDegree<BITS>(BLOCK_SIZE) : 0,
+        FixedKeys = FixedDegree != 0 ? FixedDegree - 1 : 0
+    };
+    // A key as 64 bit words, most significant first, which sort as the
+    // keys do and are usually told apart by the first word. A key which
+    // isn't a whole number of words has its last word padded with zeros.
+    using key_words_type = std::array<std::uint64_t, Words>;
+    using children_type =
+        typename detail::NodeArray<std::uint64_t, FixedDegree>::type;
     using child_func = std::function<
         std::error_condition(const std::size_t, const key_type&,
                              const key_type&, const std::uint64_t)>;
-    using node_ptr = std::shared_ptr<Node<BITS>>;
-    using iterator = typename key_values_type::iterator;
-    using const_iterator = typename key_values_type::const_iterator;
+    using node_ptr = std::shared_ptr<Node>;
 
    private:
     std::uint64_t id_;
@@ -42,11 +95,27 @@ class Node
     std::uint32_t degree_;
     key_type first_;
     key_type last_;
+    // Kept so that a lookup needn't touch the first key to find out if
+    // the node is full
+    std::size_t emptyKeys_;
+    // Keys are hashes, and a full node's are placed near each stride from
+    // first_, so a key's slot is predicted from the first words of it and
+    // of first_ as (word - firstWord_) * slotScale_
+    std::uint64_t firstWord_;
+    double slotScale_;
+    // Structure of arrays, so that a search only touches the keys. The
+    // keys are stored a word at a time, all the first words then all the
+    // second and so on, so a search runs over the first words and only
+    // reads the rest of a key on a tie or a match.
+    typename detail::NodeArray<std::uint64_t, Words * FixedKeys>::type words_;
+    typename detail::NodeArray<std::uint64_t, FixedKeys>::type offsets_;
+    typename detail::NodeArray<std::uint32_t, FixedKeys>::type lengths_;
     children_type children_;
 
-   public:
-    key_values_type keys;
+    static_assert(BLOCK_SIZE == 0 || FixedDegree >= 3,
+                  "block size must hold at least two keys");
 
+   public:
     Node(std::uint64_t const id, std::uint32_t const level,
          std::uint32_t const degree, key_type const& first,
          key_type const& last)
@@ -55,35 +124,52 @@ class Node
           degree_(degree),
           first_(first),
           last_(last),
-          children_(degree),
-          keys(degree - 1)
+          emptyKeys_(degree - 1),
+          firstWord_(0),
+          slotScale_(0),
+          words_(detail::NodeArray<std::uint64_t, Words * FixedKeys>::Make(
+              Words * (degree - 1), 0)),
+          offsets_(detail::NodeArray<std::uint64_t, FixedKeys>::Make(
+              degree - 1, EmptyValue)),
+          lengths_(detail::NodeArray<std::uint32_t, FixedKeys>::Make(
+              degree - 1, 0)),
+          children_(detail::NodeArray<std::uint64_t, FixedDegree>::Make(
+              degree, EmptyChild))
     {
+        if (FixedDegree != 0 && degree != FixedDegree)
+            throw std::invalid_argument("degree must be " +
+                                        std::to_string(FixedDegree));
         if (first >= last)
             throw std::domain_error("first must be lower than last:" +
                                     util::ToHex(first) + " " +
                                     util::ToHex(last));
+        setSlotScale();
     }
 
-    static std::uint32_t CalculateDegree(std::uint32_t const blockSize)
+    static constexpr std::uint32_t CalculateDegree(
+        std::uint32_t const blockSize)
     {
-        static const std::uint32_t bytes = BITS / 8;
-        return (blockSize - 2 * bytes - 12) / (bytes + 20);
+        return detail::NodeDegree<BITS>(blockSize);
     }
 
+    // Each array is written whole, with the keys as big endian bytes
+    // without padding
     std::size_t Write(std::string& str) const
     {
         size_t pos = 0;
         pos += string_replace<std::uint32_t>(level_, pos, str);
-        pos += util::WriteBytes(first_, pos, str);
-        pos += util::WriteBytes(last_, pos, str);
-        for (auto const& kv : keys)
+        util::ToBytes(first_, &str[pos]);
+        pos += util::Bytes;
+        util::ToBytes(last_, &str[pos]);
+        pos += util::Bytes;
+        for (std::size_t i = 0; i < MaxKeys(); i++)
         {
-            pos += util::WriteBytes(kv.key, pos, str);
-            pos += string_replace<std::uint64_t>(kv.offset, pos, str);
-            pos += string_replace<std::uint32_t>(kv.length, pos, str);
+            storeWords(getWords(i), &str[pos]);
+            pos += util::Bytes;
         }
-        for (auto const& cid : children_)
-            pos += string_replace<std::uint64_t>(cid, pos, str);
+        pos += writeArray(offsets_, pos, str);
+        pos += writeArray(lengths_, pos, str);
+        pos += writeArray(children_, pos, str);
         return pos;
     }
 
@@ -91,16 +177,24 @@ class Node
     {
         size_t pos = 0;
         pos += string_read<std::uint32_t>(str, pos, level_);
-        pos += util::ReadBytes(str, pos, first_);
-        pos += util::ReadBytes(str, pos, last_);
-        for (auto& kv : keys)
+        first_ = util::FromBytes(&str[pos], util::Bytes);
+        pos += util::Bytes;
+        last_ = util::FromBytes(&str[pos], util::Bytes);
+        pos += util::Bytes;
+        setSlotScale();
+        for (std::size_t i = 0; i < MaxKeys(); i++)
         {
-            pos += util::ReadBytes(str, pos, kv.key);
-            pos += string_read<std::uint64_t>(str, pos, kv.offset);
-            pos += string_read<std::uint32_t>(str, pos, kv.length);
+            key_words_type words;
+            loadWords(&str[pos], words);
+            for (std::size_t w = 0; w < Words; w++) word(w, i) = words[w];
+            pos += util::Bytes;
         }
-        for (auto& cid : children_)
-            pos += string_read<std::uint64_t>(str, pos, cid);
+        // Empty keys sort first
+        emptyKeys_ = 0;
+        while (emptyKeys_ < MaxKeys() && IsZero(emptyKeys_)) emptyKeys_++;
+        pos += readArray(str, pos, offsets_);
+        pos += readArray(str, pos, lengths_);
+        pos += readArray(str, pos, children_);
         return pos;
     }
 
@@ -109,11 +203,11 @@ class Node
         auto const stride = Stride();
         auto cursor = first_ + stride;
         std::uint64_t count = 0;
-        for (auto& key : keys)
+        for (std::size_t i = 0; i < MaxKeys(); i++)
         {
-            if (key.IsZero())
+            if (IsZero(i))
             {
-                key = key_value_type{cursor, SyntheticValue, 0};
+                SetKeyValue(i, key_value_type{cursor, SyntheticValue, 0});
                 count++;
             }
             cursor += stride;
@@ -123,17 +217,24 @@ class Node
 
     void Clear()
     {
-        std::fill(keys.begin(), keys.end(), key_value_type{0, EmptyValue, 0});
+        std::fill(words_.begin(), words_.end(), 0);
+        emptyKeys_ = MaxKeys();
+        std::fill(offsets_.begin(), offsets_.end(), EmptyValue);
+        std::fill(lengths_.begin(), lengths_.end(), 0);
     }
 
+    // Indexes are checked by assert rather than at(), as these are on the
+    // path of every lookup
     void SetChild(std::size_t const i, std::uint64_t const cid)
     {
-        children_.at(i) = cid;
+        assert(i < children_.size());
+        children_[i] = cid;
     }
 
-    constexpr std::uint64_t GetChild(std::size_t const i) const
+    std::uint64_t GetChild(std::size_t const i) const
     {
-        return children_.at(i);
+        assert(i < children_.size());
+        return children_[i];
     }
 
     std::error_condition EachChild(child_func f) const
@@ -144,19 +245,18 @@ class Node
         {
             if (i == 0)
             {
-                if (!keys.at(i).IsZero())
-                    err = f(i, first_, keys.at(i).key, children_.at(i));
+                if (!IsZero(i))
+                    err = f(i, first_, GetKey(i), children_[i]);
             }
             else if (i == length - 1)
             {
-                if (!keys.at(i - 1).IsZero())
-                    err = f(i, keys.at(i - 1).key, last_, children_.at(i));
+                if (!IsZero(i - 1))
+                    err = f(i, GetKey(i - 1), last_, children_[i]);
             }
             else
             {
-                if (!keys.at(i - 1).IsZero() && !keys.at(i).IsZero())
-                    err = f(i, keys.at(i - 1).key, keys.at(i).key,
-                            children_.at(i));
+                if (!IsZero(i - 1) && !IsZero(i))
+                    err = f(i, GetKey(i - 1), GetKey(i), children_[i]);
             }
             if (err)
                 return err;
@@ -164,40 +264,112 @@ class Node
         return err;
     }
 
+    // Keys are sorted, with any empty keys first. The search starts at
+    // the key's predicted slot and gallops from there, so it takes one
+    // or two probes in a full node and is never worse than a binary
+    // search.
     bool Find(key_type const& key, key_value_type* value) const
     {
-        auto found = std::find_if(keys.cbegin(), keys.cend(),
-                                  [&key](key_value_type const& kv)
-                                  {
-            return kv.key == key;
-        });
-        if (found != keys.cend())
-            *value = *found;
-        return found != keys.cend();
+        std::size_t i;
+        return Find(key, value, i);
+    }
+
+    // As Find, but when key isn't one of the node's keys also sets i as
+    // FindChild does, or to Degree() if FindChild would return false. The
+    // one search serves both.
+    bool Find(key_type const& key, key_value_type* value,
+              std::size_t& i) const
+    {
+        key_words_type words;
+        toWords(key, words);
+        i = lowerBound(words);
+        // The first word rules out all but a match without reading the rest
+        if (i < MaxKeys() && word(0, i) == words[0] && getWords(i) == words)
+        {
+            *value = key_value_type{key, offsets_[i], lengths_[i]};
+            return true;
+        }
+        if (!inChildRange(key))
+            i = Degree();
+        return false;
+    }
+
+    // Sets i to the child whose range holds key, which must not be one of
+    // the node's keys. Returns false if the range isn't a child's, as the
+    // node has no children or the key is outside first to last.
+    bool FindChild(key_type const& key, std::size_t& i) const
+    {
+        if (!inChildRange(key))
+            return false;
+        key_words_type words;
+        toWords(key, words);
+        i = lowerBound(words);
+        return true;
+    }
+
+    key_type GetKey(std::size_t const i) const
+    {
+        assert(i < MaxKeys());
+        char bytes[util::Bytes];
+        storeWords(getWords(i), bytes);
+        return util::FromBytes(bytes, util::Bytes);
     }
 
-    constexpr key_value_type GetKeyValue(std::size_t const i) const
+    key_value_type GetKeyValue(std::size_t const i) const
     {
-        return keys.at(i);
+        return key_value_type{GetKey(i), offsets_[i], lengths_[i]};
     }
 
     void SetKeyValue(std::size_t const i, key_value_type const& kv)
     {
-        keys.at(i) = kv;
+        assert(i < MaxKeys());
+        emptyKeys_ += kv.IsZero();
+        emptyKeys_ -= IsZero(i);
+        key_words_type words;
+        toWords(kv.key, words);
+        for (std::size_t w = 0; w < Words; w++) word(w, i) = words[w];
+        SetValue(i, kv.offset, kv.length);
+    }
+
+    // Replaces the value of the i'th key, leaving the key alone
+    void SetValue(std::size_t const i, std::uint64_t const offset,
+                  std::uint32_t const length)
+    {
+        assert(i < MaxKeys());
+        offsets_[i] = offset;
+        lengths_[i] = length;
+    }
+
+    bool IsZero(std::size_t const i) const
+    {
+        assert(i < MaxKeys());
+        for (std::size_t w = 0; w < Words; w++)
+            if (word(w, i) != 0)
+                return false;
+        return true;
+    }
+
+    bool IsSynthetic(std::size_t const i) const
+    {
+        assert(i < offsets_.size());
+        return offsets_[i] == SyntheticValue;
     }
 
     bool IsSane() const
     {
         if (first_ >= last_)
             return false;
-        if (!std::is_sorted(keys.cbegin(), keys.cend()))
-            return false;
-        for (std::size_t i = 1; i < Degree() - 1; i++)
+        for (std::size_t i = 1; i < MaxKeys(); i++)
+            if (getWords(i) < getWords(i - 1))
+                return false;
+        for (std::size_t i = 0; i < MaxKeys(); i++)
         {
-            if (!keys.at(i).IsZero() && keys.at(i) == keys.at(i - 1))
+            if (IsZero(i))
+                continue;
+            if (i > 0 && getWords(i) == getWords(i - 1))
                 return false;
-            if (!keys.at(i).IsZero() &&
-                (keys.at(i).key <= first_ || keys.at(i).key >= last_))
+            auto const key = GetKey(i);
+            if (key <= first_ || key >= last_)
                 return false;
         }
         if (EmptyKeyCount() > 0 && EmptyChildCount() != Degree())
@@ -210,37 +382,26 @@ class Node
     constexpr key_type First() const { return first_; }
     constexpr key_type Last() const { return last_; }
 
-    constexpr const_iterator NonZeroBegin() const
-    {
-        return std::find_if_not(keys.cbegin(), keys.cend(),
-                                [](key_value_type const& kv)
-                                {
-            return kv.IsZero();
-        });
-    }
     constexpr bool Empty() const { return EmptyKeyCount() == MaxKeys(); }
 
-    constexpr std::size_t NonSyntheticKeyCount() const
-    {
-        return std::count_if(keys.cbegin(), keys.cend(),
-                             [](key_value_type const& kv)
-                             {
-            return !kv.IsZero() && !kv.IsSynthetic();
-        });
-    }
-    constexpr std::size_t NonEmptyKeyCount() const
+    std::size_t NonSyntheticKeyCount() const
     {
-        return std::distance(NonZeroBegin(), keys.cend());
+        std::size_t count = 0;
+        for (std::size_t i = EmptyKeyCount(); i < MaxKeys(); i++)
+            if (!IsSynthetic(i))
+                count++;
+        return count;
     }
-    constexpr std::size_t EmptyKeyCount() const
+    std::size_t NonEmptyKeyCount() const
     {
-        return std::distance(keys.cbegin(), NonZeroBegin());
+        return MaxKeys() - EmptyKeyCount();
     }
+    constexpr std::size_t EmptyKeyCount() const { return emptyKeys_; }
     constexpr std::size_t EmptyChildCount() const
     {
         return std::count(children_.cbegin(), children_.cend(), EmptyChild);
     }
-    constexpr std::size_t MaxKeys() const { return keys.size(); }
+    constexpr std::size_t MaxKeys() const { return offsets_.size(); }
     constexpr std::size_t Degree() const { return children_.size(); }
     constexpr key_type Distance() const
     {
@@ -251,6 +412,154 @@ class Node
         return util::Stride(first_, last_, Degree());
     }
 
+   private:
+    // Empty keys are never a child's bounds, so a node with any has no
+    // children
+    bool inChildRange(key_type const& key) const
+    {
+        return key > first_ && key < last_ && emptyKeys_ == 0;
+    }
+
+    static void toWords(key_type const& key, key_words_type& words)
+    {
+        char bytes[util::Bytes];
+        util::ToBytes(key, bytes);
+        loadWords(bytes, words);
+    }
+
+    // Reads a key from util::Bytes big endian bytes
+    static void loadWords(char const* bytes, key_words_type& words)
+    {
+        char padded[sizeof(key_words_type)] = {};
+        std::memcpy(padded, bytes, util::Bytes);
+        for (std::size_t w = 0; w < Words; w++)
+            words[w] = util::template loadBigEndian<std::uint64_t>(
+                padded + w * sizeof(std::uint64_t));
+    }
+
+    // Writes a key as util::Bytes big endian bytes, dropping the padding
+    static void storeWords(key_words_type const& words, char* bytes)
+    {
+        char padded[sizeof(key_words_type)];
+        for (std::size_t w = 0; w < Words; w++)
+            util::storeBigEndian(words[w],
+                                 padded + w * sizeof(std::uint64_t));
+        std::memcpy(bytes, padded, util::Bytes);
+    }
+
+    // The w'th word of the i'th key
+    std::uint64_t& word(std::size_t const w, std::size_t const i)
+    {
+        return words_[w * MaxKeys() + i];
+    }
+
+    std::uint64_t word(std::size_t const w, std::size_t const i) const
+    {
+        return words_[w * MaxKeys() + i];
+    }
+
+    key_words_type getWords(std::size_t const i) const
+    {
+        key_words_type words;
+        for (std::size_t w = 0; w < Words; w++) words[w] = word(w, i);
+        return words;
+    }
+
+    void setSlotScale()
+    {
+        key_words_type first, last;
+        toWords(first_, first);
+        toWords(last_, last);
+        firstWord_ = first[0];
+        // Bounds sharing a first word predict slot 0, and the gallop does
+        // the rest
+        slotScale_ = last[0] > first[0]
+                         ? double(Degree()) / double(last[0] - first[0])
+                         : 0;
+    }
+
+    std::size_t predictSlot(std::uint64_t const word) const
+    {
+        if (word <= firstWord_)
+            return 0;
+        // Clamped before converting, as a key beyond last_ in a node with
+        // a narrow range predicts a slot too big for a std::size_t
+        auto const slot = std::min(double(word - firstWord_) * slotScale_,
+                                   double(MaxKeys() - 1));
+        return static_cast<std::size_t>(slot);
+    }
+
+    // The index of the first key not less than words. Hashes almost
+    // always differ in the first word, so keys sharing one are few and
+    // are stepped over by comparing the rest.
+    std::size_t lowerBound(key_words_type const& words) const
+    {
+        auto const first = words_.data();
+        auto const n = MaxKeys();
+        auto const target = words[0];
+        auto const slot = predictSlot(target);
+        std::size_t lo;
+        std::size_t hi;
+        std::size_t step = 1;
+        if (first[slot] < target)
+        {
+            // Gallop right, keeping first[lo - 1] < target
+            lo = slot + 1;
+            hi = lo;
+            while (hi < n && first[hi] < target)
+            {
+                lo = hi + 1;
+                hi = lo + step;
+                step *= 2;
+            }
+            hi = std::min(hi, n);
+        }
+        else
+        {
+            // Gallop left, keeping first[hi] >= target
+            hi = slot;
+            for (;;)
+            {
+                if (hi < step)
+                {
+                    lo = 0;
+                    break;
+                }
+                lo = hi - step;
+                if (first[lo] < target)
+                {
+                    lo++;
+                    break;
+                }
+                hi = lo;
+                step *= 2;
+            }
+        }
+        std::size_t i =
+            std::distance(first, std::lower_bound(first + lo, first + hi,
+                                                  target));
+        while (i < n && first[i] == target && getWords(i) < words) i++;
+        return i;
+    }
+
+    template <class Array>
+    static std::size_t writeArray(Array const& v, std::size_t const pos,
+                                  std::string& str)
+    {
+        auto const length = v.size() * sizeof(typename Array::value_type);
+        std::memcpy(&str[pos], v.data(), length);
+        return length;
+    }
+
+    template <class Array>
+    static std::size_t readArray(std::string const& str,
+                                 std::size_t const pos, Array& v)
+    {
+        auto const length = v.size() * sizeof(typename Array::value_type);
+        std::memcpy(v.data(), &str[pos], length);
+        return length;
+    }
+
     friend std::ostream& operator<<(std::ostream& stream, const Node& node)
     {
         stream << "Id:\t\t" << node.id_ << std::endl;
@@ -266,16 +575,15 @@ class Node
         for (std::size_t i = 0; i < node.MaxKeys(); i++)
         {
             stream << std::setfill('0') << std::setw(3) << i << " ";
-            stream << util::ToHex(node.keys.at(i).key) << " ";
-            if (node.keys.at(i).offset == SyntheticValue)
+            stream << util::ToHex(node.GetKey(i)) << " ";
+            if (node.IsSynthetic(i))
             {
                 stream << "Synthetic"
                        << " ";
             }
             else
             {
-                stream << node.keys.at(i).offset << " "
-                       << node.keys.at(i).length << " ";
+                stream << node.offsets_[i] << " " << node.lengths_[i] << " ";
             }
             stream << node.children_.at(i) << " " << node.children_.at(i + 1);
             stream << std::endl;
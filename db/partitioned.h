@@ -0,0 +1,184 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <string>
+#include <system_error>
+#include "db/db.h"
+
+namespace keyvadb
+{
+// Splits the key space by the top options.partitionBits of each key into
+// independent DBs, each with its own files, buffer, tree and flush thread,
+// so that flushing can use more than one core. Keys are hashes, so each
+// partition receives an equal share of the keys, and the cache budget is
+// divided equally between them. The partitions share one AsyncReader, so
+// that one Poll carries on the GetAsync lookups of all of them.
+//
+// Partition i stores its files at the names given in options with ".i"
+// appended. With zero partitionBits there is one partition which uses the
+// names unchanged, so an existing DB can be opened as a PartitionedDB. The
+// number of partitions can't be changed once a DB has been created.
+//
+// The flushCallback, if any, is called concurrently from the flush thread
+// of each partition. BLOCK_SIZE is passed to each DB.
+template <std::uint32_t BITS, class Log = NullLog,
+          std::uint32_t BLOCK_SIZE = 0>
+class PartitionedDB
+{
+    using db_type = DB<BITS, Log, BLOCK_SIZE>;
+    using db_ptr = std::unique_ptr<db_type>;
+    using key_value_func =
+        std::function<void(Slice, Slice)>;
+    using get_callback =
+        std::function<void(std::error_condition, std::string const &)>;
+
+    enum
+    {
+        key_length = BITS / 8
+    };
+
+    std::uint32_t const partitionBits_;
+    // Shared by the partitions, and drained before any of them is destroyed
+    std::shared_ptr<AsyncReader> reads_;
+    std::vector<db_ptr> partitions_;
+
+   public:
+    using value_ptr = typename db_type::value_ptr;
+
+    explicit PartitionedDB(Options const &options)
+        : partitionBits_(options.partitionBits),
+          reads_(options.asyncDepth > 0
+                     ? CreateAsyncReader(options.asyncDepth)
+                     : nullptr)
+    {
+        std::uint32_t const n = 1U << std::min(partitionBits_, 8U);
+        for (std::uint32_t i = 0; i < n; i++)
+            partitions_.push_back(std::make_unique<db_type>(
+                partitionOptions(options, i), reads_));
+    }
+    PartitionedDB(PartitionedDB const &) = delete;
+    PartitionedDB &operator=(PartitionedDB const &) = delete;
+
+    ~PartitionedDB()
+    {
+        // Finish every outstanding GetAsync first
+        if (reads_)
+            while (reads_->Pending() > 0) reads_->Poll(true);
+    }
+
+    // Not threadsafe
+    std::error_condition Open()
+    {
+        for (auto &db : partitions_)
+            if (auto err = db->Open())
+                return err;
+        return std::error_condition();
+    }
+
+    // Not threadsafe
+    std::error_condition Clear()
+    {
+        for (auto &db : partitions_)
+            if (auto err = db->Clear())
+                return err;
+        return std::error_condition();
+    }
+
+    std::error_condition Get(Slice const key, std::string *value)
+    {
+        if (key.length() != key_length)
+            return db_error::key_wrong_length;
+        return partition(key).Get(key, value);
+    }
+
+    std::error_condition Get(Slice const key, value_ptr *value)
+    {
+        if (key.length() != key_length)
+            return db_error::key_wrong_length;
+        return partition(key).Get(key, value);
+    }
+
+    void GetAsync(Slice const key, get_callback callback)
+    {
+        if (key.length() != key_length)
+            return callback(make_error_condition(db_error::key_wrong_length),
+                            std::string());
+        partition(key).GetAsync(key, std::move(callback));
+    }
+
+    std::size_t Poll(bool const wait = false)
+    {
+        return reads_ ? reads_->Poll(wait) : 0;
+    }
+
+    std::size_t Pending() const { return reads_ ? reads_->Pending() : 0; }
+
+    std::error_condition Put(Slice const key, Slice const value)
+    {
+        if (key.length() != key_length)
+            return db_error::key_wrong_length;
+        return partition(key).Put(key, value);
+    }
+
+    std::error_condition Delete(Slice const key)
+    {
+        if (key.length() != key_length)
+            return db_error::key_wrong_length;
+        return partition(key).Delete(key);
+    }
+
+    // Returns keys and values in insertion order within each partition,
+    // one partition after another.
+    std::error_condition Each(key_value_func f)
+    {
+        for (auto &db : partitions_)
+            if (auto err = db->Each(f))
+                return err;
+        return std::error_condition();
+    }
+
+    std::uint64_t FreedBytes() const
+    {
+        std::uint64_t total = 0;
+        for (auto const &db : partitions_) total += db->FreedBytes();
+        return total;
+    }
+
+    Stats GetStats() const
+    {
+        Stats stats;
+        for (auto const &db : partitions_) stats.Merge(db->GetStats());
+        return stats;
+    }
+
+    std::size_t Partitions() const { return partitions_.size(); }
+
+   private:
+    db_type &partition(Slice const key)
+    {
+        return *partitions_[detail::PartitionOf(key, partitionBits_)];
+    }
+
+    static Options partitionOptions(Options options, std::uint32_t const i)
+    {
+        options.partition = i;
+        if (options.partitionBits == 0)
+            return options;
+        auto const n = std::uint64_t(1) << options.partitionBits;
+        auto const suffix = "." + std::to_string(i);
+        options.cacheSize = std::max<std::uint64_t>(1, options.cacheSize / n);
+        options.valueCacheSize /= n;
+        options.keyFileName += suffix;
+        options.valueFileName += suffix;
+        options.filterFileName += suffix;
+        if (!options.cacheFileName.empty())
+            options.cacheFileName += suffix;
+        if (!options.traceFileName.empty())
+            options.traceFileName += suffix;
+        return options;
+    }
+};
+}  // namespace keyvadb
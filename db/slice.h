@@ -0,0 +1,12 @@
+#pragma once
+
+#include <boost/utility/string_view.hpp>
+
+namespace keyvadb
+{
+// A pointer and length into bytes owned by someone else, such as a caller's
+// buffer or a block read from disk. Builds implicitly from std::string and
+// string literals, so callers holding their own buffers don't have to copy
+// them into a std::string first.
+using Slice = boost::string_view;
+}  // namespace keyvadb
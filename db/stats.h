@@ -0,0 +1,401 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+namespace keyvadb
+{
+// A log-linear histogram in the style of HdrHistogram. Each power of two is
+// split into SubBuckets linear buckets, giving a relative error of at most
+// 1/SubBuckets over the whole uint64_t range.
+class Histogram
+{
+   public:
+    enum
+    {
+        SubBucketBits = 4,
+        SubBuckets = 1 << SubBucketBits,
+        Buckets = (64 - SubBucketBits + 1) * SubBuckets
+    };
+    using buckets_type = std::array<std::uint64_t, Buckets>;
+
+   private:
+    buckets_type buckets_{};
+    std::uint64_t count_ = 0;
+    std::uint64_t sum_ = 0;
+    std::uint64_t max_ = 0;
+
+   public:
+    static std::size_t Bucket(std::uint64_t const value)
+    {
+        if (value < SubBuckets)
+            return value;
+        std::size_t msb = 63 - __builtin_clzll(value);
+        std::size_t shift = msb - SubBucketBits;
+        return (shift + 1) * SubBuckets + ((value >> shift) & (SubBuckets - 1));
+    }
+
+    // Smallest value which falls into bucket i
+    static std::uint64_t LowerBound(std::size_t const i)
+    {
+        if (i < SubBuckets)
+            return i;
+        std::size_t shift = i / SubBuckets - 1;
+        return std::uint64_t(SubBuckets + i % SubBuckets) << shift;
+    }
+
+    // Largest value which falls into bucket i
+    static std::uint64_t UpperBound(std::size_t const i)
+    {
+        if (i + 1 == Buckets)
+            return std::numeric_limits<std::uint64_t>::max();
+        return LowerBound(i + 1) - 1;
+    }
+
+    void Add(std::uint64_t const value)
+    {
+        buckets_[Bucket(value)]++;
+        count_++;
+        sum_ += value;
+        max_ = std::max(max_, value);
+    }
+
+    void Add(std::size_t const bucket, std::uint64_t const count)
+    {
+        buckets_[bucket] += count;
+        count_ += count;
+    }
+
+    void AddSum(std::uint64_t const sum, std::uint64_t const max)
+    {
+        sum_ += sum;
+        max_ = std::max(max_, max);
+    }
+
+    void Merge(Histogram const& other)
+    {
+        for (std::size_t i = 0; i < Buckets; i++)
+            buckets_[i] += other.buckets_[i];
+        count_ += other.count_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    // Returns the upper bound of the bucket containing the p'th percentile,
+    // where p is between 0 and 1.
+    std::uint64_t Percentile(double const p) const
+    {
+        if (count_ == 0)
+            return 0;
+        auto const target = std::max<std::uint64_t>(1, std::ceil(p * count_));
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < Buckets; i++)
+        {
+            seen += buckets_[i];
+            if (seen >= target)
+                return std::min(UpperBound(i), max_);
+        }
+        return max_;
+    }
+
+    constexpr std::uint64_t Count() const { return count_; }
+    constexpr std::uint64_t Sum() const { return sum_; }
+    constexpr std::uint64_t Max() const { return max_; }
+    double Mean() const { return count_ > 0 ? double(sum_) / count_ : 0; }
+
+    std::string ToString() const
+    {
+        std::stringstream ss;
+        ss << "Count: " << count_ << " Mean: " << std::fixed
+           << std::setprecision(1) << Mean() << " P50: " << Percentile(0.5)
+           << " P99: " << Percentile(0.99) << " P999: " << Percentile(0.999)
+           << " Max: " << max_;
+        return ss.str();
+    }
+};
+
+// A consistent-enough copy of all the statistics of a DB. Latencies are in
+// nanoseconds.
+struct Stats
+{
+    std::uint64_t gets = 0;
+    std::uint64_t puts = 0;
+    std::uint64_t deletes = 0;
+    std::uint64_t bufferHits = 0;
+    std::uint64_t keyMisses = 0;
+    std::uint64_t valueHits = 0;
+    std::uint64_t valueMisses = 0;
+    // Gets for missing keys answered by the filter
+    std::uint64_t filterNegatives = 0;
+
+    std::uint64_t flushes = 0;
+    std::uint64_t flushErrors = 0;
+    std::uint64_t flushedNodes = 0;
+    std::uint64_t insertions = 0;
+    std::uint64_t evictions = 0;
+    std::uint64_t synthetics = 0;
+    std::uint64_t updates = 0;
+    std::uint64_t deletions = 0;
+    std::uint64_t freedBytes = 0;
+
+    std::uint64_t bufferSize = 0;
+    std::uint64_t cacheSize = 0;
+    std::uint64_t cacheHits = 0;
+    std::uint64_t cacheMisses = 0;
+    std::uint64_t cacheInserts = 0;
+    std::uint64_t cacheUpdates = 0;
+    // In bytes
+    std::uint64_t valueCacheSize = 0;
+    std::uint64_t valueCacheHits = 0;
+    std::uint64_t valueCacheMisses = 0;
+    // Values read from disk which weren't cached as they were less
+    // popular than the value they would have evicted
+    std::uint64_t valueCacheRejections = 0;
+
+    Histogram getLatency;
+    Histogram putLatency;
+    Histogram flushProcessLatency;
+    Histogram flushValuesLatency;
+    Histogram flushNodesLatency;
+    Histogram syncLatency;
+    // Number of keys in the buffer, sampled on every put
+    Histogram bufferOccupancy;
+
+    // Sums the statistics of several DBs, such as the partitions of a
+    // PartitionedDB.
+    void Merge(Stats const& other)
+    {
+        gets += other.gets;
+        puts += other.puts;
+        deletes += other.deletes;
+        bufferHits += other.bufferHits;
+        keyMisses += other.keyMisses;
+        valueHits += other.valueHits;
+        valueMisses += other.valueMisses;
+        filterNegatives += other.filterNegatives;
+        flushes += other.flushes;
+        flushErrors += other.flushErrors;
+        flushedNodes += other.flushedNodes;
+        insertions += other.insertions;
+        evictions += other.evictions;
+        synthetics += other.synthetics;
+        updates += other.updates;
+        deletions += other.deletions;
+        freedBytes += other.freedBytes;
+        bufferSize += other.bufferSize;
+        cacheSize += other.cacheSize;
+        cacheHits += other.cacheHits;
+        cacheMisses += other.cacheMisses;
+        cacheInserts += other.cacheInserts;
+        cacheUpdates += other.cacheUpdates;
+        valueCacheSize += other.valueCacheSize;
+        valueCacheHits += other.valueCacheHits;
+        valueCacheMisses += other.valueCacheMisses;
+        valueCacheRejections += other.valueCacheRejections;
+        getLatency.Merge(other.getLatency);
+        putLatency.Merge(other.putLatency);
+        flushProcessLatency.Merge(other.flushProcessLatency);
+        flushValuesLatency.Merge(other.flushValuesLatency);
+        flushNodesLatency.Merge(other.flushNodesLatency);
+        syncLatency.Merge(other.syncLatency);
+        bufferOccupancy.Merge(other.bufferOccupancy);
+    }
+
+    std::string ToString() const
+    {
+        std::stringstream ss;
+        ss << "Gets: " << gets << " Puts: " << puts << " Deletes: " << deletes
+           << " Buffer hits: " << bufferHits << " Key misses: " << keyMisses
+           << " Value hits: " << valueHits << " Value misses: " << valueMisses
+           << " Filter negatives: " << filterNegatives << std::endl;
+        ss << "Flushes: " << flushes << " Errors: " << flushErrors
+           << " Nodes: " << flushedNodes << " Insertions: " << insertions
+           << " Evictions: " << evictions << " Synthetics: " << synthetics
+           << " Updates: " << updates << " Deletions: " << deletions
+           << " Freed bytes: " << freedBytes << std::endl;
+        ss << "Buffer size: " << bufferSize << " Cache size: " << cacheSize
+           << " Hits: " << cacheHits << " Misses: " << cacheMisses
+           << " Inserts: " << cacheInserts << " Updates: " << cacheUpdates
+           << std::endl;
+        ss << "Value cache size: " << valueCacheSize
+           << " Hits: " << valueCacheHits << " Misses: " << valueCacheMisses
+           << " Rejections: " << valueCacheRejections << std::endl;
+        ss << "Get:           " << getLatency.ToString() << std::endl;
+        ss << "Put:           " << putLatency.ToString() << std::endl;
+        ss << "Flush process: " << flushProcessLatency.ToString() << std::endl;
+        ss << "Flush values:  " << flushValuesLatency.ToString() << std::endl;
+        ss << "Flush nodes:   " << flushNodesLatency.ToString() << std::endl;
+        ss << "Sync:          " << syncLatency.ToString() << std::endl;
+        ss << "Buffer:        " << bufferOccupancy.ToString();
+        return ss.str();
+    }
+};
+
+// Collects counters and histograms without locks. Each thread records into
+// one of a fixed number of shards using relaxed atomics, and Snapshot sums
+// the shards.
+class StatsRecorder
+{
+   public:
+    enum Counter
+    {
+        Gets,
+        Puts,
+        Deletes,
+        BufferHits,
+        KeyMisses,
+        ValueHits,
+        ValueMisses,
+        FilterNegatives,
+        Flushes,
+        FlushErrors,
+        FlushedNodes,
+        Insertions,
+        Evictions,
+        Synthetics,
+        Updates,
+        Deletions,
+        FreedBytes,
+        CounterCount
+    };
+
+    enum Timer
+    {
+        GetLatency,
+        PutLatency,
+        FlushProcessLatency,
+        FlushValuesLatency,
+        FlushNodesLatency,
+        SyncLatency,
+        BufferOccupancy,
+        TimerCount
+    };
+
+    using clock = std::chrono::steady_clock;
+
+   private:
+    enum
+    {
+        Shards = 8
+    };
+
+    using counter_type = std::atomic_uint_fast64_t;
+
+    struct AtomicHistogram
+    {
+        std::array<counter_type, Histogram::Buckets> buckets;
+        counter_type sum;
+        counter_type max;
+    };
+
+    struct Shard
+    {
+        std::array<counter_type, CounterCount> counters;
+        std::array<AtomicHistogram, TimerCount> histograms;
+    };
+
+    // Value initialised, so all counters start at zero
+    std::unique_ptr<Shard[]> shards_{new Shard[Shards]()};
+
+   public:
+    void Add(Counter const counter, std::uint64_t const n = 1)
+    {
+        shard().counters[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void Record(Timer const timer, std::uint64_t const value)
+    {
+        auto& h = shard().histograms[timer];
+        h.buckets[Histogram::Bucket(value)].fetch_add(
+            1, std::memory_order_relaxed);
+        h.sum.fetch_add(value, std::memory_order_relaxed);
+        auto max = h.max.load(std::memory_order_relaxed);
+        while (value > max &&
+               !h.max.compare_exchange_weak(max, value,
+                                            std::memory_order_relaxed))
+        {
+        }
+    }
+
+    // Records the nanoseconds elapsed since start and returns now
+    clock::time_point RecordSince(Timer const timer,
+                                  clock::time_point const start)
+    {
+        auto now = clock::now();
+        Record(timer, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          now - start).count());
+        return now;
+    }
+
+    std::uint64_t Get(Counter const counter) const
+    {
+        std::uint64_t total = 0;
+        for (std::size_t i = 0; i < Shards; i++)
+            total += shards_[i].counters[counter].load(
+                std::memory_order_relaxed);
+        return total;
+    }
+
+    Histogram Get(Timer const timer) const
+    {
+        Histogram h;
+        for (std::size_t i = 0; i < Shards; i++)
+        {
+            auto const& a = shards_[i].histograms[timer];
+            for (std::size_t b = 0; b < Histogram::Buckets; b++)
+                if (auto n = a.buckets[b].load(std::memory_order_relaxed))
+                    h.Add(b, n);
+            h.AddSum(a.sum.load(std::memory_order_relaxed),
+                     a.max.load(std::memory_order_relaxed));
+        }
+        return h;
+    }
+
+    // Fills in everything except the buffer and cache gauges
+    void Snapshot(Stats& stats) const
+    {
+        stats.gets = Get(Gets);
+        stats.puts = Get(Puts);
+        stats.deletes = Get(Deletes);
+        stats.bufferHits = Get(BufferHits);
+        stats.keyMisses = Get(KeyMisses);
+        stats.valueHits = Get(ValueHits);
+        stats.valueMisses = Get(ValueMisses);
+        stats.filterNegatives = Get(FilterNegatives);
+        stats.flushes = Get(Flushes);
+        stats.flushErrors = Get(FlushErrors);
+        stats.flushedNodes = Get(FlushedNodes);
+        stats.insertions = Get(Insertions);
+        stats.evictions = Get(Evictions);
+        stats.synthetics = Get(Synthetics);
+        stats.updates = Get(Updates);
+        stats.deletions = Get(Deletions);
+        stats.freedBytes = Get(FreedBytes);
+        stats.getLatency = Get(GetLatency);
+        stats.putLatency = Get(PutLatency);
+        stats.flushProcessLatency = Get(FlushProcessLatency);
+        stats.flushValuesLatency = Get(FlushValuesLatency);
+        stats.flushNodesLatency = Get(FlushNodesLatency);
+        stats.syncLatency = Get(SyncLatency);
+        stats.bufferOccupancy = Get(BufferOccupancy);
+    }
+
+   private:
+    Shard& shard()
+    {
+        static std::atomic_uint_fast32_t next(0);
+        static thread_local std::size_t index = next++ % Shards;
+        return shards_[index];
+    }
+};
+}  // namespace keyvadb
@@ -1,25 +1,33 @@
 #pragma once
 
 #include <algorithm>
+#include <functional>
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include <utility>
 #include "db/key.h"
+#include "db/slice.h"
 #include "db/node.h"
+#include "db/header.h"
 #include "db/env.h"
 #include "db/encoding.h"
 #include "db/error.h"
+#include "db/crc32c.h"
 
 namespace keyvadb
 {
+// Appends records of a uint32_t length, a CRC32C of the key and value, the
+// key and the value. Get verifies the checksum if verify is set, and Each
+// always does.
 template <std::uint32_t BITS>
 class ValueStore
 {
     using util = detail::KeyUtil<BITS>;
     using key_type = typename util::key_type;
     using file_type = std::unique_ptr<RandomAccessFile>;
-    using key_value_func =
-        std::function<void(std::string const&, std::string const&)>;
+    using key_value_func = std::function<void(Slice, Slice)>;
 
    private:
     enum
@@ -28,10 +36,20 @@ class ValueStore
     };
     file_type file_;
     std::atomic_uint_fast64_t size_;
+    bool const verify_;
+    // Gets of a mapped file are random, so its readahead is turned down
+    AccessPattern const pattern_;
     static const std::size_t value_offset;
+    static const std::size_t key_offset;
 
    public:
-    explicit ValueStore(file_type& file) : file_(std::move(file)) {}
+    explicit ValueStore(file_type& file, bool const verify = true,
+                        bool const mapped = false)
+        : file_(std::move(file)),
+          verify_(verify),
+          pattern_(mapped ? AccessPattern::Random : AccessPattern::Normal)
+    {
+    }
     ValueStore(const ValueStore&) = delete;
     ValueStore& operator=(const ValueStore&) = delete;
 
@@ -39,6 +57,8 @@ class ValueStore
     {
         if (auto err = file_->OpenAppend())
             return err;
+        if (pattern_ != AccessPattern::Normal)
+            file_->Advise(pattern_);
         return file_->Size(size_);
     }
     std::error_condition Clear()
@@ -51,9 +71,11 @@ class ValueStore
                              std::uint32_t const length,
                              std::string* value) const
     {
-        value->resize(length - value_offset);
-        if (value->size() == 0)
+        if (length <= value_offset)
             throw std::runtime_error("zero length read");
+        if (verify_)
+            return getVerified(offset, length, value);
+        value->resize(length - value_offset);
         std::size_t bytesRead;
         std::error_condition err;
         std::tie(bytesRead, err) = file_->ReadAt(offset + value_offset, *value);
@@ -64,6 +86,49 @@ class ValueStore
         return std::error_condition();
     }
 
+    // As Get, but read through reader, which calls done from its Poll.
+    // value must stay valid until then.
+    void GetAsync(AsyncReader& reader, std::uint64_t const offset,
+                  std::uint32_t const length, std::string* value,
+                  std::function<void(std::error_condition)> done) const
+    {
+        if (length <= value_offset)
+            throw std::runtime_error("zero length read");
+        if (!verify_)
+        {
+            value->resize(length - value_offset);
+            return file_->ReadAtAsync(
+                reader, offset + value_offset, *value,
+                [value, done](std::size_t const bytesRead,
+                              std::error_condition const err)
+                {
+                    if (err)
+                        return done(err);
+                    if (bytesRead < value->length())
+                        return done(make_error_condition(db_error::short_read));
+                    done(std::error_condition());
+                });
+        }
+        // The whole record is read into value, and the value moved to the
+        // front once it is verified
+        value->resize(length);
+        file_->ReadAtAsync(
+            reader, offset, *value,
+            [value, length, done](std::size_t const bytesRead,
+                                  std::error_condition const err)
+            {
+                if (err)
+                    return done(err);
+                if (bytesRead < value->length())
+                    return done(make_error_condition(db_error::short_read));
+                if (!checkRecord(*value, 0, length))
+                    return done(
+                        make_error_condition(db_error::checksum_mismatch));
+                value->erase(0, value_offset);
+                done(std::error_condition());
+            });
+    }
+
     std::error_condition Append(std::vector<std::uint8_t> const& buf)
     {
         std::size_t bytesWritten;
@@ -78,10 +143,22 @@ class ValueStore
     }
 
     std::error_condition Each(key_value_func f) const
+    {
+        file_->Advise(AccessPattern::Sequential);
+        auto err = each(f);
+        file_->Advise(pattern_);
+        return err;
+    }
+
+    std::uint64_t Size() const { return size_; }
+
+    std::error_condition Sync() const { return file_->Sync(); }
+
+   private:
+    std::error_condition each(key_value_func f) const
     {
         std::string str(1024 * 64, '\0');
         std::uint64_t filePosition = 0;
-        std::string key, value;
         do
         {
             std::error_condition err;
@@ -92,52 +169,115 @@ class ValueStore
             std::uint32_t length = 0;
             for (std::size_t pos = 0; pos < bytesRead;)
             {
+                // A length which straddles the end of what was read is
+                // read again from filePosition
+                if (pos + sizeof(length) > bytesRead)
+                {
+                    if (pos == 0)
+                        return make_error_condition(db_error::short_read);
+                    break;
+                }
                 string_read<std::uint32_t>(str, pos, length);
+                if (length < value_offset || filePosition + length > size_)
+                    return make_error_condition(db_error::checksum_mismatch);
                 // tail case
                 if (pos + length > bytesRead)
                 {
+                    // Grow the buffer for a record bigger than it
+                    if (pos == 0)
+                        str.resize(length);
                     break;
                 }
-                pos += sizeof(length);
-                key.assign(str, pos, Bytes);
+                if (!checkRecord(str, pos, length))
+                    return make_error_condition(db_error::checksum_mismatch);
+                pos += key_offset;
+                Slice const key(&str[pos], Bytes);
                 pos += Bytes;
                 auto valueLength = length - value_offset;
-                value.assign(str, pos, valueLength);
+                // Only valid during the call, as str is reused
+                f(key, Slice(&str[pos], valueLength));
                 pos += valueLength;
-                f(key, value);
                 filePosition += length;
             }
         } while (filePosition < size_);
         return std::error_condition();
     }
 
-    std::uint64_t Size() const { return size_; }
+    std::error_condition getVerified(std::uint64_t const offset,
+                                     std::uint32_t const length,
+                                     std::string* value) const
+    {
+        std::string record(length, '\0');
+        std::size_t bytesRead;
+        std::error_condition err;
+        std::tie(bytesRead, err) = file_->ReadAt(offset, record);
+        if (err)
+            return err;
+        if (bytesRead < record.length())
+            return make_error_condition(db_error::short_read);
+        if (!checkRecord(record, 0, length))
+            return make_error_condition(db_error::checksum_mismatch);
+        value->assign(record, value_offset, std::string::npos);
+        return std::error_condition();
+    }
+
+    // The record at pos in str must be length bytes long
+    static bool checkRecord(std::string const& str, std::size_t const pos,
+                            std::uint32_t const length)
+    {
+        std::uint32_t storedLength, crc;
+        string_read(str, pos, storedLength);
+        string_read(str, pos + sizeof(std::uint32_t), crc);
+        return storedLength == length && length >= value_offset &&
+               crc == detail::Crc32c::Value(&str[pos + key_offset],
+                                            length - key_offset);
+    }
 };
 template <std::uint32_t BITS>
-const std::size_t ValueStore<BITS>::value_offset = util::MaxSize() +
-                                                   sizeof(std::uint32_t);
-
+const std::size_t ValueStore<BITS>::key_offset = 2 * sizeof(std::uint32_t);
 template <std::uint32_t BITS>
+const std::size_t ValueStore<BITS>::value_offset = Bytes + key_offset;
+
+// Stores nodes after the two copies of a KeyFileHeader. The id of a node is
+// its offset in the file, and its size depends on its level. Open fails if
+// the file is shorter than the header says the last committed flush left
+// it. The last four bytes of each node's block are a CRC32C of the rest,
+// which Get verifies if verify is set. A non-zero BLOCK_SIZE is the only
+// block size the store's nodes can have, and Open fails if any level of
+// the file has another.
+template <std::uint32_t BITS, std::uint32_t BLOCK_SIZE = 0>
 class KeyStore
 {
     using util = detail::KeyUtil<BITS>;
     using key_type = typename util::key_type;
-    using node_type = Node<BITS>;
+    using node_type = Node<BITS, BLOCK_SIZE>;
     using node_ptr = std::shared_ptr<node_type>;
     using node_result = std::pair<node_ptr, std::error_condition>;
     using file_type = std::unique_ptr<RandomAccessFile>;
+    using header_type = KeyFileHeader<BITS>;
 
    private:
-    const std::uint32_t block_size_;
-    const std::uint32_t degree_;
+    // Used for new files, an existing file keeps its own block sizes
+    const header_type options_;
+    header_type header_;
     file_type file_;
     std::atomic_uint_fast64_t size_;
+    bool const verify_;
 
    public:
-    KeyStore(std::uint32_t const block_size, file_type& file)
-        : block_size_(block_size),
-          degree_(node_type::CalculateDegree(block_size)),
-          file_(std::move(file))
+    KeyStore(std::vector<std::uint32_t> const& blockSizes, file_type& file,
+             bool const verify = true)
+        : options_{blockSizes},
+          header_{blockSizes},
+          file_(std::move(file)),
+          verify_(verify)
+    {
+        if (!options_.IsValid())
+            throw std::invalid_argument("Bad block sizes");
+    }
+    KeyStore(std::uint32_t const blockSize, file_type& file,
+             bool const verify = true)
+        : KeyStore(std::vector<std::uint32_t>{blockSize}, file, verify)
     {
     }
     KeyStore(const KeyStore&) = delete;
@@ -145,15 +285,28 @@ class KeyStore
 
     std::error_condition Open()
     {
+        if (!fixedBlockSize(options_))
+            return make_error_condition(db_error::wrong_block_size);
         if (auto err = file_->Open())
             return err;
-        return file_->Size(size_);
+        if (auto err = file_->Size(size_))
+            return err;
+        if (size_ == 0)
+            return create();
+        if (auto err = readHeader())
+            return err;
+        if (!fixedBlockSize(header_))
+            return make_error_condition(db_error::wrong_block_size);
+        if (size_ < header_.keysLength)
+            return make_error_condition(db_error::truncated);
+        return std::error_condition();
     }
 
     std::error_condition Clear()
     {
-        size_ = 0;
-        return file_->Truncate();
+        if (auto err = file_->Truncate())
+            return err;
+        return create();
     }
 
     std::error_condition Close() { return file_->Close(); }
@@ -161,19 +314,153 @@ class KeyStore
     node_ptr New(std::uint32_t const level, key_type const& first,
                  key_type const& last)
     {
-        size_ += block_size_;
-        return std::make_shared<node_type>(size_ - block_size_, level, degree_,
+        auto const blockSize = header_.BlockSize(level);
+        auto const id = size_.fetch_add(blockSize);
+        return std::make_shared<node_type>(id, level, header_.Degree(level),
                                            first, last);
     }
 
-    node_result Get(std::uint64_t const id) const
+    // The level is needed to know how big the node is
+    node_result Get(std::uint64_t const id, std::uint32_t const level) const
+    {
+        return get(id, level, verify_);
+    }
+
+    // Verifies the checksum whatever the store was created with
+    node_result GetVerified(std::uint64_t const id,
+                            std::uint32_t const level) const
+    {
+        return get(id, level, true);
+    }
+
+    // As Get, but read through reader, which calls done from its Poll
+    void GetAsync(AsyncReader& reader, std::uint64_t const id,
+                  std::uint32_t const level,
+                  std::function<void(node_result)> done) const
+    {
+        auto str =
+            std::make_shared<std::string>(header_.BlockSize(level), '\0');
+        file_->ReadAtAsync(reader, id, *str,
+                           [this, id, level, str, done](
+                               std::size_t const bytesRead,
+                               std::error_condition const err)
+                           {
+                               done(decodeRead(id, level, *str, bytesRead,
+                                               err, verify_));
+                           });
+    }
+
+    // Reads count nodes of a level stored one after another from id, with
+    // a single read.
+    std::error_condition GetRun(std::uint64_t const id,
+                                std::uint32_t const level,
+                                std::size_t const count,
+                                std::vector<node_ptr>& nodes) const
+    {
+        auto const blockSize = header_.BlockSize(level);
+        std::string str(std::size_t(blockSize) * count, '\0');
+        std::size_t bytesRead;
+        std::error_condition err;
+        std::tie(bytesRead, err) = file_->ReadAt(id, str);
+        if (err)
+            return err;
+        if (bytesRead != str.size())
+            return make_error_condition(db_error::short_read);
+        std::string block(blockSize, '\0');
+        for (std::size_t i = 0; i < count; i++)
+        {
+            block.assign(str, i * blockSize, blockSize);
+            node_ptr node;
+            std::tie(node, err) =
+                decode(id + i * blockSize, level, block, verify_);
+            if (err)
+                return err;
+            nodes.push_back(node);
+        }
+        return std::error_condition();
+    }
+
+    // Starts reading a node that Get will be asked for soon. Returns false
+    // if no read was started.
+    bool Prefetch(std::uint64_t const id, std::uint32_t const level) const
+    {
+        return file_->Prefetch(id, header_.BlockSize(level));
+    }
+
+    std::error_condition Set(node_ptr const& node)
     {
         std::string str;
-        str.resize(block_size_);
-        auto node = std::make_shared<node_type>(id, 0, degree_, 0, 1);
+        str.resize(header_.BlockSize(node->Level()));
+        node->Write(str);
+        auto const crcOffset = str.size() - sizeof(std::uint32_t);
+        string_replace(detail::Crc32c::Value(str.data(), crcOffset), crcOffset,
+                       str);
+        std::size_t bytesWritten;
+        std::error_condition err;
+        std::tie(bytesWritten, err) = file_->WriteAt(str, node->Id());
+        if (err)
+            return err;
+        if (bytesWritten != str.size())
+            return make_error_condition(db_error::short_write);
+        return std::error_condition();
+    }
+
+    // Records a flush in the header once its values and nodes are written.
+    // The values file must already be synced, and the nodes are synced
+    // here, so that the header never names data that isn't on disk.
+    std::error_condition Commit(std::uint64_t const valuesLength)
+    {
+        if (auto err = file_->Sync())
+            return err;
+        header_.flushSequence++;
+        header_.keysLength = size_;
+        header_.valuesLength = valuesLength;
+        return writeHeader();
+    }
+
+    std::uint64_t Size() const { return size_; }
+    // State of the files after the last committed flush
+    std::uint64_t FlushSequence() const { return header_.flushSequence; }
+    std::uint64_t CommittedSize() const { return header_.keysLength; }
+    std::uint64_t CommittedValuesSize() const { return header_.valuesLength; }
+    constexpr std::uint64_t RootId() const { return header_type::Length; }
+    std::uint32_t BlockSize(std::uint32_t const level) const
+    {
+        return header_.BlockSize(level);
+    }
+    std::uint32_t Degree(std::uint32_t const level) const
+    {
+        return header_.Degree(level);
+    }
+
+   private:
+    static bool fixedBlockSize(header_type const& header)
+    {
+        return BLOCK_SIZE == 0 ||
+               std::all_of(header.blockSizes.cbegin(),
+                           header.blockSizes.cend(),
+                           [](std::uint32_t const blockSize)
+                           {
+                               return blockSize == BLOCK_SIZE;
+                           });
+    }
+
+    node_result get(std::uint64_t const id, std::uint32_t const level,
+                    bool const verify) const
+    {
+        std::string str;
+        str.resize(header_.BlockSize(level));
         std::size_t bytesRead;
         std::error_condition err;
         std::tie(bytesRead, err) = file_->ReadAt(id, str);
+        return decodeRead(id, level, str, bytesRead, err, verify);
+    }
+
+    node_result decodeRead(std::uint64_t const id, std::uint32_t const level,
+                           std::string const& str, std::size_t const bytesRead,
+                           std::error_condition const err,
+                           bool const verify) const
+    {
         if (err)
             return std::make_pair(node_ptr(), err);
         if (bytesRead == 0)
@@ -181,51 +468,125 @@ class KeyStore
             return std::make_pair(
                 node_ptr(), make_error_condition(db_error::key_not_found));
         }
-        if (bytesRead != block_size_)
+        if (bytesRead != str.size())
             return std::make_pair(node_ptr(),
                                   make_error_condition(db_error::short_read));
+        return decode(id, level, str, verify);
+    }
+
+    node_result decode(std::uint64_t const id, std::uint32_t const level,
+                       std::string const& str, bool const verify) const
+    {
+        // Only reached if Open failed
+        if (BLOCK_SIZE != 0 && str.size() != BLOCK_SIZE)
+            return std::make_pair(
+                node_ptr(), make_error_condition(db_error::wrong_block_size));
+        if (verify)
+        {
+            auto const crcOffset = str.size() - sizeof(std::uint32_t);
+            std::uint32_t crc;
+            string_read(str, crcOffset, crc);
+            if (crc != detail::Crc32c::Value(str.data(), crcOffset))
+                return std::make_pair(
+                    node_ptr(),
+                    make_error_condition(db_error::checksum_mismatch));
+        }
+        auto node =
+            std::make_shared<node_type>(id, level, header_.Degree(level), 0, 1);
         node->Read(str);
         return std::make_pair(node, std::error_condition());
     }
 
-    std::error_condition Set(node_ptr const& node)
+    std::error_condition create()
     {
-        std::string str;
-        str.resize(block_size_);
-        node->Write(str);
+        header_ = options_;
+        header_.keysLength = header_type::Length;
+        size_ = header_type::Length;
+        for (std::size_t copy = 0; copy < header_type::Copies; copy++)
+            if (auto err = writeHeader(copy))
+                return err;
+        return std::error_condition();
+    }
+
+    // Each flush overwrites the older copy
+    std::error_condition writeHeader()
+    {
+        return writeHeader(header_.flushSequence % header_type::Copies);
+    }
+
+    std::error_condition writeHeader(std::size_t const copy)
+    {
+        auto str = header_.Write();
         std::size_t bytesWritten;
         std::error_condition err;
-        std::tie(bytesWritten, err) = file_->WriteAt(str, node->Id());
+        std::tie(bytesWritten, err) =
+            file_->WriteAt(str, copy * header_type::Size);
         if (err)
             return err;
-        if (bytesWritten != block_size_)
+        if (bytesWritten != str.size())
             return make_error_condition(db_error::short_write);
         return std::error_condition();
     }
 
-    std::uint64_t Size() const { return size_; }
+    std::error_condition readHeader()
+    {
+        std::string str(header_type::Length, '\0');
+        std::size_t bytesRead;
+        std::error_condition err;
+        std::tie(bytesRead, err) = file_->ReadAt(0, str);
+        if (err)
+            return err;
+        if (bytesRead != str.size())
+            return make_error_condition(db_error::bad_header);
+        bool found = false;
+        for (std::size_t copy = 0; copy < header_type::Copies; copy++)
+        {
+            header_type header;
+            if (header.Read(str.substr(copy * header_type::Size,
+                                       header_type::Size)))
+                continue;
+            if (!found || header.flushSequence > header_.flushSequence)
+                header_ = header;
+            found = true;
+        }
+        if (!found)
+            return make_error_condition(db_error::bad_header);
+        return std::error_condition();
+    }
 };
 
-template <std::uint32_t BITS>
-static std::unique_ptr<KeyStore<BITS>> CreateKeyStore(
-    std::string const& filename, std::uint32_t const blockSize)
+template <std::uint32_t BITS, std::uint32_t BLOCK_SIZE = 0>
+static std::unique_ptr<KeyStore<BITS, BLOCK_SIZE>> CreateKeyStore(
+    std::string const& filename, std::vector<std::uint32_t> const& blockSizes,
+    bool const verify = true, bool const direct = false)
 {
     // Put ifdef here!
     auto file = std::unique_ptr<RandomAccessFile>(
-        std::make_unique<PosixRandomAccessFile>(filename));
+        std::make_unique<PosixRandomAccessFile>(filename, direct));
     // endif
-    return std::make_unique<KeyStore<BITS>>(blockSize, file);
+    return std::make_unique<KeyStore<BITS, BLOCK_SIZE>>(blockSizes, file,
+                                                       verify);
+}
+
+template <std::uint32_t BITS, std::uint32_t BLOCK_SIZE = 0>
+static std::unique_ptr<KeyStore<BITS, BLOCK_SIZE>> CreateKeyStore(
+    std::string const& filename, std::uint32_t const blockSize,
+    bool const verify = true, bool const direct = false)
+{
+    return CreateKeyStore<BITS, BLOCK_SIZE>(
+        filename, std::vector<std::uint32_t>{blockSize}, verify, direct);
 }
 
 template <std::uint32_t BITS>
 static std::unique_ptr<ValueStore<BITS>> CreateValueStore(
-    std::string const& filename)
+    std::string const& filename, bool const verify = true,
+    bool const mapped = false)
 {
     // Put ifdef here!
     auto file = std::unique_ptr<RandomAccessFile>(
-        std::make_unique<PosixRandomAccessFile>(filename));
+        std::make_unique<PosixRandomAccessFile>(filename, false, mapped));
     // endif
-    return std::make_unique<ValueStore<BITS>>(file);
+    return std::make_unique<ValueStore<BITS>>(file, verify, mapped);
 }
 
 }  // namespace keyvadb
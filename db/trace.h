@@ -0,0 +1,195 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <map>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+
+namespace keyvadb
+{
+// A breakdown of a single flush. Phases are named after the function they
+// time and a phase may occur more than once, for instance once per batch of
+// values written.
+struct FlushReport
+{
+    using clock = std::chrono::steady_clock;
+    using duration = std::chrono::nanoseconds;
+
+    struct Phase
+    {
+        std::string name;
+        clock::time_point start;
+        duration elapsed;
+    };
+
+    std::uint64_t sequence = 0;
+    clock::time_point start = clock::now();
+    clock::time_point finish = start;
+    std::vector<Phase> phases;
+
+    // Keys written to the values file
+    std::uint64_t keys = 0;
+    std::uint64_t valueBytes = 0;
+    std::uint64_t nodeBytes = 0;
+    // Dirty nodes by level
+    std::map<std::uint32_t, std::uint64_t> levels;
+    std::uint64_t insertions = 0;
+    std::uint64_t evictions = 0;
+    std::uint64_t synthetics = 0;
+    std::uint64_t updates = 0;
+    std::uint64_t deletions = 0;
+    std::uint64_t freedBytes = 0;
+    // Uncached nodes read ahead of being processed
+    std::uint64_t prefetches = 0;
+
+    void Add(std::string const& name, clock::time_point const from,
+             clock::time_point const to)
+    {
+        phases.push_back(
+            Phase{name, from, std::chrono::duration_cast<duration>(to - from)});
+        finish = std::max(finish, to);
+    }
+
+    // Total time spent in all phases with name
+    duration Elapsed(std::string const& name) const
+    {
+        duration total(0);
+        for (auto const& phase : phases)
+            if (phase.name == name)
+                total += phase.elapsed;
+        return total;
+    }
+
+    duration Elapsed() const
+    {
+        return std::chrono::duration_cast<duration>(finish - start);
+    }
+
+    std::uint64_t Nodes() const
+    {
+        std::uint64_t total = 0;
+        for (auto const& level : levels) total += level.second;
+        return total;
+    }
+
+    bool Empty() const { return keys == 0 && Nodes() == 0; }
+
+    std::string ToString() const
+    {
+        std::map<std::string, duration> totals;
+        for (auto const& phase : phases) totals[phase.name] += phase.elapsed;
+        std::stringstream ss;
+        ss << "Flush: " << sequence << " Keys: " << keys
+           << " Value bytes: " << valueBytes << " Nodes: " << Nodes()
+           << " Node bytes: " << nodeBytes << " Insertions: " << insertions
+           << " Evictions: " << evictions << " Synthetics: " << synthetics
+           << " Updates: " << updates << " Deletions: " << deletions
+           << " Freed bytes: " << freedBytes
+           << " Prefetches: " << prefetches << " Levels:";
+        for (auto const& level : levels)
+            ss << " " << level.first << ":" << level.second;
+        ss << " Elapsed: " << toMilliseconds(Elapsed()) << "ms";
+        for (auto const& total : totals)
+            ss << " " << total.first << ": " << toMilliseconds(total.second)
+               << "ms";
+        return ss.str();
+    }
+
+   private:
+    static double toMilliseconds(duration const d)
+    {
+        return std::chrono::duration_cast<
+                   std::chrono::duration<double, std::milli>>(d).count();
+    }
+};
+
+// Adds a phase to a FlushReport when it goes out of scope
+class ScopedTimer
+{
+    FlushReport& report_;
+    char const* name_;
+    FlushReport::clock::time_point start_;
+
+   public:
+    ScopedTimer(FlushReport& report, char const* name)
+        : report_(report), name_(name), start_(FlushReport::clock::now())
+    {
+    }
+    ScopedTimer(ScopedTimer const&) = delete;
+    ScopedTimer& operator=(ScopedTimer const&) = delete;
+    ~ScopedTimer() { report_.Add(name_, start_, FlushReport::clock::now()); }
+};
+
+// Appends FlushReports to a file in the Chrome trace event format, which
+// can be loaded into chrome://tracing or Perfetto. The JSON array format is
+// used, which allows the closing bracket to be missing, so the file is
+// valid after every write and can be appended to by successive DBs.
+class TraceWriter
+{
+    using clock = FlushReport::clock;
+
+    std::ofstream out_;
+    bool first_;
+
+   public:
+    explicit TraceWriter(std::string const& filename)
+        : out_(filename, std::ios::out | std::ios::app), first_(false)
+    {
+        if (out_.tellp() == 0)
+        {
+            out_ << "[";
+            first_ = true;
+        }
+    }
+    TraceWriter(TraceWriter const&) = delete;
+    TraceWriter& operator=(TraceWriter const&) = delete;
+
+    explicit operator bool() const { return out_.good(); }
+
+    void Write(FlushReport const& report)
+    {
+        std::stringstream args;
+        args << "{\"sequence\":" << report.sequence
+             << ",\"keys\":" << report.keys
+             << ",\"value_bytes\":" << report.valueBytes
+             << ",\"nodes\":" << report.Nodes()
+             << ",\"node_bytes\":" << report.nodeBytes
+             << ",\"insertions\":" << report.insertions
+             << ",\"evictions\":" << report.evictions
+             << ",\"synthetics\":" << report.synthetics
+             << ",\"updates\":" << report.updates
+             << ",\"deletions\":" << report.deletions
+             << ",\"freed_bytes\":" << report.freedBytes
+             << ",\"prefetches\":" << report.prefetches;
+        for (auto const& level : report.levels)
+            args << ",\"level_" << level.first << "\":" << level.second;
+        args << "}";
+        event("Flush", report.start, report.Elapsed(), args.str());
+        for (auto const& phase : report.phases)
+            event(phase.name, phase.start, phase.elapsed, "{}");
+        out_.flush();
+    }
+
+   private:
+    void event(std::string const& name, clock::time_point const start,
+               FlushReport::duration const elapsed, std::string const& args)
+    {
+        using micros = std::chrono::duration<double, std::micro>;
+        out_ << (first_ ? "\n" : ",\n") << std::fixed << std::setprecision(3)
+             << "{\"name\":\"" << name
+             << "\",\"cat\":\"flush\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":"
+             << std::chrono::duration_cast<micros>(start.time_since_epoch())
+                    .count()
+             << ",\"dur\":"
+             << std::chrono::duration_cast<micros>(elapsed).count()
+             << ",\"args\":" << args << "}";
+        first_ = false;
+    }
+};
+}  // namespace keyvadb
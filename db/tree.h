@@ -15,27 +15,32 @@
 
 namespace keyvadb
 {
-template <uint32_t BITS>
+template <std::uint32_t BITS, std::uint32_t BLOCK_SIZE = 0>
 class Tree
 {
    public:
     using util = detail::KeyUtil<BITS>;
     using key_type = typename util::key_type;
     using key_value_type = KeyValue<BITS>;
-    using key_store_type = KeyStore<BITS>;
-    using node_ptr = std::shared_ptr<Node<BITS>>;
+    using key_store_type = KeyStore<BITS, BLOCK_SIZE>;
+    using node_ptr = std::shared_ptr<Node<BITS, BLOCK_SIZE>>;
     using node_func =
         std::function<std::error_condition(node_ptr, std::uint32_t)>;
-    using cache_type = NodeCache<BITS>;
+    using cache_type = NodeCache<BITS, BLOCK_SIZE>;
 
    private:
-    static const uint64_t rootId = 0;
     key_store_type& store_;
     cache_type& cache_;
+    key_type const first_;
+    key_type const last_;
 
    public:
-    Tree(key_store_type& store, cache_type& cache)
-        : store_(store), cache_(cache)
+    // The root spans first to last, which is the whole key space unless
+    // the tree is one partition of a PartitionedDB.
+    Tree(key_store_type& store, cache_type& cache,
+         key_type const& first = FirstRootKey(),
+         key_type const& last = LastRootKey())
+        : store_(store), cache_(cache), first_(first), last_(last)
     {
     }
 
@@ -44,10 +49,16 @@ class Tree
     {
         node_ptr root;
         std::error_condition err;
-        std::tie(root, err) = store_.Get(rootId);
+        std::tie(root, err) = store_.Get(store_.RootId(), 0);
         if (!err)
+        {
+            if (root->First() != first_ || root->Last() != last_)
+                return make_error_condition(db_error::wrong_partition);
+            return err;
+        }
+        if (err != db_error::key_not_found)
             return err;
-        root = store_.New(0, firstRootKey(), lastRootKey());
+        root = store_.New(0, first_, last_);
         if (addSynthetics)
             root->AddSyntheticKeyValues();
         cache_.Reset();
@@ -55,19 +66,40 @@ class Tree
         return store_.Set(root);
     }
 
-    std::error_condition Walk(node_func f) const { return walk(rootId, 0, f); }
+    std::error_condition Walk(node_func f) const
+    {
+        return walk(store_.RootId(), 0, f, false);
+    }
+
+    // Walks the tree verifying the checksum of every node, whatever the
+    // store's policy
+    std::error_condition Verify(node_func f) const
+    {
+        return walk(store_.RootId(), 0, f, true);
+    }
 
     std::pair<node_ptr, std::error_condition> Root() const
     {
-        return GetNode(rootId);
+        return GetNode(store_.RootId(), 0);
     }
 
-    std::pair<node_ptr, std::error_condition> GetNode(std::uint64_t id) const
+    std::pair<node_ptr, std::error_condition> GetNode(
+        std::uint64_t const id, std::uint32_t const level) const
     {
         auto node = cache_.GetById(id);
         if (node)
             return std::make_pair(node, std::error_condition());
-        return store_.Get(id);
+        return store_.Get(id, level);
+    }
+
+    // Starts reading a node which isn't cached, so that a later GetNode
+    // doesn't have to wait as long. Returns true if a read was started,
+    // which it isn't for a cached node or a direct file.
+    bool Prefetch(std::uint64_t const id, std::uint32_t const level) const
+    {
+        if (cache_.GetById(id))
+            return false;
+        return store_.Prefetch(id, level);
     }
 
     node_ptr CreateNode(std::uint32_t const level, key_type const& first,
@@ -83,13 +115,38 @@ class Tree
         if (!node)
         {
             std::error_condition err;
-            std::tie(node, err) = store_.Get(rootId);
+            std::tie(node, err) = store_.Get(store_.RootId(), 0);
             if (err)
                 throw std::runtime_error("no root!");
         }
         return get(node, key);
     }
 
+    // One step of Get, which looks for key in node without reading from
+    // the store. Sets child to the id of the node at the next level to
+    // look in, or to EmptyChild once the search is over, with kv set if
+    // the key was found.
+    std::error_condition Search(node_ptr const& node, key_type const& key,
+                                key_value_type& kv, std::uint64_t& child) const
+    {
+        kv = key_value_type{};
+        child = EmptyChild;
+        std::size_t i;
+        if (node->Find(key, &kv, i))
+        {
+            // A synthetic key is either a placeholder or a deleted key
+            if (kv.IsSynthetic())
+                return make_error_condition(db_error::key_not_found);
+            return std::error_condition();
+        }
+        if (i == node->Degree())
+            return make_error_condition(db_error::key_not_found);
+        child = node->GetChild(i);
+        if (child == EmptyChild)
+            return make_error_condition(db_error::key_not_found);
+        return std::error_condition();
+    }
+
     std::error_condition Update(const node_ptr& node)
     {
         if (auto err = store_.Set(node))
@@ -98,6 +155,11 @@ class Tree
         return std::error_condition();
     }
 
+    std::uint32_t BlockSize(std::uint32_t const level) const
+    {
+        return store_.BlockSize(level);
+    }
+
     std::pair<bool, std::error_condition> IsSane() const
     {
         bool sane = true;
@@ -133,53 +195,34 @@ class Tree
         return stream;
     }
 
+    static key_type FirstRootKey() { return util::Min() + 1; }
+    static key_type LastRootKey() { return util::Max(); }
+
    private:
-    static constexpr key_type firstRootKey() { return util::Min() + 1; }
-    static constexpr key_type lastRootKey() { return util::Max(); }
 
     std::pair<key_value_type, std::error_condition> get(
         node_ptr const& node, key_type const& key) const
     {
         key_value_type kv;
-        if (node->Find(key, &kv))
-            return std::make_pair(kv, std::error_condition());
-        // TODO(DH) This needs early breaking to be efficient
-        bool found = false;
-        auto err = node->EachChild(
-            [&](const std::size_t, const key_type& first, const key_type& last,
-                const std::uint64_t cid)
-            {
-                if (key > first && key < last)
-                {
-                    if (cid == EmptyChild)
-                    {
-                        return make_error_condition(db_error::key_not_found);
-                    }
-                    found = true;
-                    node_ptr node;
-                    std::error_condition err;
-                    std::tie(node, err) = store_.Get(cid);
-                    if (err)
-                    {
-                        return err;
-                    }
-                    cache_.Add(node);
-                    std::tie(kv, err) = get(node, key);
-                    return err;
-                }
-                return std::error_condition();
-            });
-        if (!found)
-            err = db_error::key_not_found;
-        return std::make_pair(kv, err);
+        std::uint64_t cid;
+        auto err = Search(node, key, kv, cid);
+        if (cid == EmptyChild)
+            return std::make_pair(kv, err);
+        node_ptr child;
+        std::tie(child, err) = store_.Get(cid, node->Level() + 1);
+        if (err)
+            return std::make_pair(kv, err);
+        cache_.Add(child);
+        return get(child, key);
     }
 
     std::error_condition walk(std::uint64_t const id, std::uint32_t const level,
-                              node_func f) const
+                              node_func f, bool const verify) const
     {
         node_ptr node;
         std::error_condition err;
-        std::tie(node, err) = store_.Get(id);
+        std::tie(node, err) = verify ? store_.GetVerified(id, level)
+                                     : store_.Get(id, level);
         if (err)
             return err;
         if (auto err = f(node, level))
@@ -188,7 +231,8 @@ class Tree
                                    const key_type&, const std::uint64_t cid)
                                {
                                    if (cid != EmptyChild)
-                                       if (auto err = walk(cid, level + 1, f))
+                                       if (auto err = walk(cid, level + 1,
+                                                           f, verify))
                                            return err;
                                    return std::error_condition();
                                });
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <algorithm>
+
+namespace keyvadb
+{
+namespace detail
+{
+// A count-min sketch of how often each offset has been asked for, with
+// 4 bit counters that are halved every sampleSize increments so that old
+// popularity fades.
+class FrequencySketch
+{
+   private:
+    enum
+    {
+        Depth = 4,
+        MaxCount = 15
+    };
+
+    std::vector<std::uint8_t> counters_;
+    std::uint64_t mask_ = 0;
+    std::uint64_t sampleSize_ = 0;
+    std::uint64_t additions_ = 0;
+
+   public:
+    // Sized for about entries distinct offsets
+    void Resize(std::uint64_t const entries)
+    {
+        std::uint64_t width = 64;
+        while (width < entries) width <<= 1;
+        counters_.assign(width * Depth, 0);
+        mask_ = width - 1;
+        sampleSize_ = width * 10;
+        additions_ = 0;
+    }
+
+    void Clear()
+    {
+        std::fill(counters_.begin(), counters_.end(), 0);
+        additions_ = 0;
+    }
+
+    void Increment(std::uint64_t const offset)
+    {
+        bool added = false;
+        for (std::size_t i = 0; i < Depth; i++)
+        {
+            auto& counter = counters_[index(offset, i)];
+            if (counter < MaxCount)
+            {
+                counter++;
+                added = true;
+            }
+        }
+        if (added && ++additions_ == sampleSize_)
+            age();
+    }
+
+    std::uint32_t Estimate(std::uint64_t const offset) const
+    {
+        std::uint32_t count = MaxCount;
+        for (std::size_t i = 0; i < Depth; i++)
+            count = std::min<std::uint32_t>(count, counters_[index(offset, i)]);
+        return count;
+    }
+
+   private:
+    void age()
+    {
+        for (auto& counter : counters_) counter >>= 1;
+        additions_ /= 2;
+    }
+
+    // Row i's counter, by double hashing the splitmix64 finalizer
+    std::size_t index(std::uint64_t x, std::size_t const i) const
+    {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return i * (mask_ + 1) + ((x + i * ((x >> 32) | 1)) & mask_);
+    }
+};
+}  // namespace detail
+
+// Caches values by their offset in the values file, which names one value
+// for as long as the file isn't cleared as it is only ever appended to.
+// Split into shards each with their own lock and LRU list. When a shard is
+// full a value is only admitted if the frequency sketch says it is asked
+// for more often than the value it would evict (TinyLFU), so a scan of
+// cold keys can't push out the hot ones. Values are handed out as shared
+// pointers, which stay valid after eviction.
+class ValueCache
+{
+   public:
+    using value_ptr = std::shared_ptr<std::string const>;
+
+   private:
+    enum
+    {
+        Shards = 16,  // The top 4 bits of the hash pick the shard
+        // Rough cost of an entry besides its value
+        Overhead = 96,
+        // Expected mean value size, for sizing the sketch
+        MeanSize = 256
+    };
+
+    using entry_type = std::pair<std::uint64_t, value_ptr>;
+    using list_type = std::list<entry_type>;
+
+    struct Shard
+    {
+        std::mutex lock;
+        list_type lru;  // Most recently used first
+        std::unordered_map<std::uint64_t, list_type::iterator> index;
+        std::uint64_t bytes = 0;
+        detail::FrequencySketch sketch;
+    };
+
+    std::uint64_t maxBytes_ = 0;
+    std::array<Shard, Shards> shards_;
+    std::atomic_uint_fast64_t bytes_{0};
+    std::atomic_uint_fast64_t hits_{0};
+    std::atomic_uint_fast64_t misses_{0};
+    std::atomic_uint_fast64_t rejections_{0};
+
+   public:
+    // Not threadsafe. Zero disables the cache.
+    void SetMaxBytes(std::uint64_t const maxBytes)
+    {
+        maxBytes_ = maxBytes;
+        for (auto& shard : shards_)
+            shard.sketch.Resize(maxBytes / Shards / (MeanSize + Overhead));
+        Clear();
+    }
+
+    bool Enabled() const { return maxBytes_ > 0; }
+
+    void Clear()
+    {
+        for (auto& shard : shards_)
+        {
+            std::lock_guard<std::mutex> lock(shard.lock);
+            shard.lru.clear();
+            shard.index.clear();
+            shard.bytes = 0;
+            shard.sketch.Clear();
+        }
+        bytes_ = 0;
+    }
+
+    // Returns null if the value isn't cached. Every call counts towards
+    // the offset's frequency, hit or miss.
+    value_ptr Get(std::uint64_t const offset)
+    {
+        if (!Enabled())
+            return value_ptr();
+        auto& shard = shardFor(offset);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        shard.sketch.Increment(offset);
+        auto found = shard.index.find(offset);
+        if (found == shard.index.end())
+        {
+            misses_++;
+            return value_ptr();
+        }
+        hits_++;
+        shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+        return found->second->second;
+    }
+
+    // Offers a value read from disk after a missed Get
+    void Add(std::uint64_t const offset, value_ptr const& value)
+    {
+        if (!Enabled())
+            return;
+        auto const cost = value->size() + Overhead;
+        auto const capacity = maxBytes_ / Shards;
+        if (cost > capacity)
+            return;
+        auto& shard = shardFor(offset);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        if (shard.index.count(offset) > 0)
+            return;
+        auto const frequency = shard.sketch.Estimate(offset);
+        while (shard.bytes + cost > capacity)
+        {
+            auto& victim = shard.lru.back();
+            if (frequency <= shard.sketch.Estimate(victim.first))
+            {
+                rejections_++;
+                return;
+            }
+            shard.bytes -= victim.second->size() + Overhead;
+            bytes_ -= victim.second->size() + Overhead;
+            shard.index.erase(victim.first);
+            shard.lru.pop_back();
+        }
+        shard.lru.emplace_front(offset, value);
+        shard.index[offset] = shard.lru.begin();
+        shard.bytes += cost;
+        bytes_ += cost;
+    }
+
+    std::uint64_t MaxBytes() const { return maxBytes_; }
+    std::uint64_t Bytes() const { return bytes_; }
+    std::uint64_t Hits() const { return hits_; }
+    std::uint64_t Misses() const { return misses_; }
+    std::uint64_t Rejections() const { return rejections_; }
+
+   private:
+    Shard& shardFor(std::uint64_t const offset)
+    {
+        // Fibonacci hashing, as offsets depend on the value lengths
+        return shards_[(offset * 0x9e3779b97f4a7c15ULL) >> 60];
+    }
+};
+}  // namespace keyvadb
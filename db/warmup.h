@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <utility>
+#include <system_error>
+#include "db/env.h"
+#include "db/encoding.h"
+#include "db/error.h"
+#include "db/crc32c.h"
+
+namespace keyvadb
+{
+// The nodes resident in a NodeCache, saved on close so that a restarted DB
+// can read them back instead of starting with a cold cache.
+class CacheSnapshot
+{
+   public:
+    struct Entry
+    {
+        std::uint64_t id;
+        std::uint32_t level;
+    };
+
+    // Least recently used first
+    std::vector<Entry> entries;
+
+    // The length of the keys file is stored alongside the entries, as a
+    // snapshot from before a crash or a Clear may name nodes that have
+    // since changed.
+    std::error_condition Save(RandomAccessFile& file,
+                              std::uint64_t const keysLength) const
+    {
+        std::string str(headerSize() + entries.size() * entrySize, '\0');
+        std::size_t pos = 0;
+        pos += string_replace<std::uint32_t>(Magic, pos, str);
+        pos += string_replace<std::uint32_t>(Version, pos, str);
+        pos += string_replace<std::uint64_t>(keysLength, pos, str);
+        pos += string_replace<std::uint64_t>(entries.size(), pos, str);
+        for (auto const& entry : entries)
+        {
+            pos += string_replace(entry.id, pos, str);
+            pos += string_replace(entry.level, pos, str);
+        }
+        string_replace(detail::Crc32c::Value(str.data(), pos), pos, str);
+        if (auto err = file.Truncate())
+            return err;
+        std::size_t bytesWritten;
+        std::error_condition err;
+        std::tie(bytesWritten, err) = file.WriteAt(str, 0);
+        if (err)
+            return err;
+        if (bytesWritten != str.size())
+            return make_error_condition(db_error::short_write);
+        return std::error_condition();
+    }
+
+    // Returns false if the file is missing, corrupt or out of date
+    std::pair<bool, std::error_condition> Load(RandomAccessFile& file,
+                                               std::uint64_t const keysLength)
+    {
+        entries.clear();
+        std::atomic_uint_fast64_t length;
+        if (auto err = file.Size(length))
+            return std::make_pair(false, err);
+        if (length < headerSize())
+            return std::make_pair(false, std::error_condition());
+        std::string str(length, '\0');
+        std::size_t bytesRead;
+        std::error_condition err;
+        std::tie(bytesRead, err) = file.ReadAt(0, str);
+        if (err)
+            return std::make_pair(false, err);
+        if (bytesRead != str.size())
+            return std::make_pair(false,
+                                  make_error_condition(db_error::short_read));
+        std::uint32_t magic, version, crc;
+        std::uint64_t savedKeysLength, count;
+        std::size_t pos = 0;
+        pos += string_read(str, pos, magic);
+        pos += string_read(str, pos, version);
+        pos += string_read(str, pos, savedKeysLength);
+        pos += string_read(str, pos, count);
+        if (magic != Magic || version != Version ||
+            savedKeysLength != keysLength ||
+            str.size() != headerSize() + count * entrySize)
+            return std::make_pair(false, std::error_condition());
+        auto const crcPos = str.size() - sizeof(crc);
+        string_read(str, crcPos, crc);
+        if (crc != detail::Crc32c::Value(str.data(), crcPos))
+            return std::make_pair(false, std::error_condition());
+        entries.resize(count);
+        for (auto& entry : entries)
+        {
+            pos += string_read(str, pos, entry.id);
+            pos += string_read(str, pos, entry.level);
+        }
+        return std::make_pair(true, std::error_condition());
+    }
+
+    // The entries to read back into a cache of maxSize nodes, in the order
+    // to read them. Upper levels come first as every lookup needs them, and
+    // within a level the most recently used are kept. Each level is sorted
+    // by id so that neighbouring nodes can be read together.
+    std::vector<Entry> Plan(std::uint64_t const maxSize) const
+    {
+        std::vector<Entry> plan(entries.rbegin(), entries.rend());
+        std::stable_sort(plan.begin(), plan.end(),
+                         [](Entry const& lhs, Entry const& rhs)
+                         {
+                             return lhs.level < rhs.level;
+                         });
+        if (plan.size() > maxSize)
+            plan.resize(maxSize);
+        std::sort(plan.begin(), plan.end(),
+                  [](Entry const& lhs, Entry const& rhs)
+                  {
+                      if (lhs.level == rhs.level)
+                          return lhs.id < rhs.id;
+                      return lhs.level < rhs.level;
+                  });
+        return plan;
+    }
+
+   private:
+    enum
+    {
+        Magic = 0x5744564B,  // KVDW
+        Version = 1,
+        entrySize = sizeof(std::uint64_t) + sizeof(std::uint32_t)
+    };
+
+    // Including the checksum at the end
+    static constexpr std::size_t headerSize()
+    {
+        return 3 * sizeof(std::uint32_t) + 2 * sizeof(std::uint64_t);
+    }
+};
+}  // namespace keyvadb
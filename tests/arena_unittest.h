@@ -0,0 +1,50 @@
+#include <set>
+#include <map>
+#include "tests/common.h"
+#include "db/arena.h"
+
+using namespace keyvadb;
+
+TEST(ArenaTest, General)
+{
+    Arena arena;
+    ASSERT_EQ(0UL, arena.Blocks());
+    auto a = arena.Allocate(3, 1);
+    auto b = arena.Allocate(8, 8);
+    ASSERT_EQ(0UL, reinterpret_cast<std::uintptr_t>(b) % 8);
+    ASSERT_LE(static_cast<char*>(a) + 3, static_cast<char*>(b));
+    ASSERT_EQ(11UL, arena.Allocated());
+    ASSERT_EQ(1UL, arena.Blocks());
+    // Too big for a standard block
+    arena.Allocate(1024 * 1024, 16);
+    ASSERT_EQ(2UL, arena.Blocks());
+    arena.Reset();
+    ASSERT_EQ(0UL, arena.Allocated());
+    ASSERT_EQ(1UL, arena.Blocks());
+    ASSERT_EQ(a, arena.Allocate(3, 1));
+}
+
+TEST(ArenaTest, Containers)
+{
+    using util = detail::KeyUtil<256>;
+    using kv_type = KeyValue<256>;
+    Arena arena;
+    ArenaAllocator<kv_type> alloc(arena);
+    {
+        std::set<kv_type, std::less<kv_type>, ArenaAllocator<kv_type>> set(
+            alloc);
+        for (auto const& key : util::RandomKeys(1000, 0))
+            set.emplace(kv_type{key, 1, 1});
+        ASSERT_EQ(1000UL, set.size());
+        ASSERT_TRUE(std::is_sorted(set.cbegin(), set.cend()));
+        std::multimap<int, std::string, std::less<int>,
+                      ArenaAllocator<std::pair<int const, std::string>>>
+            map(alloc);
+        map.emplace(1, "one");
+        map.emplace(1, "uno");
+        ASSERT_EQ(2UL, map.count(1));
+    }
+    ASSERT_LT(1000 * sizeof(kv_type), arena.Allocated());
+    arena.Reset();
+    ASSERT_EQ(0UL, arena.Allocated());
+}
@@ -0,0 +1,111 @@
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include "tests/common.h"
+#include "db/env.h"
+
+using namespace keyvadb;
+
+// Reads every block of a file at once from one thread, with more reads
+// than the reader's depth
+void CheckReader(AsyncReader& reader)
+{
+    std::remove("test.async");
+    PosixRandomAccessFile file("test.async");
+    ASSERT_FALSE(file.Open());
+    std::size_t const blocks = 500, blockSize = 512;
+    std::vector<std::uint8_t> buf;
+    for (std::size_t i = 0; i < blocks; i++)
+        buf.insert(buf.end(), blockSize, std::uint8_t(i));
+    ASSERT_EQ(buf.size(), file.Write(buf).first);
+    std::vector<std::string> reads(blocks, std::string(blockSize, '\0'));
+    std::size_t done = 0;
+    for (std::size_t i = 0; i < blocks; i++)
+        file.ReadAtAsync(reader, i * blockSize, reads[i],
+                         [&, i](std::size_t n, std::error_condition err)
+                         {
+                             ASSERT_FALSE(err);
+                             ASSERT_EQ(blockSize, n);
+                             ASSERT_EQ(std::string(blockSize, char(i)),
+                                       reads[i]);
+                             done++;
+                         });
+    ASSERT_EQ(0UL, done);
+    ASSERT_EQ(blocks, reader.Pending());
+    while (reader.Pending() > 0) reader.Poll(true);
+    ASSERT_EQ(blocks, done);
+    ASSERT_EQ(0UL, reader.Poll(true));
+    // Reads past the end are short
+    std::string str(10, '\0');
+    std::size_t bytesRead = 1;
+    file.ReadAtAsync(reader, buf.size() - 2, str,
+                     [&](std::size_t n, std::error_condition err)
+                     {
+                         ASSERT_FALSE(err);
+                         bytesRead = n;
+                     });
+    while (reader.Pending() > 0) reader.Poll(true);
+    ASSERT_EQ(2UL, bytesRead);
+    // Errors are called back too
+    std::error_condition err;
+    reader.Read(-1, 0, &str[0], str.size(),
+                [&](std::size_t, std::error_condition e)
+                {
+                    err = e;
+                });
+    while (reader.Pending() > 0) reader.Poll(true);
+    ASSERT_EQ(std::errc::bad_file_descriptor, err);
+    ASSERT_FALSE(file.Close());
+    std::remove("test.async");
+}
+
+// Destroying a reader calls back the reads it hasn't, including those
+// still waiting for a slot
+void CheckDestroy(std::unique_ptr<AsyncReader> reader)
+{
+    std::remove("test.async");
+    PosixRandomAccessFile file("test.async");
+    ASSERT_FALSE(file.Open());
+    ASSERT_EQ(4096UL,
+              file.Write(std::vector<std::uint8_t>(4096, 1)).first);
+    std::size_t const reads = 100;
+    std::vector<std::string> bufs(reads, std::string(4096, '\0'));
+    std::size_t done = 0;
+    for (std::size_t i = 0; i < reads; i++)
+        file.ReadAtAsync(*reader, 0, bufs[i],
+                         [&](std::size_t n, std::error_condition err)
+                         {
+                             ASSERT_FALSE(err);
+                             ASSERT_EQ(4096UL, n);
+                             done++;
+                         });
+    reader.reset();
+    ASSERT_EQ(reads, done);
+    ASSERT_FALSE(file.Close());
+    std::remove("test.async");
+}
+
+TEST(AsyncTest, Aio)
+{
+    AioReader reader(64);
+    CheckReader(reader);
+    CheckDestroy(std::make_unique<AioReader>(16));
+}
+
+#ifdef KEYVADB_IO_URING
+TEST(AsyncTest, Uring)
+{
+    UringReader reader(64);
+    if (auto err = reader.Open())
+    {
+        std::cout << "io_uring isn't available: " << err.message()
+                  << std::endl;
+        return;
+    }
+    CheckReader(reader);
+    auto destroyed = std::make_unique<UringReader>(16);
+    ASSERT_FALSE(destroyed->Open());
+    CheckDestroy(std::move(destroyed));
+}
+#endif
@@ -51,3 +51,38 @@ TEST(BufferTest, Purge)
     // buffer.Purge();
     // std::cout << buffer;
 }
+
+TEST(BufferTest, OverwriteAndDelete)
+{
+    using util = detail::KeyUtil<256>;
+    Buffer<256> buffer;
+    auto key = util::ToBytes(util::FromHex('1'));
+    buffer.Add(key, "first");
+    buffer.Add(key, "second");
+    ASSERT_EQ(1UL, buffer.Size());
+    ASSERT_EQ(std::string("second"), *buffer.Get(key));
+    buffer.Delete(key);
+    ASSERT_EQ(1UL, buffer.Size());
+    ASSERT_EQ(0UL, buffer.Get(key)->length());
+    ASSERT_TRUE(buffer.ContainsRange(util::MakeKey(1), util::FromHex('F')));
+    ASSERT_FALSE(
+        buffer.ContainsInsertions(util::MakeKey(1), util::FromHex('F')));
+    buffer.Add(key, "third");
+    ASSERT_EQ(std::string("third"), *buffer.Get(key));
+    // Once a flush has the key, changes wait for the next flush
+    std::vector<KeyValue<256>> candidates, evictions, tombstones;
+    buffer.GetCandidates(util::Min(), util::Max(), candidates, evictions,
+                         tombstones);
+    ASSERT_EQ(1UL, candidates.size());
+    buffer.Delete(key);
+    ASSERT_EQ(2UL, buffer.Size());
+    ASSERT_EQ(0UL, buffer.Get(key)->length());
+    buffer.SetOffset(util::FromHex('1'), 0);
+    ASSERT_FALSE(buffer.ContainsRange(util::MakeKey(1), util::FromHex('F')));
+    std::vector<std::uint8_t> wb;
+    ASSERT_TRUE(buffer.Write(1024, wb));
+    ASSERT_EQ(candidates.begin()->length, wb.size());
+    buffer.Purge();
+    ASSERT_EQ(1UL, buffer.Size());
+    ASSERT_EQ(0UL, buffer.Get(key)->length());
+}
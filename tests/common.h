@@ -11,6 +11,7 @@
 #include "db/buffer.h"
 #include "db/journal.h"
 #include "db/db.h"
+#include "db/partitioned.h"
 
 using namespace keyvadb;
 
@@ -82,9 +83,11 @@ class StoreTest : public ::testing::Test,
     value_type GetValue(std::uint64_t const offset, std::string const& value)
     {
         return value_type{offset,
-                          std::uint32_t(value.size() + sizeof(std::uint32_t) +
+                          std::uint32_t(value.size() +
+                                        2 * sizeof(std::uint32_t) +
                                         TestPolicy::Bits / 8),
-                          value, status_type::NeedsCommitting};
+                          std::make_shared<std::string const>(value),
+                          status_type::NeedsCommitting};
     }
 
     key_value_type EmptyKeyValue() { return key_value_type(); }
@@ -160,12 +163,26 @@ class DBTest : public ::testing::Test
    public:
     using util = detail::KeyUtil<TestPolicy::Bits>;
 
-    std::unique_ptr<DB<TestPolicy::Bits>> GetDB()
+    template <std::uint32_t BLOCK_SIZE = 0>
+    std::unique_ptr<DB<TestPolicy::Bits, NullLog, BLOCK_SIZE>> GetDB(
+        Options options = Options())
     {
-        Options options;
         options.keyFileName = "db.test.keys";
         options.valueFileName = "db.test.values";
-        return std::make_unique<DB<TestPolicy::Bits>>(options);
+        options.filterFileName = "db.test.filter";
+        options.cacheFileName = "db.test.cache";
+        return std::make_unique<DB<TestPolicy::Bits, NullLog, BLOCK_SIZE>>(
+            options);
+    }
+
+    std::unique_ptr<PartitionedDB<TestPolicy::Bits>> GetPartitionedDB(
+        Options options)
+    {
+        options.keyFileName = "db.test.keys";
+        options.valueFileName = "db.test.values";
+        options.filterFileName = "db.test.filter";
+        options.cacheFileName = "db.test.cache";
+        return std::make_unique<PartitionedDB<TestPolicy::Bits>>(options);
     }
 
     auto RandomKeys(std::size_t n, std::uint32_t seed)
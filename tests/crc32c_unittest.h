@@ -0,0 +1,27 @@
+#include <string>
+#include "tests/common.h"
+#include "db/crc32c.h"
+
+using namespace keyvadb;
+
+TEST(Crc32cTest, General)
+{
+    using detail::Crc32c;
+    // Check values from RFC 3720
+    std::string zeros(32, '\0');
+    std::string ones(32, '\xFF');
+    ASSERT_EQ(0x8A9136AAU, Crc32c::Value(zeros.data(), zeros.size()));
+    ASSERT_EQ(0x62A8AB43U, Crc32c::Value(ones.data(), ones.size()));
+    ASSERT_EQ(0xE3069283U, Crc32c::Value("123456789", 9));
+    std::string str;
+    for (std::size_t i = 0; i < 4099; i++) str.push_back(char(i * 7));
+    // Every length exercises both the word and byte loops
+    for (std::size_t n = 0; n < str.size(); n += 97)
+        ASSERT_EQ(Crc32c::TableValue(str.data(), n),
+                  Crc32c::Value(str.data(), n));
+    auto const crc = Crc32c::Value(str.data(), str.size());
+    ASSERT_EQ(crc, Crc32c::Extend(Crc32c::Value(str.data(), 1000),
+                                  str.data() + 1000, str.size() - 1000));
+    str[2000] ^= 1;
+    ASSERT_NE(crc, Crc32c::Value(str.data(), str.size()));
+}
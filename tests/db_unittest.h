@@ -2,6 +2,12 @@
 #include <vector>
 #include <set>
 #include <random>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
 #include "tests/common.h"
 
 using namespace keyvadb;
@@ -25,6 +31,13 @@ TYPED_TEST(DBTest, General)
     ASSERT_EQ(db_error::key_not_found, db->Get(key, &value));
     ASSERT_FALSE(db->Put(key, value));
     ASSERT_FALSE(db->Get(key, &value));
+    auto stats = db->GetStats();
+    ASSERT_EQ(1UL, stats.puts);
+    ASSERT_EQ(2UL, stats.gets);
+    ASSERT_EQ(1UL, stats.bufferHits);
+    ASSERT_EQ(1UL, stats.keyMisses);
+    ASSERT_EQ(2UL, stats.getLatency.Count());
+    ASSERT_EQ(1UL, stats.bufferOccupancy.Max());
 }
 
 TYPED_TEST(DBTest, Bulk)
@@ -76,12 +89,656 @@ TYPED_TEST(DBTest, Bulk)
     db = this->GetDB();
     ASSERT_FALSE(db->Open());
     std::uint32_t i = 0;
-    auto err = db->Each([&](std::string const& key, std::string const& value)
+    auto err = db->Each([&](Slice key, Slice value)
                         {
-                            this->CompareKeys(key, value.substr(0, 32));
-                            ASSERT_TRUE(unique.find(key) != unique.end());
+                            this->CompareKeys(key.to_string(),
+                                              value.substr(0, 32).to_string());
+                            ASSERT_TRUE(unique.find(key.to_string()) !=
+                                        unique.end());
                             i++;
                         });
     ASSERT_FALSE(err);
     ASSERT_EQ(numKeys, i);
 }
+
+TYPED_TEST(DBTest, OverwriteAndDelete)
+{
+    auto keys = this->RandomKeys(1000, 1);
+    auto db = this->GetDB();
+    ASSERT_FALSE(db->Open());
+    ASSERT_FALSE(db->Clear());
+    for (auto const& key : keys) ASSERT_FALSE(db->Put(key, key));
+    // Force flush to disk
+    db.reset();
+    db = this->GetDB();
+    ASSERT_FALSE(db->Open());
+    std::string value;
+    for (std::size_t i = 0; i < keys.size(); i++)
+    {
+        if (i % 2 == 0)
+            ASSERT_FALSE(db->Delete(keys[i]));
+        else
+            ASSERT_FALSE(db->Put(keys[i], "overwritten"));
+    }
+    for (std::size_t i = 0; i < keys.size(); i++)
+    {
+        auto err = db->Get(keys[i], &value);
+        if (i % 2 == 0)
+            ASSERT_EQ(db_error::key_not_found, err);
+        else
+        {
+            ASSERT_TRUE(NoError(err));
+            ASSERT_EQ("overwritten", value);
+        }
+    }
+    db.reset();
+    db = this->GetDB();
+    ASSERT_FALSE(db->Open());
+    for (std::size_t i = 0; i < keys.size(); i++)
+    {
+        auto err = db->Get(keys[i], &value);
+        if (i % 2 == 0)
+            ASSERT_EQ(db_error::key_not_found, err);
+        else
+        {
+            ASSERT_TRUE(NoError(err));
+            ASSERT_EQ("overwritten", value);
+        }
+    }
+}
+
+TYPED_TEST(DBTest, FlushReport)
+{
+    std::mutex lock;
+    std::vector<FlushReport> reports;
+    Options options;
+    options.flushInterval = 10;
+    options.flushCallback = [&](FlushReport const& report)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        reports.push_back(report);
+    };
+    auto db = this->GetDB(options);
+    ASSERT_FALSE(db->Open());
+    ASSERT_FALSE(db->Clear());
+    auto keys = this->RandomKeys(100, 2);
+    for (auto const& key : keys) ASSERT_FALSE(db->Put(key, key));
+    // Each flush which wrote anything synced both files
+    auto written = [&]()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return std::any_of(reports.cbegin(), reports.cend(),
+                           [](FlushReport const& report)
+                           {
+            return !report.Empty();
+        });
+    };
+    for (std::size_t i = 0; i < 1000 && !written(); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    ASSERT_TRUE(written());
+    ASSERT_LE(2UL, db->GetStats().syncLatency.Count());
+    db.reset();
+    std::uint64_t total = 0;
+    for (std::size_t i = 0; i < reports.size(); i++)
+    {
+        ASSERT_EQ(i, reports[i].sequence);
+        total += reports[i].keys;
+        if (reports[i].Empty())
+            continue;
+        for (auto const& phase : {"ValueStore::Sync", "KeyStore::Commit"})
+            ASSERT_LT(0, reports[i].Elapsed(phase).count()) << phase;
+    }
+    ASSERT_EQ(keys.size(), total);
+}
+
+TYPED_TEST(DBTest, Filter)
+{
+    auto keys = this->RandomKeys(2000, 3);
+    auto missing = this->RandomKeys(2000, 4);
+    auto db = this->GetDB();
+    ASSERT_FALSE(db->Open());
+    ASSERT_FALSE(db->Clear());
+    for (auto const& key : keys) ASSERT_FALSE(db->Put(key, key));
+    // Reopen twice, first loading the saved filter and then rebuilding it
+    for (auto const& filterFile : {"db.test.filter", "db.test.missing"})
+    {
+        db.reset();
+        Options options;
+        options.filterFileName = filterFile;
+        db = this->GetDB(options);
+        ASSERT_FALSE(db->Open());
+        std::string value;
+        for (auto const& key : keys)
+        {
+            ASSERT_TRUE(NoError(db->Get(key, &value)));
+            ASSERT_EQ(key, value);
+        }
+        for (auto const& key : missing)
+            ASSERT_EQ(db_error::key_not_found, db->Get(key, &value));
+        auto stats = db->GetStats();
+        ASSERT_LT(missing.size() * 9 / 10, stats.filterNegatives);
+        ASSERT_EQ(missing.size(), stats.keyMisses);
+    }
+    db.reset();
+    std::remove("db.test.missing");
+}
+
+TYPED_TEST(DBTest, Partitioned)
+{
+    auto keys = this->RandomKeys(4000, 5);
+    Options options;
+    options.partitionBits = 2;
+    options.flushInterval = 10;
+    auto db = this->GetPartitionedDB(options);
+    ASSERT_EQ(4UL, db->Partitions());
+    ASSERT_FALSE(db->Open());
+    ASSERT_FALSE(db->Clear());
+    for (std::size_t i = 0; i < keys.size(); i++)
+        ASSERT_FALSE(db->Put(keys[i], keys[i]));
+    for (std::size_t i = 0; i < keys.size(); i += 4)
+        ASSERT_FALSE(db->Delete(keys[i]));
+    db.reset();
+    db = this->GetPartitionedDB(options);
+    ASSERT_FALSE(db->Open());
+    std::string value;
+    for (std::size_t i = 0; i < keys.size(); i++)
+    {
+        auto err = db->Get(keys[i], &value);
+        if (i % 4 == 0)
+            ASSERT_EQ(db_error::key_not_found, err);
+        else
+        {
+            ASSERT_TRUE(NoError(err));
+            ASSERT_EQ(keys[i], value);
+        }
+    }
+    auto stats = db->GetStats();
+    ASSERT_EQ(keys.size(), stats.gets);
+    std::size_t count = 0;
+    ASSERT_FALSE(db->Each([&](Slice, Slice)
+                          {
+                              count++;
+                          }));
+    // Keys deleted before they were flushed never reach the values file
+    ASSERT_LE(keys.size() * 3 / 4, count);
+    ASSERT_GE(keys.size(), count);
+    // The partitions share one reader, and finish their lookups on close
+    std::size_t asyncFound = 0;
+    for (std::size_t i = 1; i < keys.size(); i += 4)
+        db->GetAsync(keys[i], [&, i](std::error_condition err,
+                                     std::string const& v)
+                     {
+                         if (!err && v == keys[i])
+                             asyncFound++;
+                     });
+    db->Poll();
+    db.reset();
+    ASSERT_EQ(keys.size() / 4, asyncFound);
+
+    // Each partition only accepts its own keys and files
+    options.partition = 1;
+    auto part = this->GetDB(options);
+    ASSERT_EQ(db_error::wrong_partition,
+              part->Put(std::string(32, '\0'), "x"));
+    ASSERT_FALSE(part->Delete(std::string(32, '\x40')));
+    part.reset();
+    auto whole = this->GetDB();
+    ASSERT_FALSE(whole->Open());
+    whole.reset();
+    part = this->GetDB(options);
+    ASSERT_EQ(db_error::wrong_partition, part->Open());
+}
+
+TYPED_TEST(DBTest, LevelBlockSizes)
+{
+    Options options;
+    options.levelBlockSizes = {65536, 4096};
+    auto keys = this->RandomKeys(5000, 5);
+    auto db = this->GetDB(options);
+    ASSERT_FALSE(db->Open());
+    ASSERT_FALSE(db->Clear());
+    for (auto const& key : keys) ASSERT_FALSE(db->Put(key, key));
+    // Reopened with the default options the file keeps its block sizes
+    db.reset();
+    db = this->GetDB();
+    ASSERT_FALSE(db->Open());
+    std::string value;
+    for (auto const& key : keys)
+    {
+        ASSERT_TRUE(NoError(db->Get(key, &value)));
+        ASSERT_EQ(key, value);
+    }
+}
+
+TYPED_TEST(DBTest, FixedBlockSize)
+{
+    auto keys = this->RandomKeys(5000, 11);
+    // Start from a file of 4096 byte blocks
+    auto other = this->GetDB();
+    ASSERT_FALSE(other->Open());
+    ASSERT_FALSE(other->Clear());
+    other.reset();
+    auto db = this->template GetDB<4096>();
+    ASSERT_FALSE(db->Open());
+    ASSERT_FALSE(db->Clear());
+    for (auto const& key : keys) ASSERT_FALSE(db->Put(key, key));
+    db.reset();
+    // The file is the same as one written with the block size at run time
+    other = this->GetDB();
+    ASSERT_FALSE(other->Open());
+    std::string value;
+    for (auto const& key : keys)
+    {
+        ASSERT_TRUE(NoError(other->Get(key, &value)));
+        ASSERT_EQ(key, value);
+    }
+    ASSERT_FALSE(other->Clear());
+    other.reset();
+    Options options;
+    options.levelBlockSizes = {8192, 4096};
+    db = this->template GetDB<4096>(options);
+    ASSERT_EQ(db_error::wrong_block_size, db->Open());
+    other = this->GetDB(options);
+    ASSERT_FALSE(other->Open());
+    ASSERT_FALSE(other->Clear());
+    other.reset();
+    db = this->template GetDB<4096>();
+    ASSERT_EQ(db_error::wrong_block_size, db->Open());
+}
+
+TYPED_TEST(DBTest, Checksums)
+{
+    auto flip = [](char const* filename, std::uint64_t const offset)
+    {
+        PosixRandomAccessFile file(filename);
+        ASSERT_FALSE(file.Open());
+        std::string str(1, '\0');
+        ASSERT_FALSE(file.ReadAt(offset, str).second);
+        str[0] ^= 1;
+        ASSERT_FALSE(file.WriteAt(str, offset).second);
+        ASSERT_FALSE(file.Close());
+    };
+    auto const key = this->RandomKeys(1, 6).front();
+    std::string const stored(100, 'v');
+    auto db = this->GetDB();
+    ASSERT_FALSE(db->Open());
+    ASSERT_FALSE(db->Clear());
+    ASSERT_FALSE(db->Put(key, stored));
+    db.reset();
+
+    // The only record starts the values file, flip a bit of its value
+    flip("db.test.values", 60);
+    std::string value;
+    db = this->GetDB();
+    ASSERT_FALSE(db->Open());
+    ASSERT_EQ(db_error::checksum_mismatch, db->Get(key, &value));
+    ASSERT_EQ(db_error::checksum_mismatch,
+              db->Each([](Slice, Slice)
+                       {
+                       }));
+    db.reset();
+    Options options;
+    options.verifyChecksums = ChecksumPolicy::Nodes;
+    db = this->GetDB(options);
+    ASSERT_FALSE(db->Open());
+    ASSERT_TRUE(NoError(db->Get(key, &value)));
+    ASSERT_NE(stored, value);
+    db.reset();
+
+    // The root is the first node after the header
+    flip("db.test.keys", 2 * 4096 + 100);
+    db = this->GetDB(options);
+    ASSERT_EQ(db_error::checksum_mismatch, db->Open());
+    db.reset();
+    options.verifyChecksums = ChecksumPolicy::None;
+    db = this->GetDB(options);
+    ASSERT_FALSE(db->Open());
+    // Don't leave corrupt files for the next test to open
+    ASSERT_FALSE(db->Clear());
+}
+
+TYPED_TEST(DBTest, DirectIO)
+{
+    Options options;
+    options.directIO = true;
+    options.cacheSize = 16;
+    // There is no page cache to prefetch into
+    std::atomic<std::uint64_t> prefetches(0);
+    options.flushCallback = [&](FlushReport const& report)
+    {
+        prefetches += report.prefetches;
+    };
+    auto keys = this->RandomKeys(5000, 7);
+    auto db = this->GetDB(options);
+    ASSERT_FALSE(db->Open());
+    ASSERT_FALSE(db->Clear());
+    for (auto const& key : keys) ASSERT_FALSE(db->Put(key, key));
+    db.reset();
+    ASSERT_EQ(0UL, prefetches);
+    db = this->GetDB(options);
+    ASSERT_FALSE(db->Open());
+    std::string value;
+    for (auto const& key : keys)
+    {
+        ASSERT_TRUE(NoError(db->Get(key, &value)));
+        ASSERT_EQ(key, value);
+    }
+}
+
+TYPED_TEST(DBTest, MmapValues)
+{
+    Options options;
+    options.mmapValues = true;
+    auto keys = this->RandomKeys(2000, 13);
+    auto db = this->GetDB(options);
+    ASSERT_FALSE(db->Open());
+    ASSERT_FALSE(db->Clear());
+    for (auto const& key : keys) ASSERT_FALSE(db->Put(key, key));
+    db.reset();
+    db = this->GetDB(options);
+    ASSERT_FALSE(db->Open());
+    std::string value;
+    for (auto const& key : keys)
+    {
+        ASSERT_TRUE(NoError(db->Get(key, &value)));
+        ASSERT_EQ(key, value);
+    }
+    // Values written after the file was mapped
+    auto more = this->RandomKeys(2000, 14);
+    for (auto const& key : more) ASSERT_FALSE(db->Put(key, key));
+    db.reset();
+    db = this->GetDB(options);
+    ASSERT_FALSE(db->Open());
+    std::size_t count = 0;
+    ASSERT_FALSE(db->Each([&count](Slice key, Slice value)
+                          {
+                              if (key == value)
+                                  count++;
+                          }));
+    ASSERT_EQ(keys.size() + more.size(), count);
+}
+
+TYPED_TEST(DBTest, GetAsync)
+{
+    auto keys = this->RandomKeys(2000, 8);
+    auto missing = this->RandomKeys(100, 9);
+    for (auto const direct : {false, true})
+    {
+        Options options;
+        options.directIO = direct;
+        options.mmapValues = !direct;
+        auto db = this->GetDB(options);
+        ASSERT_FALSE(db->Open());
+        ASSERT_FALSE(db->Clear());
+        for (auto const& key : keys) ASSERT_FALSE(db->Put(key, key));
+        // Reopen without the cache file so that nothing but the root has
+        // been read
+        db.reset();
+        std::remove("db.test.cache");
+        db = this->GetDB(options);
+        ASSERT_FALSE(db->Open());
+        auto const thread = std::this_thread::get_id();
+        std::size_t done = 0, found = 0, notFound = 0;
+        auto check = [&](std::string const& key)
+        {
+            return [&, key](std::error_condition err, std::string const& value)
+            {
+                ASSERT_EQ(thread, std::this_thread::get_id());
+                if (!err && value == key)
+                    found++;
+                else if (err == db_error::key_not_found)
+                    notFound++;
+                done++;
+            };
+        };
+        for (auto const& key : keys) db->GetAsync(key, check(key));
+        for (auto const& key : missing) db->GetAsync(key, check(key));
+        // Every present key is waiting for a read, with none of them
+        // blocking this thread
+        ASSERT_LE(keys.size(), db->Pending());
+        ASSERT_LE(keys.size() + missing.size(), done + db->Pending());
+        while (db->Pending() > 0) db->Poll(true);
+        ASSERT_EQ(keys.size() + missing.size(), done);
+        ASSERT_EQ(keys.size(), found);
+        ASSERT_EQ(missing.size(), notFound);
+        ASSERT_EQ(done, db->GetStats().gets);
+        ASSERT_EQ(0UL, db->Poll());
+        // Lookups may be started from callbacks
+        std::string value;
+        db->GetAsync(keys[0], [&](std::error_condition, std::string const&)
+                     {
+                         db->GetAsync(keys[1],
+                                      [&](std::error_condition err,
+                                          std::string const& v)
+                                      {
+                                          if (!err)
+                                              value = v;
+                                      });
+                     });
+        while (db->Pending() > 0) db->Poll(true);
+        ASSERT_EQ(keys[1], value);
+        // Bad keys call back straight away
+        std::error_condition err;
+        db->GetAsync("short", [&](std::error_condition e, std::string const&)
+                     {
+                         err = e;
+                     });
+        ASSERT_EQ(db_error::key_wrong_length, err);
+        // Destroying the DB finishes outstanding lookups
+        done = found = 0;
+        for (auto const& key : keys) db->GetAsync(key, check(key));
+        db.reset();
+        ASSERT_EQ(keys.size(), found);
+    }
+    // Without a reader GetAsync calls Get
+    Options options;
+    options.asyncDepth = 0;
+    auto db = this->GetDB(options);
+    ASSERT_FALSE(db->Open());
+    bool called = false;
+    db->GetAsync(keys[0], [&](std::error_condition err, std::string const& v)
+                 {
+                     ASSERT_FALSE(err);
+                     ASSERT_EQ(keys[0], v);
+                     called = true;
+                 });
+    ASSERT_TRUE(called);
+    ASSERT_EQ(0UL, db->Pending());
+}
+
+TYPED_TEST(DBTest, GetAsyncDuringFlush)
+{
+    auto keys = this->RandomKeys(1000, 12);
+    Options options;
+    // Every read is started before the flush
+    options.asyncDepth = 1024;
+    auto db = this->GetDB(options);
+    ASSERT_FALSE(db->Open());
+    ASSERT_FALSE(db->Clear());
+    for (auto const& key : keys) ASSERT_FALSE(db->Put(key, "old"));
+    // Flushed on close, and reopened with an empty cache so that every
+    // lookup is reading a node
+    db.reset();
+    std::remove("db.test.cache");
+    options.flushInterval = 10;
+    db = this->GetDB(options);
+    ASSERT_FALSE(db->Open());
+    // Cache the root, so that the lookups read the nodes below it
+    std::string value;
+    db->GetAsync(keys[0], [](std::error_condition, std::string const&)
+                 {
+                 });
+    while (db->Pending() > 0) db->Poll(true);
+    std::size_t done = 0;
+    for (auto const& key : keys)
+        db->GetAsync(key, [&](std::error_condition err, std::string const& v)
+                     {
+                         ASSERT_FALSE(err);
+                         ASSERT_TRUE(v == "old" || v == "new") << v;
+                         done++;
+                     });
+    ASSERT_LE(keys.size(), db->Pending());
+    // Rewrite every node on the lookups' paths before they are polled
+    for (auto const& key : keys) ASSERT_FALSE(db->Put(key, "new"));
+    for (std::size_t i = 0; i < 1000 && db->GetStats().bufferSize > 0; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    ASSERT_EQ(0UL, db->GetStats().bufferSize);
+    while (db->Pending() > 0) db->Poll(true);
+    ASSERT_EQ(keys.size(), done);
+    // The nodes read before the flush weren't cached over its own
+    for (auto const& key : keys)
+    {
+        ASSERT_FALSE(db->Get(key, &value));
+        ASSERT_EQ("new", value);
+        db->GetAsync(key, [&](std::error_condition err, std::string const& v)
+                     {
+                         ASSERT_FALSE(err);
+                         ASSERT_EQ("new", v);
+                     });
+        while (db->Pending() > 0) db->Poll(true);
+    }
+}
+
+#ifdef KEYVADB_COROUTINES
+// Runs from its start to its first suspension when called
+struct DetachedTask
+{
+    struct promise_type
+    {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+template <class DBType>
+DetachedTask AwaitKeys(DBType& db, std::vector<std::string> const& keys,
+                       std::size_t& found)
+{
+    std::string value;
+    for (auto const& key : keys)
+        if (!co_await AwaitGet(db, key, &value) && value == key)
+            found++;
+}
+
+TYPED_TEST(DBTest, AwaitGet)
+{
+    auto keys = this->RandomKeys(500, 11);
+    auto db = this->GetDB();
+    ASSERT_FALSE(db->Open());
+    ASSERT_FALSE(db->Clear());
+    for (auto const& key : keys) ASSERT_FALSE(db->Put(key, key));
+    // Some are awaited from the buffer without suspending
+    std::size_t found = 0;
+    AwaitKeys(*db, keys, found);
+    ASSERT_EQ(keys.size(), found);
+    db.reset();
+    db = this->GetDB();
+    ASSERT_FALSE(db->Open());
+    // Many coroutines, each awaiting a few keys in turn from disk
+    found = 0;
+    std::vector<std::vector<std::string>> batches(100);
+    for (std::size_t i = 0; i < keys.size(); i++)
+        batches[i % batches.size()].push_back(keys[i]);
+    for (auto const& batch : batches) AwaitKeys(*db, batch, found);
+    ASSERT_LT(0UL, db->Pending());
+    while (db->Pending() > 0) db->Poll(true);
+    ASSERT_EQ(keys.size(), found);
+}
+#endif
+
+TYPED_TEST(DBTest, Warmup)
+{
+    auto keys = this->RandomKeys(5000, 10);
+    auto db = this->GetDB();
+    ASSERT_FALSE(db->Open());
+    ASSERT_FALSE(db->Clear());
+    for (auto const& key : keys) ASSERT_FALSE(db->Put(key, key));
+    db.reset();
+    db = this->GetDB();
+    ASSERT_FALSE(db->Open());
+    // The cache is filled in the background
+    for (std::size_t i = 0; i < 1000 && db->GetStats().cacheSize == 0; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    ASSERT_LT(0UL, db->GetStats().cacheSize);
+    std::string value;
+    for (auto const& key : keys)
+    {
+        ASSERT_TRUE(NoError(db->Get(key, &value)));
+        ASSERT_EQ(key, value);
+    }
+    // Without the snapshot the cache starts empty
+    db.reset();
+    std::remove("db.test.cache");
+    db = this->GetDB();
+    ASSERT_FALSE(db->Open());
+    ASSERT_EQ(0UL, db->GetStats().cacheSize);
+}
+
+TYPED_TEST(DBTest, ValueCache)
+{
+    Options options;
+    options.valueCacheSize = 1024 * 1024;
+    auto keys = this->RandomKeys(1000, 11);
+    auto db = this->GetDB(options);
+    ASSERT_FALSE(db->Open());
+    ASSERT_FALSE(db->Clear());
+    for (auto const& key : keys) ASSERT_FALSE(db->Put(key, key));
+    db.reset();
+    db = this->GetDB(options);
+    ASSERT_FALSE(db->Open());
+    std::string value;
+    for (std::size_t i = 0; i < 2; i++)
+        for (auto const& key : keys)
+        {
+            ASSERT_TRUE(NoError(db->Get(key, &value)));
+            ASSERT_EQ(key, value);
+        }
+    auto stats = db->GetStats();
+    ASSERT_EQ(keys.size(), stats.valueCacheMisses);
+    ASSERT_EQ(keys.size(), stats.valueCacheHits);
+    ASSERT_LT(0UL, stats.valueCacheSize);
+    // Clearing the values file drops the cached values
+    ASSERT_FALSE(db->Clear());
+    ASSERT_EQ(0UL, db->GetStats().valueCacheSize);
+    ASSERT_EQ(db_error::key_not_found, db->Get(keys[0], &value));
+}
+
+TYPED_TEST(DBTest, PinnedGet)
+{
+    Options options;
+    options.valueCacheSize = 1024 * 1024;
+    auto keys = this->RandomKeys(100, 12);
+    auto db = this->GetDB(options);
+    ASSERT_FALSE(db->Open());
+    ASSERT_FALSE(db->Clear());
+    ASSERT_FALSE(db->Put(keys[0], keys[0]));
+    // Straight from the buffer, without a copy
+    typename DB<TypeParam::Bits>::value_ptr first, second;
+    ASSERT_FALSE(db->Get(keys[0], &first));
+    ASSERT_FALSE(db->Get(keys[0], &second));
+    ASSERT_EQ(keys[0], *first);
+    ASSERT_EQ(first, second);
+    ASSERT_EQ(db_error::key_not_found, db->Get(keys[1], &second));
+    ASSERT_FALSE(db->Delete(keys[0]));
+    ASSERT_EQ(db_error::key_not_found, db->Get(keys[0], &second));
+    // Still valid after the buffer has moved on
+    ASSERT_EQ(keys[0], *first);
+    for (auto const& key : keys) ASSERT_FALSE(db->Put(key, key));
+    db.reset();
+    db = this->GetDB(options);
+    ASSERT_FALSE(db->Open());
+    // Read from disk once, then shared from the value cache
+    for (auto const& key : keys)
+    {
+        ASSERT_TRUE(NoError(db->Get(key, &first)));
+        ASSERT_TRUE(NoError(db->Get(key, &second)));
+        ASSERT_EQ(key, *first);
+        ASSERT_EQ(first, second);
+    }
+    ASSERT_EQ(keys.size(), db->GetStats().valueCacheHits);
+    ASSERT_FALSE(db->Clear());
+    ASSERT_EQ(keys.back(), *first);
+}
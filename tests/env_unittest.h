@@ -0,0 +1,67 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "tests/common.h"
+#include "db/env.h"
+
+using namespace keyvadb;
+
+TEST(EnvTest, Direct)
+{
+    std::remove("test.direct");
+    PosixRandomAccessFile file("test.direct", true);
+    ASSERT_FALSE(file.Open());
+    std::atomic_uint_fast64_t size;
+    // Whole pages
+    std::string page(4096, 'a');
+    ASSERT_EQ(4096UL, file.WriteAt(page, 4096).first);
+    ASSERT_FALSE(file.Size(size));
+    ASSERT_EQ(8192UL, size);
+    // Part of a page keeps the rest of it and the file length
+    ASSERT_EQ(3UL, file.WriteAt("bcd", 4100).first);
+    ASSERT_FALSE(file.Size(size));
+    ASSERT_EQ(8192UL, size);
+    std::string str(6, '\0');
+    ASSERT_EQ(6UL, file.ReadAt(4098, str).first);
+    ASSERT_EQ("aabcda", str);
+    // Appends past the end, across a page boundary
+    std::vector<std::uint8_t> buf(5000, 'e');
+    ASSERT_EQ(5000UL, file.Write(buf).first);
+    ASSERT_FALSE(file.Size(size));
+    ASSERT_EQ(13192UL, size);
+    // Reads past the end are short
+    str.assign(10, '\0');
+    ASSERT_EQ(2UL, file.ReadAt(13190, str).first);
+    ASSERT_EQ("ee", str.substr(0, 2));
+    ASSERT_EQ(0UL, file.ReadAt(20000, str).first);
+    ASSERT_FALSE(file.Close());
+    std::remove("test.direct");
+}
+
+TEST(EnvTest, Mapped)
+{
+    std::remove("test.mapped");
+    PosixRandomAccessFile file("test.mapped", false, true);
+    ASSERT_FALSE(file.Open());
+    std::vector<std::uint8_t> buf(5000, 'a');
+    ASSERT_EQ(5000UL, file.Write(buf).first);
+    std::string str(6, '\0');
+    ASSERT_EQ(6UL, file.ReadAt(4094, str).first);
+    ASSERT_EQ("aaaaaa", str);
+    // Reads see writes made after the file was mapped
+    ASSERT_EQ(3UL, file.WriteAt("bcd", 4095).first);
+    buf.assign(100, 'e');
+    ASSERT_EQ(100UL, file.Write(buf).first);
+    ASSERT_EQ(6UL, file.ReadAt(4094, str).first);
+    ASSERT_EQ("abcdaa", str);
+    // Reads past the end are short, not faults
+    str.assign(10, '\0');
+    ASSERT_EQ(2UL, file.ReadAt(5098, str).first);
+    ASSERT_EQ("ee", str.substr(0, 2));
+    ASSERT_EQ(0UL, file.ReadAt(20000, str).first);
+    file.Advise(AccessPattern::Sequential);
+    ASSERT_FALSE(file.Truncate());
+    ASSERT_EQ(0UL, file.ReadAt(0, str).first);
+    ASSERT_FALSE(file.Close());
+    std::remove("test.mapped");
+}
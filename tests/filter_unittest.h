@@ -0,0 +1,113 @@
+#include "tests/common.h"
+#include "db/filter.h"
+
+using namespace keyvadb;
+
+TEST(FilterTest, General)
+{
+    using util = detail::KeyUtil<256>;
+    KeyFilter<256> disabled(0);
+    ASSERT_FALSE(disabled.Enabled());
+    ASSERT_TRUE(disabled.MayContain(util::MakeKey(1)));
+
+    // Small initial capacity so that the filter has to grow
+    KeyFilter<256> filter(10, 1000);
+    auto keys = util::RandomKeys(10000, 0);
+    for (auto const& key : keys) filter.Add(key);
+    // Keys which are false positives aren't counted
+    ASSERT_LE(9700UL, filter.Count());
+    for (auto const& key : keys) ASSERT_TRUE(filter.MayContain(key));
+    std::size_t falsePositives = 0;
+    for (auto const& key : util::RandomKeys(10000, 1))
+        falsePositives += filter.MayContain(key);
+    ASSERT_GT(500UL, falsePositives);
+    // Structured keys are spread too
+    for (std::uint64_t i = 1; i < 1000; i++)
+        filter.Add(util::MakeKey(i));
+    for (std::uint64_t i = 1; i < 1000; i++)
+        ASSERT_TRUE(filter.MayContain(util::MakeKey(i)));
+}
+
+TEST(FilterTest, SaveAndLoad)
+{
+    using util = detail::KeyUtil<256>;
+    PosixRandomAccessFile file("test.filter");
+    ASSERT_FALSE(file.Open());
+    ASSERT_FALSE(file.Truncate());
+    KeyFilter<256> filter(10, 1000);
+    KeyFilter<256> loaded(10, 1000);
+    bool ok;
+    std::error_condition err;
+    // Empty file
+    std::tie(ok, err) = loaded.Load(file, 1, 2);
+    ASSERT_FALSE(err);
+    ASSERT_FALSE(ok);
+    auto keys = util::RandomKeys(5000, 0);
+    for (auto const& key : keys) filter.Add(key);
+    ASSERT_FALSE(filter.Save(file, 1, 2));
+    // Out of date
+    std::tie(ok, err) = loaded.Load(file, 1, 3);
+    ASSERT_FALSE(err);
+    ASSERT_FALSE(ok);
+    std::tie(ok, err) = loaded.Load(file, 1, 2);
+    ASSERT_FALSE(err);
+    ASSERT_TRUE(ok);
+    ASSERT_EQ(filter.Count(), loaded.Count());
+    ASSERT_EQ(filter.MemoryUsage(), loaded.MemoryUsage());
+    for (auto const& key : keys) ASSERT_TRUE(loaded.MayContain(key));
+    for (auto const& key : util::RandomKeys(1000, 1))
+        ASSERT_EQ(filter.MayContain(key), loaded.MayContain(key));
+    // Different configuration
+    KeyFilter<256> other(8, 1000);
+    std::tie(ok, err) = other.Load(file, 1, 2);
+    ASSERT_FALSE(ok);
+    ASSERT_FALSE(file.Close());
+}
+
+TEST(FilterTest, Corrupt)
+{
+    using util = detail::KeyUtil<256>;
+    PosixRandomAccessFile file("test.filter");
+    ASSERT_FALSE(file.Open());
+    ASSERT_FALSE(file.Truncate());
+    KeyFilter<256> filter(10, 1000);
+    for (auto const& key : util::RandomKeys(5000, 0)) filter.Add(key);
+    ASSERT_FALSE(filter.Save(file, 1, 2));
+    std::atomic_uint_fast64_t length;
+    ASSERT_FALSE(file.Size(length));
+    std::string saved(length, '\0');
+    std::size_t n;
+    std::error_condition err;
+    std::tie(n, err) = file.ReadAt(0, saved);
+    ASSERT_FALSE(err);
+    // Writes str as the whole file and loads it
+    auto load = [&](std::string const& str)
+    {
+        EXPECT_FALSE(file.Truncate());
+        std::size_t written;
+        std::error_condition writeErr;
+        std::tie(written, writeErr) = file.WriteAt(str, 0);
+        EXPECT_FALSE(writeErr);
+        KeyFilter<256> loaded(10, 1000);
+        bool ok;
+        std::error_condition loadErr;
+        std::tie(ok, loadErr) = loaded.Load(file, 1, 2);
+        EXPECT_FALSE(loadErr);
+        return ok;
+    };
+    ASSERT_TRUE(load(saved));
+    // A flipped bit in the bits of a level
+    auto flipped = saved;
+    flipped[saved.size() / 2] ^= 1;
+    ASSERT_FALSE(load(flipped));
+    // Truncated
+    ASSERT_FALSE(load(saved.substr(0, saved.size() - 100)));
+    // A capacity far bigger than the file, with a checksum to match
+    auto huge = saved;
+    std::uint64_t const capacity = 1ULL << 60;
+    string_replace(capacity, 32, huge);
+    auto const end = huge.size() - sizeof(std::uint32_t);
+    string_replace(detail::Crc32c::Value(huge.data(), end), end, huge);
+    ASSERT_FALSE(load(huge));
+    ASSERT_FALSE(file.Close());
+}
@@ -1,4 +1,9 @@
 #include <boost/algorithm/hex.hpp>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
 #include <string>
 #include "tests/common.h"
 #include "db/key.h"
@@ -14,7 +19,8 @@ class KeyTest : public ::testing::Test
 };
 
 typedef ::testing::Types<detail::KeyUtil<1024>, detail::KeyUtil<256>,
-                         detail::KeyUtil<32>, detail::KeyUtil<8>> KeyUtilTypes;
+                         detail::KeyUtil<160>, detail::KeyUtil<32>,
+                         detail::KeyUtil<8>> KeyUtilTypes;
 TYPED_TEST_CASE(KeyTest, KeyUtilTypes);
 
 TYPED_TEST(KeyTest, General)
@@ -59,10 +65,48 @@ TYPED_TEST(KeyTest, General)
     this->policy_.NearestStride(zero, stride, two, distance, nearest);
     ASSERT_EQ(ones - two, distance);
     ASSERT_EQ(0UL, nearest);
+    // StrideDivider agrees with NearestStride
+    for (auto const degree : {2U, 15U, 77U})
+    {
+        auto start = this->policy_.MakeKey(1);
+        auto s = this->policy_.Stride(start, last, degree);
+        if (s.is_zero())
+            continue;
+        auto values = this->policy_.RandomKeys(1000, degree);
+        values.push_back(last);
+        values.push_back(start + s);
+        values.push_back(start + s * (degree - 1));
+        // Including from a start whose strides would run past Max
+        auto const nearMax = last - s * (degree / 2) - first;
+        for (std::uint32_t i = 0; i <= degree / 2; i++)
+            values.push_back(nearMax + s * i + first);
+        for (auto const& from : {start, nearMax})
+        {
+            typename TypeParam::StrideDivider divider(from, s, degree);
+            for (auto const& value : values)
+            {
+                if (value <= from)
+                    continue;
+                uint32_t expectedNearest, gotNearest;
+                auto expectedDistance = zero, gotDistance = zero;
+                this->policy_.NearestStride(from, s, value, expectedDistance,
+                                            expectedNearest);
+                divider.Nearest(value, gotDistance, gotNearest);
+                ASSERT_EQ(expectedNearest, gotNearest);
+                ASSERT_EQ(expectedDistance, gotDistance);
+            }
+        }
+    }
     // From/To bytes
     auto f = this->policy_.ToBytes(first);
+    ASSERT_EQ(std::size_t(this->policy_.Bytes), f.size());
+    ASSERT_EQ(std::string(this->policy_.Bytes - 1, '\0') + '\1', f);
     auto f2 = this->policy_.FromBytes(f);
     ASSERT_EQ(first, f2);
+    ASSERT_EQ(std::string(this->policy_.HexChars - 1, '0') + '1',
+              this->policy_.ToHex(first));
+    ASSERT_EQ(std::string(this->policy_.HexChars, 'F'),
+              this->policy_.ToHex(last));
     auto l = this->policy_.ToBytes(last);
     auto l2 = this->policy_.FromBytes(l);
     ASSERT_EQ(last, l2);
@@ -78,9 +122,108 @@ TYPED_TEST(KeyTest, General)
 TEST(KeyTest, RoundTrip)
 {
     using util = detail::KeyUtil<256>;
-    using key_type = typename util::key_type;
     std::string in(
         "1E0DABB20AAAC3498DE92C73EA14E0FAB24BE2F53E503A0ACEB73AD54DB8DBF5");
     auto key = util::FromBytes(unhex(in));
     ASSERT_EQ(in, util::ToHex(key));
 }
+
+// Compares the encodings with the string reversing and stringstream versions
+// they replaced. A benchmark rather than a test, so it only runs when asked
+// for. Run with a release build for meaningful numbers.
+TEST(KeyTest, DISABLED_EncodingSpeed)
+{
+    using util = detail::KeyUtil<256>;
+    using key_type = typename util::key_type;
+    using clock = std::chrono::steady_clock;
+    auto oldToBytes = [](key_type const& key)
+    {
+        auto bytes = key.backend().limbs();
+        auto length = key.backend().size() * sizeof(*key.backend().limbs());
+        auto str = std::string(reinterpret_cast<const char*>(bytes), length);
+        std::reverse(str.begin(), str.end());
+        return str;
+    };
+    auto oldFromBytes = [](std::string const& str)
+    {
+        key_type key;
+        auto length = str.size() / sizeof(*key.backend().limbs());
+        key.backend().resize(length, length);
+        auto bytes = key.backend().limbs();
+        std::reverse_copy(str.cbegin(), str.cend(),
+                          reinterpret_cast<char*>(bytes));
+        key.backend().normalize();
+        return key;
+    };
+    auto oldToHex = [](key_type const& key)
+    {
+        std::stringstream ss;
+        ss << std::setw(64) << std::setfill('0') << std::setbase(16) << key;
+        return ss.str();
+    };
+    auto keys = util::RandomKeys(10000, 0);
+    std::vector<std::string> bytes;
+    for (auto const& key : keys) bytes.push_back(util::ToBytes(key));
+    auto time = [&](char const* name, std::function<std::size_t()> f)
+    {
+        auto start = clock::now();
+        auto checksum = f();
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      clock::now() - start).count();
+        std::cout << name << ": " << ns / keys.size() << " ns/key"
+                  << std::endl;
+        return checksum;
+    };
+    char out[util::HexChars];
+    auto oldTo = time("ToBytes (reverse)", [&]
+                      {
+                          std::size_t n = 0;
+                          for (auto const& key : keys)
+                              n += oldToBytes(key)[0];
+                          return n;
+                      });
+    auto newTo = time("ToBytes (bswap)", [&]
+                      {
+                          std::size_t n = 0;
+                          for (auto const& key : keys)
+                          {
+                              util::ToBytes(key, out);
+                              n += out[0];
+                          }
+                          return n;
+                      });
+    ASSERT_EQ(oldTo, newTo);
+    auto oldFrom = time("FromBytes (reverse)", [&]
+                        {
+                            std::size_t n = 0;
+                            for (auto const& b : bytes)
+                                n += oldFromBytes(b).backend().limbs()[0];
+                            return n;
+                        });
+    auto newFrom = time("FromBytes (bswap)", [&]
+                        {
+                            std::size_t n = 0;
+                            for (auto const& b : bytes)
+                                n += util::FromBytes(b.data(), b.size())
+                                         .backend()
+                                         .limbs()[0];
+                            return n;
+                        });
+    ASSERT_EQ(oldFrom, newFrom);
+    time("ToHex (stringstream)", [&]
+         {
+             std::size_t n = 0;
+             for (auto const& key : keys) n += oldToHex(key)[0];
+             return n;
+         });
+    time("ToHex (table)", [&]
+         {
+             std::size_t n = 0;
+             for (auto const& key : keys)
+             {
+                 util::ToHex(key, out);
+                 n += out[0];
+             }
+             return n;
+         });
+}
@@ -1,8 +1,41 @@
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
 #include "tests/common.h"
 #include "db/node.h"
 
 using namespace keyvadb;
 
+// Returns the mean ns per key of Find, with the choice of child, over
+// count copies of node, picked at random for each key so that most
+// lookups miss the CPU caches as they would in a large tree. Also returns
+// a checksum of the results.
+template <class NodeType>
+std::pair<double, std::size_t> TimeFind(
+    NodeType const& node, std::size_t const count,
+    std::vector<typename NodeType::key_type> const& keys)
+{
+    std::vector<std::unique_ptr<NodeType>> nodes;
+    for (std::size_t n = 0; n < count; n++)
+        nodes.push_back(std::make_unique<NodeType>(node));
+    std::mt19937_64 rng(0);
+    typename NodeType::key_value_type kv;
+    std::size_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (auto const& key : keys)
+    {
+        std::size_t i;
+        if (nodes[rng() % count]->Find(key, &kv, i))
+            checksum += kv.offset;
+        else
+            checksum += i;
+    }
+    auto const ns = std::chrono::duration<double, std::nano>(
+                        std::chrono::steady_clock::now() - start).count();
+    return std::make_pair(ns / keys.size(), checksum);
+}
+
 template <typename T>
 class NodeTest : public ::testing::Test
 {
@@ -55,4 +88,255 @@ TEST(NodeTest, CalculateDegree)
 {
     ASSERT_EQ(77UL, Node<256>::CalculateDegree(4096));
     ASSERT_EQ(156UL, Node<256>::CalculateDegree(8192));
-}
\ No newline at end of file
+}
+
+TYPED_TEST(NodeTest, Find)
+{
+    auto first = this->policy_.MakeKey(1);
+    auto last = this->policy_.FromHex('F');
+    Node<256> node(0, 0, 16, first, last);
+    typename Node<256>::key_value_type kv;
+    std::size_t i;
+    // Empty keys are never children's bounds
+    ASSERT_FALSE(node.FindChild(last - 1, i));
+    ASSERT_FALSE(node.Find(last - 1, &kv, i));
+    ASSERT_EQ(node.Degree(), i);
+    node.AddSyntheticKeyValues();
+    for (std::size_t j = 0; j < node.MaxKeys(); j++)
+    {
+        auto const key = node.GetKeyValue(j).key;
+        ASSERT_TRUE(node.Find(key, &kv));
+        ASSERT_EQ(key, kv.key);
+        ASSERT_FALSE(node.Find(key + 1, &kv));
+        // Between key j - 1 and key j is child j
+        ASSERT_TRUE(node.FindChild(key - 1, i));
+        ASSERT_EQ(j, i);
+        ASSERT_TRUE(node.FindChild(key + 1, i));
+        ASSERT_EQ(j + 1, i);
+        ASSERT_FALSE(node.Find(key - 1, &kv, i));
+        ASSERT_EQ(j, i);
+    }
+    ASSERT_FALSE(node.FindChild(first, i));
+    ASSERT_FALSE(node.FindChild(last, i));
+    ASSERT_FALSE(node.Find(last, &kv, i));
+    ASSERT_EQ(node.Degree(), i);
+    // Constant for a compile time block size
+    static_assert(Node<256>::CalculateDegree(4096) == 77, "degree");
+}
+
+TYPED_TEST(NodeTest, ReadWrite)
+{
+    auto first = this->policy_.MakeKey(1);
+    auto last = this->policy_.FromHex('F');
+    Node<256> node(0, 3, 16, first, last);
+    node.AddSyntheticKeyValues();
+    node.SetValue(4, 100, 20);
+    node.SetChild(5, 4096);
+    std::string str(4096, '\0');
+    auto const length = node.Write(str);
+    // The keys follow the level and bounds as one big endian array
+    ASSERT_EQ(this->policy_.ToBytes(node.GetKey(0)), str.substr(4 + 64, 32));
+    ASSERT_EQ(this->policy_.ToBytes(node.GetKey(1)), str.substr(4 + 96, 32));
+    Node<256> read(0, 0, 16, 0, 1);
+    ASSERT_EQ(length, read.Read(str));
+    ASSERT_EQ(3UL, read.Level());
+    ASSERT_EQ(first, read.First());
+    ASSERT_EQ(last, read.Last());
+    ASSERT_TRUE(read.IsSane());
+    for (std::size_t i = 0; i < node.MaxKeys(); i++)
+    {
+        auto const kv = read.GetKeyValue(i);
+        ASSERT_EQ(node.GetKeyValue(i).key, kv.key);
+        ASSERT_EQ(node.GetKeyValue(i).offset, kv.offset);
+        ASSERT_EQ(node.GetKeyValue(i).length, kv.length);
+    }
+    ASSERT_EQ(4096UL, read.GetChild(5));
+    ASSERT_EQ(1UL, read.NonSyntheticKeyCount());
+}
+
+TYPED_TEST(NodeTest, SharedFirstWord)
+{
+    // Every key and the empty keys share a zero first word
+    auto first = this->policy_.MakeKey(1);
+    auto last = this->policy_.MakeKey(1 << 20);
+    Node<256> node(0, 0, 16, first, last);
+    for (std::size_t j = 10; j < node.MaxKeys(); j++)
+        node.SetKeyValue(j, KeyValue<256>{first + j * 1000, j, 1});
+    ASSERT_TRUE(node.IsSane());
+    ASSERT_EQ(10UL, node.EmptyKeyCount());
+    typename Node<256>::key_value_type kv;
+    std::size_t i;
+    for (std::size_t j = 10; j < node.MaxKeys(); j++)
+    {
+        auto const key = first + j * 1000;
+        ASSERT_TRUE(node.Find(key, &kv));
+        ASSERT_EQ(j, kv.offset);
+        ASSERT_FALSE(node.Find(key + 1, &kv, i));
+        ASSERT_EQ(node.Degree(), i);
+    }
+    node.Clear();
+    node.AddSyntheticKeyValues();
+    ASSERT_TRUE(node.IsSane());
+    ASSERT_EQ(0UL, node.EmptyKeyCount());
+    for (std::size_t j = 0; j < node.MaxKeys(); j++)
+    {
+        auto const key = node.GetKeyValue(j).key;
+        ASSERT_TRUE(node.Find(key, &kv));
+        ASSERT_FALSE(node.Find(key - 1, &kv, i));
+        ASSERT_EQ(j, i);
+        ASSERT_TRUE(node.FindChild(key + 1, i));
+        ASSERT_EQ(j + 1, i);
+    }
+}
+
+TYPED_TEST(NodeTest, PredictedSlot)
+{
+    // Keys packed at the end, or filling the node but far from their
+    // strides, are still found by galloping from the predicted slot
+    auto first = this->policy_.MakeKey(1);
+    auto last = this->policy_.Max();
+    for (std::size_t count : {20, 83})
+    {
+        Node<256> node(0, 0, 84, first, last);
+        auto keys = this->policy_.RandomKeys(count, count);
+        std::sort(keys.begin(), keys.end());
+        auto const empty = node.MaxKeys() - count;
+        for (std::size_t j = 0; j < count; j++)
+            node.SetKeyValue(empty + j, KeyValue<256>{keys[j], j, 1});
+        ASSERT_TRUE(node.IsSane());
+        typename Node<256>::key_value_type kv;
+        std::size_t i;
+        for (std::size_t j = 0; j < count; j++)
+        {
+            ASSERT_TRUE(node.Find(keys[j], &kv));
+            ASSERT_EQ(j, kv.offset);
+        }
+        for (auto const& key : this->policy_.RandomKeys(1000, 7))
+        {
+            ASSERT_FALSE(node.Find(key, &kv, i));
+            if (count < node.MaxKeys())
+                ASSERT_EQ(node.Degree(), i);
+            else
+                ASSERT_EQ(std::size_t(std::distance(
+                              keys.cbegin(), std::lower_bound(keys.cbegin(),
+                                                              keys.cend(),
+                                                              key))),
+                          i);
+        }
+    }
+}
+
+TYPED_TEST(NodeTest, FixedDegree)
+{
+    using fixed_type = Node<256, 4096>;
+    static_assert(fixed_type::FixedDegree == 77, "degree");
+    auto first = this->policy_.MakeKey(1);
+    auto last = this->policy_.Max();
+    ASSERT_THROW(fixed_type(0, 0, 84, first, last), std::invalid_argument);
+    fixed_type node(0, 2, 77, first, last);
+    Node<256> other(0, 2, 77, first, last);
+    ASSERT_EQ(76UL, node.MaxKeys());
+    ASSERT_EQ(76UL, node.EmptyKeyCount());
+    auto keys = this->policy_.RandomKeys(node.MaxKeys(), 12);
+    std::sort(keys.begin(), keys.end());
+    for (std::size_t j = 0; j < keys.size(); j++)
+        node.SetKeyValue(j, KeyValue<256>{keys[j], j, 1});
+    node.SetChild(3, 4096);
+    ASSERT_TRUE(node.IsSane());
+    // Laid out on disk as a node of the same degree known at run time
+    std::string str(4096, '\0');
+    auto const length = node.Write(str);
+    ASSERT_EQ(length, other.Read(str));
+    ASSERT_EQ(4096UL, other.GetChild(3));
+    typename Node<256>::key_value_type kv, otherKv;
+    std::size_t i, otherI;
+    for (auto const& key : keys)
+    {
+        ASSERT_TRUE(node.Find(key, &kv));
+        ASSERT_TRUE(other.Find(key, &otherKv));
+        ASSERT_EQ(otherKv, kv);
+    }
+    for (auto const& key : this->policy_.RandomKeys(1000, 13))
+    {
+        ASSERT_FALSE(node.Find(key, &kv, i));
+        ASSERT_FALSE(other.Find(key, &otherKv, otherI));
+        ASSERT_EQ(otherI, i);
+    }
+}
+
+TYPED_TEST(NodeTest, OutsideRange)
+{
+    // First words one apart, so a key far beyond last predicts a slot
+    // far beyond the node
+    auto first = this->policy_.FromHex("1" + std::string(48, '0'));
+    auto last = this->policy_.FromHex("2" + std::string(48, '0'));
+    Node<256> node(0, 0, 16, first, last);
+    node.AddSyntheticKeyValues();
+    ASSERT_TRUE(node.IsSane());
+    typename Node<256>::key_value_type kv;
+    std::size_t i;
+    for (auto const& key : {this->policy_.Max(), this->policy_.MakeKey(1),
+                            last, first})
+    {
+        ASSERT_FALSE(node.Find(key, &kv, i));
+        ASSERT_EQ(node.Degree(), i);
+        ASSERT_FALSE(node.FindChild(key, i));
+    }
+}
+
+TEST(NodeTest, PartialWord)
+{
+    // 160 bit keys fill two words and a third padded with zeros
+    using util = detail::KeyUtil<160>;
+    static_assert(Node<160>::Words == 3, "words");
+    auto const degree = Node<160>::CalculateDegree(4096);
+    Node<160> node(0, 1, degree, util::MakeKey(1), util::Max());
+    auto keys = util::RandomKeys(node.MaxKeys(), 14);
+    std::sort(keys.begin(), keys.end());
+    for (std::size_t j = 0; j < keys.size(); j++)
+        node.SetKeyValue(j, KeyValue<160>{keys[j], j, 1});
+    ASSERT_TRUE(node.IsSane());
+    std::string str(4096, '\0');
+    auto const length = node.Write(str);
+    ASSERT_EQ(util::ToBytes(keys[0]), str.substr(4 + 40, 20));
+    ASSERT_EQ(util::ToBytes(keys[1]), str.substr(4 + 60, 20));
+    Node<160> read(0, 0, degree, 0, 1);
+    ASSERT_EQ(length, read.Read(str));
+    ASSERT_TRUE(read.IsSane());
+    typename Node<160>::key_value_type kv;
+    std::size_t i;
+    for (std::size_t j = 0; j < keys.size(); j++)
+    {
+        ASSERT_EQ(keys[j], read.GetKey(j));
+        ASSERT_TRUE(read.Find(keys[j], &kv));
+        ASSERT_EQ(j, kv.offset);
+        ASSERT_FALSE(read.Find(keys[j] + 1, &kv, i));
+        ASSERT_EQ(j + 1, i);
+    }
+}
+
+// Lookups over 16k full nodes of 4096 byte blocks, each with its own copy
+// of the keys, with the degree known at run time and at compile time. A
+// benchmark rather than a test, so it only runs when asked for. Run with a
+// release build for meaningful numbers.
+TEST(NodeTest, DISABLED_FindSpeed)
+{
+    using util = detail::KeyUtil<256>;
+    auto const degree = Node<256>::CalculateDegree(4096);
+    Node<256> node(0, 0, degree, util::MakeKey(1), util::Max());
+    node.AddSyntheticKeyValues();
+    Node<256, 4096> fixed(0, 0, degree, util::MakeKey(1), util::Max());
+    fixed.AddSyntheticKeyValues();
+    // One in eight keys is found, the rest choose a child
+    auto keys = util::RandomKeys(1 << 16, 1);
+    for (std::size_t j = 0; j < keys.size(); j += 8)
+        keys[j] = node.GetKey(j % node.MaxKeys());
+    // About 70MB of nodes, which is more than the CPU caches hold
+    auto const runtime = TimeFind(node, 16384, keys);
+    std::cout << "Find (run time degree): " << runtime.first << " ns/key"
+              << std::endl;
+    auto const compiled = TimeFind(fixed, 16384, keys);
+    std::cout << "Find (compile time degree): " << compiled.first
+              << " ns/key" << std::endl;
+    ASSERT_EQ(runtime.second, compiled.second);
+}
@@ -0,0 +1,55 @@
+#include <thread>
+#include <vector>
+#include "tests/common.h"
+#include "db/stats.h"
+
+using namespace keyvadb;
+
+TEST(StatsTest, Histogram)
+{
+    // Every bucket's bounds must map back to that bucket
+    for (std::size_t i = 0; i < Histogram::Buckets; i++)
+    {
+        ASSERT_EQ(i, Histogram::Bucket(Histogram::LowerBound(i)));
+        ASSERT_EQ(i, Histogram::Bucket(Histogram::UpperBound(i)));
+    }
+    Histogram h;
+    ASSERT_EQ(0UL, h.Percentile(0.5));
+    for (std::uint64_t i = 1; i <= 1000; i++) h.Add(i);
+    ASSERT_EQ(1000UL, h.Count());
+    ASSERT_EQ(1000UL, h.Max());
+    ASSERT_DOUBLE_EQ(500.5, h.Mean());
+    // Within the relative error of a bucket
+    ASSERT_NEAR(500, h.Percentile(0.5), 500 / Histogram::SubBuckets);
+    ASSERT_NEAR(990, h.Percentile(0.99), 990 / Histogram::SubBuckets);
+    ASSERT_EQ(1000UL, h.Percentile(1.0));
+    Histogram other;
+    other.Add(5000);
+    h.Merge(other);
+    ASSERT_EQ(1001UL, h.Count());
+    ASSERT_EQ(5000UL, h.Percentile(1.0));
+}
+
+TEST(StatsTest, Recorder)
+{
+    StatsRecorder recorder;
+    const std::size_t perThread = 10000;
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t < 16; t++)
+        threads.emplace_back([&recorder, perThread]()
+                             {
+            for (std::size_t i = 0; i < perThread; i++)
+            {
+                recorder.Add(StatsRecorder::Gets);
+                recorder.Record(StatsRecorder::GetLatency, i);
+            }
+        });
+    for (auto& t : threads) t.join();
+    Stats stats;
+    recorder.Snapshot(stats);
+    ASSERT_EQ(16 * perThread, stats.gets);
+    ASSERT_EQ(0UL, stats.puts);
+    ASSERT_EQ(16 * perThread, stats.getLatency.Count());
+    ASSERT_EQ(perThread - 1, stats.getLatency.Max());
+    ASSERT_EQ(0UL, stats.putLatency.Count());
+}
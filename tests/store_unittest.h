@@ -1,5 +1,8 @@
+#include <cstdio>
+#include <cstring>
 #include <string>
 #include <tuple>
+#include <vector>
 #include "tests/common.h"
 #include "db/store.h"
 
@@ -10,23 +13,128 @@ TYPED_TEST(StoreTest, SetAndGetKeys)
     auto first = this->MakeKey(0);
     auto last = this->FromHex('F');
     auto root = this->keys_->New(0, first, last);
-    ASSERT_EQ(0UL, root->Id());
+    ASSERT_EQ(this->keys_->RootId(), root->Id());
     ASSERT_EQ(first, root->First());
     ASSERT_EQ(last, root->Last());
     root->AddSyntheticKeyValues();
     ASSERT_TRUE(root->IsSane());
     std::error_condition err;
     auto node = this->EmptyNode();
-    std::tie(node, err) = this->keys_->Get(root->Id());
+    std::tie(node, err) = this->keys_->Get(root->Id(), 0);
     ASSERT_EQ(db_error::key_not_found, err.value());
     ASSERT_EQ(nullptr, node);
     ASSERT_FALSE(this->keys_->Set(root));
-    std::tie(node, err) = this->keys_->Get(root->Id());
+    std::tie(node, err) = this->keys_->Get(root->Id(), 0);
     ASSERT_FALSE(err);
     ASSERT_EQ(root->Last(), node->Last());
     ASSERT_TRUE(node->IsSane());
 }
 
+TYPED_TEST(StoreTest, LevelBlockSizes)
+{
+    auto first = this->MakeKey(0);
+    auto last = this->FromHex('F');
+    auto keys = CreateKeyStore<TypeParam::Bits>("test.levels.keys",
+                                                 {16384, 4096});
+    ASSERT_FALSE(keys->Open());
+    ASSERT_FALSE(keys->Clear());
+    ASSERT_EQ(16384U, keys->BlockSize(0));
+    ASSERT_EQ(4096U, keys->BlockSize(1));
+    ASSERT_EQ(4096U, keys->BlockSize(5));
+    ASSERT_GT(keys->Degree(0), keys->Degree(1));
+    auto root = keys->New(0, first, last);
+    auto child = keys->New(1, first, last);
+    auto grandChild = keys->New(2, first, last);
+    ASSERT_EQ(keys->RootId() + 16384, child->Id());
+    ASSERT_EQ(child->Id() + 4096, grandChild->Id());
+    ASSERT_EQ(keys->Degree(0), root->Degree());
+    for (auto const& node : {root, child, grandChild})
+    {
+        node->AddSyntheticKeyValues();
+        ASSERT_FALSE(keys->Set(node));
+    }
+    ASSERT_FALSE(keys->Close());
+
+    // An existing file keeps the block sizes it was created with
+    auto reopened =
+        CreateKeyStore<TypeParam::Bits>("test.levels.keys", 4096);
+    ASSERT_FALSE(reopened->Open());
+    ASSERT_EQ(16384U, reopened->BlockSize(0));
+    ASSERT_EQ(grandChild->Id() + 4096, reopened->Size());
+    std::error_condition err;
+    auto node = this->EmptyNode();
+    std::tie(node, err) = reopened->Get(root->Id(), 0);
+    ASSERT_FALSE(err);
+    ASSERT_EQ(root->Degree(), node->Degree());
+    ASSERT_TRUE(node->IsSane());
+    std::tie(node, err) = reopened->Get(grandChild->Id(), 2);
+    ASSERT_FALSE(err);
+    ASSERT_TRUE(node->IsSane());
+    ASSERT_FALSE(reopened->Close());
+
+    // Block sizes too small for a node are rejected
+    ASSERT_THROW(CreateKeyStore<TypeParam::Bits>("test.levels.keys", 16),
+                 std::invalid_argument);
+}
+
+TYPED_TEST(StoreTest, Header)
+{
+    auto first = this->MakeKey(0);
+    auto last = this->FromHex('F');
+    std::remove("test.header.keys");
+    auto keys = CreateKeyStore<TypeParam::Bits>("test.header.keys", 4096);
+    ASSERT_FALSE(keys->Open());
+    ASSERT_FALSE(keys->Clear());
+    ASSERT_EQ(0U, keys->FlushSequence());
+    ASSERT_EQ(keys->RootId(), keys->CommittedSize());
+    auto root = keys->New(0, first, last);
+    root->AddSyntheticKeyValues();
+    ASSERT_FALSE(keys->Set(root));
+    ASSERT_FALSE(keys->Commit(1234));
+    ASSERT_FALSE(keys->Close());
+
+    keys = CreateKeyStore<TypeParam::Bits>("test.header.keys", 4096);
+    ASSERT_FALSE(keys->Open());
+    ASSERT_EQ(1U, keys->FlushSequence());
+    ASSERT_EQ(root->Id() + 4096, keys->CommittedSize());
+    ASSERT_EQ(1234U, keys->CommittedValuesSize());
+    ASSERT_FALSE(keys->Close());
+
+    auto flip = [](std::uint64_t const pos)
+    {
+        PosixRandomAccessFile file("test.header.keys");
+        ASSERT_FALSE(file.Open());
+        std::string str(1, '\0');
+        std::size_t n;
+        std::error_condition err;
+        std::tie(n, err) = file.ReadAt(pos, str);
+        ASSERT_FALSE(err);
+        str[0] ^= 1;
+        std::tie(n, err) = file.WriteAt(str, pos);
+        ASSERT_FALSE(err);
+        ASSERT_FALSE(file.Close());
+    };
+    // A torn write of the newer copy falls back to the older one
+    flip(4096 + 100);
+    ASSERT_FALSE(keys->Open());
+    ASSERT_EQ(0U, keys->FlushSequence());
+    ASSERT_EQ(keys->RootId(), keys->CommittedSize());
+    ASSERT_FALSE(keys->Close());
+    // Which the next commit overwrites
+    ASSERT_FALSE(keys->Open());
+    ASSERT_FALSE(keys->Commit(1234));
+    ASSERT_FALSE(keys->Close());
+    ASSERT_FALSE(keys->Open());
+    ASSERT_EQ(1U, keys->FlushSequence());
+    ASSERT_FALSE(keys->Close());
+    // Both copies bad
+    flip(100);
+    flip(4096 + 100);
+    ASSERT_EQ(db_error::bad_header, keys->Open());
+    ASSERT_FALSE(keys->Close());
+    std::remove("test.header.keys");
+}
+
 // TYPED_TEST(StoreTest, SetAndGetValues)
 // {
 //     auto key1 = this->FromHex('1');
@@ -44,6 +152,39 @@ TYPED_TEST(StoreTest, SetAndGetKeys)
 //     ASSERT_EQ(value2, got2);
 // }
 
+TYPED_TEST(StoreTest, EachAcrossReads)
+{
+    // Each reads 64KB at a time. The first record ends two bytes short of
+    // that, so the second's length straddles the end of the first read.
+    auto const keys = this->RandomKeys(3, 15);
+    std::vector<std::string> values{std::string(65534 - 40, 'a'),
+                                    std::string(100, 'b'),
+                                    std::string(70000, 'c')};
+    std::vector<std::uint8_t> buf;
+    for (std::size_t i = 0; i < keys.size(); i++)
+    {
+        auto const record = std::string(8, '\0') + this->ToBytes(keys[i]) +
+                            values[i];
+        std::uint32_t const length = record.size();
+        auto const crc = detail::Crc32c::Value(&record[8], length - 8);
+        auto const pos = buf.size();
+        buf.insert(buf.end(), record.begin(), record.end());
+        std::memcpy(&buf[pos], &length, sizeof(length));
+        std::memcpy(&buf[pos + 4], &crc, sizeof(crc));
+    }
+    ASSERT_EQ(65534U, 40 + values[0].size());
+    ASSERT_FALSE(this->values_->Append(buf));
+    std::size_t i = 0;
+    ASSERT_TRUE(NoError(this->values_->Each([&](Slice key, Slice value)
+                                            {
+        ASSERT_LT(i, keys.size());
+        ASSERT_EQ(this->ToBytes(keys[i]), key.to_string());
+        ASSERT_EQ(values[i], value.to_string());
+        i++;
+    })));
+    ASSERT_EQ(keys.size(), i);
+}
+
 TYPED_TEST(StoreTest, Cache)
 {
     this->cache_.SetMaxSize(2);
@@ -71,7 +212,7 @@ TYPED_TEST(StoreTest, Cache)
     ASSERT_EQ(this->cache_.GetById(secondChild->Id()), secondChild);
     // root now evicted
     ASSERT_FALSE(this->cache_.Get(first + 1));
-    ASSERT_FALSE(this->cache_.GetById(0));
+    ASSERT_FALSE(this->cache_.GetById(root->Id()));
 
     this->cache_.Add(firstChild);
     this->cache_.Add(firstChild);
@@ -0,0 +1,76 @@
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include "tests/common.h"
+#include "db/trace.h"
+
+using namespace keyvadb;
+
+TEST(TraceTest, FlushReport)
+{
+    FlushReport report;
+    ASSERT_TRUE(report.Empty());
+    {
+        ScopedTimer timer(report, "First");
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    {
+        ScopedTimer timer(report, "Second");
+    }
+    {
+        ScopedTimer timer(report, "First");
+    }
+    ASSERT_EQ(3UL, report.phases.size());
+    ASSERT_GE(report.Elapsed("First"), std::chrono::milliseconds(1));
+    ASSERT_LE(report.Elapsed("First") + report.Elapsed("Second"),
+              report.Elapsed());
+    ASSERT_EQ(0, report.Elapsed("Missing").count());
+    report.levels[0] = 1;
+    report.levels[3] = 4;
+    ASSERT_EQ(5UL, report.Nodes());
+    ASSERT_FALSE(report.Empty());
+
+    std::remove("test.trace.json");
+    for (std::size_t i = 0; i < 2; i++)
+    {
+        TraceWriter writer("test.trace.json");
+        ASSERT_TRUE(static_cast<bool>(writer));
+        writer.Write(report);
+    }
+    std::ifstream in("test.trace.json");
+    std::stringstream ss;
+    ss << in.rdbuf();
+    auto trace = ss.str();
+    ASSERT_EQ('[', trace.front());
+    ASSERT_EQ(1, std::count(trace.begin(), trace.end(), '['));
+    // Four events per write, each with an args object
+    ASSERT_EQ(2 * 4 * 2, std::count(trace.begin(), trace.end(), '{'));
+    ASSERT_NE(std::string::npos, trace.find("\"name\":\"Flush\""));
+    ASSERT_NE(std::string::npos, trace.find("\"level_3\":4"));
+    ASSERT_NE(std::string::npos, trace.find("\"name\":\"Second\""));
+}
+
+TYPED_TEST(StoreTest, JournalReport)
+{
+    auto tree = this->GetTree();
+    ASSERT_FALSE(tree->Init(false));
+    const std::size_t n = 1000;
+    for (auto const& kv : this->RandomKeyValues(n, 0))
+        this->buffer_.Add(kv.first, kv.second);
+    auto journal = this->GetJournal();
+    ASSERT_FALSE(journal->Process(*tree));
+    ASSERT_FALSE(journal->Commit(*tree, 4096));
+    auto const& report = journal->Report();
+    ASSERT_EQ(n, report.keys);
+    ASSERT_EQ(n * (this->Bytes * 2 + 2 * sizeof(std::uint32_t)),
+              report.valueBytes);
+    ASSERT_LT(1UL, report.levels.size());
+    ASSERT_EQ(1UL, report.levels.at(0));
+    ASSERT_EQ(report.Nodes() * 4096, report.nodeBytes);
+    // Insertions are net of keys evicted to a lower level
+    ASSERT_EQ(n, report.insertions + report.evictions);
+    for (auto const& phase : {"Journal::process", "Buffer::Write",
+                              "ValueStore::Append", "KeyStore::Set",
+                              "Buffer::Purge"})
+        ASSERT_LT(0, report.Elapsed(phase).count()) << phase;
+}
@@ -37,3 +37,52 @@ TYPED_TEST(StoreTest, TreeOperations)
     }
     // std::cout << this->cache_;
 }
+
+TYPED_TEST(StoreTest, TreeOverwriteAndDelete)
+{
+    auto tree = this->GetTree();
+    ASSERT_FALSE(tree->Init(false));
+    const std::size_t n = 500;
+    auto input = this->RandomKeyValues(n, 0);
+    for (auto const& kv : input) this->buffer_.Add(kv.first, kv.second);
+    auto journal = this->GetJournal();
+    ASSERT_FALSE(journal->Process(*tree));
+    ASSERT_FALSE(journal->Commit(*tree, 4096));
+    this->checkTree(tree);
+    this->checkCount(tree, n);
+    ASSERT_EQ(0UL, journal->FreedBytes());
+
+    // Overwrite every key with a longer value and delete every other key
+    for (std::size_t i = 0; i < n; i++)
+    {
+        if (i % 2 == 0)
+            this->buffer_.Delete(input[i].first);
+        else
+            this->buffer_.Add(input[i].first, input[i].second + "updated");
+    }
+    journal = this->GetJournal();
+    ASSERT_FALSE(journal->Process(*tree));
+    ASSERT_FALSE(journal->Commit(*tree, 4096));
+    ASSERT_EQ(0UL, this->buffer_.Size());
+    this->checkTree(tree);
+    this->checkCount(tree, n / 2);
+    ASSERT_EQ(n * (this->Bytes * 2 + 2 * sizeof(std::uint32_t)),
+              journal->FreedBytes());
+    // Nothing is cached, so every existing child was read ahead
+    ASSERT_LT(0UL, journal->Report().prefetches);
+    for (std::size_t i = 0; i < n; i++)
+    {
+        typename TestFixture::key_value_type got;
+        std::error_condition err;
+        std::tie(got, err) = tree->Get(this->FromBytes(input[i].first));
+        if (i % 2 == 0)
+        {
+            ASSERT_EQ(db_error::key_not_found, err);
+            continue;
+        }
+        ASSERT_FALSE(err);
+        std::string value;
+        ASSERT_FALSE(this->values_->Get(got.offset, got.length, &value));
+        ASSERT_EQ(input[i].second + "updated", value);
+    }
+}
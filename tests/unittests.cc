@@ -1,10 +1,19 @@
 #include "gtest/gtest.h"
 #include "tests/key_unittest.h"
+#include "tests/arena_unittest.h"
+#include "tests/crc32c_unittest.h"
+#include "tests/env_unittest.h"
+#include "tests/async_unittest.h"
 #include "tests/node_unittest.h"
 #include "tests/buffer_unittest.h"
+#include "tests/filter_unittest.h"
 #include "tests/tree_unittest.h"
 #include "tests/store_unittest.h"
 #include "tests/error_unittest.h"
+#include "tests/stats_unittest.h"
+#include "tests/trace_unittest.h"
+#include "tests/value_cache_unittest.h"
+#include "tests/warmup_unittest.h"
 #include "tests/db_unittest.h"
 
 GTEST_API_ int main(int argc, char **argv)
@@ -0,0 +1,56 @@
+#include <memory>
+#include <string>
+#include "tests/common.h"
+#include "db/value_cache.h"
+
+using namespace keyvadb;
+
+TEST(ValueCacheTest, General)
+{
+    ValueCache cache;
+    ASSERT_FALSE(cache.Enabled());
+    ASSERT_FALSE(cache.Get(0));
+    // Room for about 4 values of 100 bytes per shard
+    cache.SetMaxBytes(16 * 4 * 200);
+    ASSERT_TRUE(cache.Enabled());
+    ASSERT_FALSE(cache.Get(0));
+    auto value = std::make_shared<std::string const>(100, 'a');
+    cache.Add(0, value);
+    auto got = cache.Get(0);
+    ASSERT_EQ(value, got);
+    ASSERT_EQ(1UL, cache.Hits());
+    ASSERT_EQ(1UL, cache.Misses());
+    ASSERT_LT(0UL, cache.Bytes());
+    // Too big to ever be cached
+    cache.Add(1, std::make_shared<std::string const>(16 * 4 * 200, 'b'));
+    ASSERT_FALSE(cache.Get(1));
+    cache.Clear();
+    ASSERT_EQ(0UL, cache.Bytes());
+    ASSERT_FALSE(cache.Get(0));
+    // Still valid after being dropped from the cache
+    ASSERT_EQ(std::string(100, 'a'), *got);
+}
+
+TEST(ValueCacheTest, Admission)
+{
+    ValueCache cache;
+    cache.SetMaxBytes(16 * 4 * 200);
+    auto value = std::make_shared<std::string const>(100, 'a');
+    // A few hot offsets, each asked for many times
+    const std::uint64_t hot = 32;
+    for (std::size_t i = 0; i < 10; i++)
+        for (std::uint64_t offset = 0; offset < hot; offset++)
+            if (!cache.Get(offset))
+                cache.Add(offset, value);
+    // A scan of cold offsets, each asked for once
+    for (std::uint64_t offset = hot; offset < 10000; offset++)
+        if (!cache.Get(offset))
+            cache.Add(offset, value);
+    ASSERT_LT(0UL, cache.Rejections());
+    std::size_t hits = 0;
+    for (std::uint64_t offset = 0; offset < hot; offset++)
+        if (cache.Get(offset))
+            hits++;
+    // With plain LRU the scan would have evicted all of them
+    ASSERT_LT(hot / 2, hits);
+}
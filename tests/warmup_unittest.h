@@ -0,0 +1,48 @@
+#include <cstdio>
+#include "tests/common.h"
+#include "db/warmup.h"
+
+using namespace keyvadb;
+
+TEST(CacheSnapshotTest, SaveLoadAndPlan)
+{
+    std::remove("test.cache");
+    PosixRandomAccessFile file("test.cache");
+    ASSERT_FALSE(file.Open());
+    CacheSnapshot snapshot;
+    bool loaded;
+    std::error_condition err;
+    // Nothing saved yet
+    std::tie(loaded, err) = snapshot.Load(file, 100);
+    ASSERT_FALSE(err);
+    ASSERT_FALSE(loaded);
+    // Least recently used first
+    snapshot.entries = {{300, 2}, {100, 1}, {200, 2}, {0, 0}, {400, 2}};
+    ASSERT_FALSE(snapshot.Save(file, 100));
+    CacheSnapshot other;
+    // A different keys file length means the nodes may have changed
+    std::tie(loaded, err) = other.Load(file, 101);
+    ASSERT_FALSE(err);
+    ASSERT_FALSE(loaded);
+    ASSERT_TRUE(other.entries.empty());
+    std::tie(loaded, err) = other.Load(file, 100);
+    ASSERT_FALSE(err);
+    ASSERT_TRUE(loaded);
+    ASSERT_EQ(5UL, other.entries.size());
+    ASSERT_EQ(400UL, other.entries[4].id);
+    ASSERT_EQ(2U, other.entries[4].level);
+    // Upper levels first, then the most recently used, in id order
+    auto plan = other.Plan(4);
+    ASSERT_EQ(4UL, plan.size());
+    ASSERT_EQ(0UL, plan[0].id);
+    ASSERT_EQ(100UL, plan[1].id);
+    ASSERT_EQ(200UL, plan[2].id);
+    ASSERT_EQ(400UL, plan[3].id);
+    // A corrupt snapshot is ignored
+    ASSERT_EQ(1UL, file.WriteAt("x", 30).first);
+    std::tie(loaded, err) = other.Load(file, 100);
+    ASSERT_FALSE(err);
+    ASSERT_FALSE(loaded);
+    ASSERT_FALSE(file.Close());
+    std::remove("test.cache");
+}
@@ -0,0 +1,535 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include "db/db.h"
+#include "db/partitioned.h"
+
+using namespace keyvadb;
+using namespace std::chrono;
+
+// A db_bench style harness. Runs a comma separated list of workloads in
+// order against the same database and reports throughput and latency
+// percentiles as text and, optionally, JSON.
+//
+// keyvadb_bench --benchmarks=fillrandom,readrandom --num=1000000 --threads=4
+
+namespace
+{
+struct Flags
+{
+    std::string benchmarks =
+        "fillseq,fillrandom,readrandom,readhot,readmissing,readwhilewriting,"
+        "scan";
+    std::string db = "bench";
+    std::string json;
+    std::uint64_t num = 100000;
+    std::uint64_t reads = 0;
+    std::uint32_t threads = 1;
+    std::uint32_t valueSize = 100;
+    std::uint32_t valueSizeMax = 0;
+    std::string valueDistribution = "fixed";
+    double hotFraction = 0.01;
+    std::uint32_t readPercent = 90;
+    std::uint32_t seed = 0;
+    bool useExisting = false;
+    Options options;
+};
+
+struct Result
+{
+    std::string name;
+    std::uint64_t ops = 0;
+    std::uint64_t bytes = 0;
+    std::uint64_t found = 0;
+    double seconds = 0;
+    std::vector<std::uint64_t> latencies;
+
+    double Percentile(double const p) const
+    {
+        if (latencies.empty())
+            return 0;
+        auto i = static_cast<std::size_t>(std::ceil(p * latencies.size()));
+        return latencies.at(std::min(i, latencies.size()) - 1) / 1000.0;
+    }
+
+    double OpsPerSecond() const { return seconds > 0 ? ops / seconds : 0; }
+    double MBPerSecond() const
+    {
+        return seconds > 0 ? bytes / (1024.0 * 1024.0) / seconds : 0;
+    }
+};
+
+// Per thread samples, merged once all threads have joined.
+struct ThreadState
+{
+    std::mt19937_64 rng;
+    std::vector<std::uint64_t> latencies;
+    std::uint64_t bytes = 0;
+    std::uint64_t found = 0;
+};
+
+class Benchmark
+{
+    using db_type = PartitionedDB<256>;
+    using db_ptr = std::unique_ptr<db_type>;
+
+    enum
+    {
+        key_length = 32
+    };
+
+    Flags const& flags_;
+    db_ptr db_;
+    std::string values_;
+    std::vector<std::string> sorted_;
+    std::vector<Result> results_;
+
+   public:
+    explicit Benchmark(Flags const& flags) : flags_(flags)
+    {
+        // Values are slices of a random buffer
+        std::mt19937_64 rng(flags_.seed);
+        values_.resize(std::max(flags_.valueSize, flags_.valueSizeMax) * 2 +
+                       1024 * 1024);
+        for (auto& c : values_) c = static_cast<char>(rng());
+    }
+
+    int Run()
+    {
+        if (auto err = open(!flags_.useExisting))
+        {
+            std::cerr << "Open: " << err.message() << std::endl;
+            return 1;
+        }
+        std::stringstream names(flags_.benchmarks);
+        std::string name;
+        while (std::getline(names, name, ','))
+        {
+            if (name.empty())
+                continue;
+            Result result;
+            result.name = name;
+            if (name == "fillseq")
+            {
+                sortKeys();
+                run(result, flags_.num, &Benchmark::fillSeq);
+            }
+            else if (name == "fillrandom")
+                run(result, flags_.num, &Benchmark::fillRandom);
+            else if (name == "overwrite")
+                run(result, flags_.num, &Benchmark::overwrite);
+            else if (name == "readrandom")
+                run(result, reads(), &Benchmark::readRandom);
+            else if (name == "readhot")
+                run(result, reads(), &Benchmark::readHot);
+            else if (name == "readmissing")
+                run(result, reads(), &Benchmark::readMissing);
+            else if (name == "readwhilewriting")
+                run(result, reads(), &Benchmark::readWhileWriting);
+            else if (name == "scan")
+                scan(result);
+            else
+            {
+                std::cerr << "Unknown benchmark: " << name << std::endl;
+                return 1;
+            }
+            report(result);
+            results_.push_back(std::move(result));
+            // Make sure everything written is on disk before the next
+            // workload starts
+            if (name.compare(0, 4, "fill") == 0 || name == "overwrite" ||
+                name == "readwhilewriting")
+                if (auto err = open(false))
+                {
+                    std::cerr << "Reopen: " << err.message() << std::endl;
+                    return 1;
+                }
+        }
+        if (!flags_.json.empty())
+            writeJSON();
+        return 0;
+    }
+
+   private:
+    using op_func = void (Benchmark::*)(ThreadState&, std::uint64_t);
+
+    std::uint64_t reads() const
+    {
+        return flags_.reads > 0 ? flags_.reads : flags_.num;
+    }
+
+    std::error_condition open(bool const clear)
+    {
+        // Closing the database flushes the buffer
+        db_.reset();
+        db_ = std::make_unique<db_type>(flags_.options);
+        if (auto err = db_->Open())
+            return err;
+        if (clear)
+            return db_->Clear();
+        return std::error_condition();
+    }
+
+    // Keys are a deterministic hash of their index, so that reads can find
+    // keys written by an earlier run or workload.
+    static std::string key(std::uint64_t const index, std::uint64_t const salt)
+    {
+        std::string k(key_length, '\0');
+        std::uint64_t x = index ^ salt;
+        for (std::size_t i = 0; i < key_length; i += sizeof(x))
+        {
+            // splitmix64
+            std::uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            z ^= z >> 31;
+            std::memcpy(&k[i], &z, sizeof(z));
+        }
+        return k;
+    }
+
+    // fillseq writes the same keys as fillrandom, in ascending order
+    void sortKeys()
+    {
+        if (sorted_.size() == flags_.num)
+            return;
+        sorted_.clear();
+        for (std::uint64_t i = 0; i < flags_.num; i++)
+            sorted_.push_back(key(i, flags_.seed));
+        std::sort(sorted_.begin(), sorted_.end());
+    }
+
+    // Points into values_, so a put doesn't build a string
+    Slice value(ThreadState& state) const
+    {
+        std::uint32_t length = flags_.valueSize;
+        if (flags_.valueSizeMax > flags_.valueSize)
+        {
+            if (flags_.valueDistribution == "uniform")
+                length = std::uniform_int_distribution<std::uint32_t>(
+                    flags_.valueSize, flags_.valueSizeMax)(state.rng);
+            else if (flags_.valueDistribution == "exponential")
+            {
+                // Mean is valueSize, clamped to valueSizeMax
+                std::exponential_distribution<double> dist(1.0 /
+                                                           flags_.valueSize);
+                length = std::min<std::uint32_t>(
+                    flags_.valueSizeMax,
+                    std::max<std::uint32_t>(1, dist(state.rng)));
+            }
+        }
+        auto start = state.rng() % (values_.size() - length);
+        return Slice(values_).substr(start, length);
+    }
+
+    void put(ThreadState& state, std::string const& k)
+    {
+        auto v = value(state);
+        if (auto err = db_->Put(k, v))
+            throw std::runtime_error("Put: " + err.message());
+        state.bytes += k.size() + v.size();
+    }
+
+    void get(ThreadState& state, std::string const& k)
+    {
+        std::string v;
+        auto err = db_->Get(k, &v);
+        if (err && err != db_error::key_not_found)
+            throw std::runtime_error("Get: " + err.message());
+        if (!err)
+        {
+            state.found++;
+            state.bytes += k.size() + v.size();
+        }
+    }
+
+    void fillSeq(ThreadState& state, std::uint64_t const i)
+    {
+        put(state, sorted_.at(i));
+    }
+
+    void fillRandom(ThreadState& state, std::uint64_t const i)
+    {
+        // Keys are hashes, so index order is random key order
+        put(state, key(i, flags_.seed));
+    }
+
+    void overwrite(ThreadState& state, std::uint64_t const)
+    {
+        put(state, key(state.rng() % flags_.num, flags_.seed));
+    }
+
+    void readRandom(ThreadState& state, std::uint64_t const)
+    {
+        get(state, key(state.rng() % flags_.num, flags_.seed));
+    }
+
+    void readHot(ThreadState& state, std::uint64_t const)
+    {
+        auto hot = std::max<std::uint64_t>(1, flags_.num * flags_.hotFraction);
+        get(state, key(state.rng() % hot, flags_.seed));
+    }
+
+    void readMissing(ThreadState& state, std::uint64_t const)
+    {
+        get(state, key(state.rng() % flags_.num, ~std::uint64_t(flags_.seed)));
+    }
+
+    void readWhileWriting(ThreadState& state, std::uint64_t const i)
+    {
+        if (state.rng() % 100 < flags_.readPercent)
+            readRandom(state, i);
+        else
+            overwrite(state, i);
+    }
+
+    void run(Result& result, std::uint64_t const ops, op_func op)
+    {
+        std::vector<ThreadState> states(flags_.threads);
+        std::vector<std::thread> threads;
+        auto const perThread = ops / flags_.threads;
+        auto start = steady_clock::now();
+        for (std::uint32_t t = 0; t < flags_.threads; t++)
+        {
+            threads.emplace_back([&, t]()
+                                 {
+                auto& state = states[t];
+                state.rng.seed(flags_.seed + t + 1);
+                state.latencies.reserve(perThread);
+                auto const first = perThread * t;
+                auto const last =
+                    t + 1 == flags_.threads ? ops : first + perThread;
+                for (auto i = first; i < last; i++)
+                {
+                    auto opStart = steady_clock::now();
+                    (this->*op)(state, i);
+                    state.latencies.push_back(
+                        duration_cast<nanoseconds>(steady_clock::now() -
+                                                   opStart).count());
+                }
+            });
+        }
+        for (auto& t : threads) t.join();
+        result.seconds =
+            duration_cast<duration<double>>(steady_clock::now() - start)
+                .count();
+        merge(result, states);
+    }
+
+    void scan(Result& result)
+    {
+        ThreadState state;
+        auto start = steady_clock::now();
+        auto last = start;
+        auto err =
+            db_->Each([&](Slice k, Slice v)
+                      {
+                          auto now = steady_clock::now();
+                          state.latencies.push_back(
+                              duration_cast<nanoseconds>(now - last).count());
+                          last = now;
+                          state.bytes += k.size() + v.size();
+                          state.found++;
+                      });
+        if (err)
+            throw std::runtime_error("Each: " + err.message());
+        result.seconds =
+            duration_cast<duration<double>>(steady_clock::now() - start)
+                .count();
+        std::vector<ThreadState> states;
+        states.push_back(std::move(state));
+        merge(result, states);
+    }
+
+    static void merge(Result& result, std::vector<ThreadState>& states)
+    {
+        for (auto& state : states)
+        {
+            result.latencies.insert(result.latencies.end(),
+                                    state.latencies.begin(),
+                                    state.latencies.end());
+            result.bytes += state.bytes;
+            result.found += state.found;
+        }
+        result.ops = result.latencies.size();
+        std::sort(result.latencies.begin(), result.latencies.end());
+    }
+
+    void report(Result const& result) const
+    {
+        std::cout << std::left << std::setw(18) << result.name << ": "
+                  << std::right << std::fixed << std::setprecision(3)
+                  << std::setw(10)
+                  << (result.ops > 0 ? result.seconds * 1e6 / result.ops : 0)
+                  << " micros/op " << std::setw(10)
+                  << static_cast<std::uint64_t>(result.OpsPerSecond())
+                  << " ops/sec " << std::setw(8) << std::setprecision(1)
+                  << result.MBPerSecond() << " MB/s" << std::setprecision(3)
+                  << " p50: " << result.Percentile(0.5)
+                  << " p99: " << result.Percentile(0.99)
+                  << " p999: " << result.Percentile(0.999) << " micros";
+        if (result.name.compare(0, 4, "read") == 0)
+            std::cout << " (" << result.found << " of " << result.ops
+                      << " found)";
+        std::cout << std::endl;
+    }
+
+    void writeJSON() const
+    {
+        std::ofstream out(flags_.json);
+        out << std::fixed << std::setprecision(3);
+        out << "{\n  \"config\": {\"num\": " << flags_.num
+            << ", \"threads\": " << flags_.threads
+            << ", \"value_size\": " << flags_.valueSize
+            << ", \"value_size_max\": " << flags_.valueSizeMax
+            << ", \"value_distribution\": \"" << flags_.valueDistribution
+            << "\", \"block_size\": " << flags_.options.blockSize
+            << ", \"cache_size\": " << flags_.options.cacheSize
+            << ", \"value_cache_size\": " << flags_.options.valueCacheSize
+            << ", \"write_buffer_size\": " << flags_.options.writeBufferSize
+            << ", \"flush_interval\": " << flags_.options.flushInterval
+            << ", \"partition_bits\": " << flags_.options.partitionBits
+            << ", \"direct_io\": "
+            << (flags_.options.directIO ? "true" : "false")
+            << ", \"mmap_values\": "
+            << (flags_.options.mmapValues ? "true" : "false")
+            << "},\n  \"benchmarks\": [";
+        for (std::size_t i = 0; i < results_.size(); i++)
+        {
+            auto const& r = results_[i];
+            out << (i > 0 ? "," : "") << "\n    {\"name\": \"" << r.name
+                << "\", \"ops\": " << r.ops << ", \"found\": " << r.found
+                << ", \"seconds\": " << r.seconds
+                << ", \"ops_per_sec\": " << r.OpsPerSecond()
+                << ", \"mb_per_sec\": " << r.MBPerSecond()
+                << ", \"p50_us\": " << r.Percentile(0.5)
+                << ", \"p99_us\": " << r.Percentile(0.99)
+                << ", \"p999_us\": " << r.Percentile(0.999)
+                << ", \"max_us\": " << r.Percentile(1.0) << "}";
+        }
+        out << "\n  ]\n}" << std::endl;
+    }
+};
+
+void usage()
+{
+    Flags defaults;
+    std::cerr
+        << "Usage: keyvadb_bench [--flag=value]...\n"
+           "  --benchmarks=LIST     comma separated, default: "
+        << defaults.benchmarks
+        << "\n"
+           "                        also: overwrite\n"
+           "  --num=N               number of keys\n"
+           "  --reads=N             number of reads, default --num\n"
+           "  --threads=N           threads per workload\n"
+           "  --value_size=N        value size, or mean for exponential\n"
+           "  --value_size_max=N    maximum value size\n"
+           "  --value_distribution= fixed, uniform or exponential\n"
+           "  --hot_fraction=F      fraction of keys read by readhot\n"
+           "  --read_percent=N      reads in readwhilewriting\n"
+           "  --seed=N              key and value seed\n"
+           "  --db=PREFIX           prefix of the keys and values files\n"
+           "  --use_existing_db=0|1 don't clear the database first\n"
+           "  --json=FILE           also write results as JSON\n"
+           "  --block_size=N --cache_size=N --write_buffer_size=N\n"
+           "  --value_cache_size=N --flush_interval=N --filter_bits_per_key=N\n"
+           "  --partition_bits=N --direct_io=0|1 --mmap_values=0|1\n"
+           "                        Options overrides\n"
+           "  --trace_file=FILE     write flushes as Chrome trace events"
+        << std::endl;
+}
+
+bool parse(int argc, char* argv[], Flags& flags)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg(argv[i]);
+        auto eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos)
+            return false;
+        auto name = arg.substr(2, eq - 2);
+        auto value = arg.substr(eq + 1);
+        if (name == "benchmarks")
+            flags.benchmarks = value;
+        else if (name == "db")
+            flags.db = value;
+        else if (name == "json")
+            flags.json = value;
+        else if (name == "num")
+            flags.num = std::stoull(value);
+        else if (name == "reads")
+            flags.reads = std::stoull(value);
+        else if (name == "threads")
+            flags.threads = std::max(1UL, std::stoul(value));
+        else if (name == "value_size")
+            flags.valueSize = std::max(1UL, std::stoul(value));
+        else if (name == "value_size_max")
+            flags.valueSizeMax = std::stoul(value);
+        else if (name == "value_distribution")
+            flags.valueDistribution = value;
+        else if (name == "hot_fraction")
+            flags.hotFraction = std::stod(value);
+        else if (name == "read_percent")
+            flags.readPercent = std::stoul(value);
+        else if (name == "seed")
+            flags.seed = std::stoul(value);
+        else if (name == "use_existing_db")
+            flags.useExisting = value == "1";
+        else if (name == "block_size")
+            flags.options.blockSize = std::stoul(value);
+        else if (name == "cache_size")
+            flags.options.cacheSize = std::stoull(value);
+        else if (name == "value_cache_size")
+            flags.options.valueCacheSize = std::stoull(value);
+        else if (name == "write_buffer_size")
+            flags.options.writeBufferSize = std::stoull(value);
+        else if (name == "flush_interval")
+            flags.options.flushInterval = std::stoul(value);
+        else if (name == "filter_bits_per_key")
+            flags.options.filterBitsPerKey = std::stoul(value);
+        else if (name == "partition_bits")
+            flags.options.partitionBits = std::stoul(value);
+        else if (name == "direct_io")
+            flags.options.directIO = value == "1";
+        else if (name == "mmap_values")
+            flags.options.mmapValues = value == "1";
+        else if (name == "trace_file")
+            flags.options.traceFileName = value;
+        else
+            return false;
+    }
+    flags.options.keyFileName = flags.db + ".keys";
+    flags.options.valueFileName = flags.db + ".values";
+    flags.options.filterFileName = flags.db + ".filter";
+    flags.options.cacheFileName = flags.db + ".cache";
+    return flags.num > 0;
+}
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+    Flags flags;
+    if (!parse(argc, argv, flags))
+    {
+        usage();
+        return 1;
+    }
+    try
+    {
+        return Benchmark(flags).Run();
+    }
+    catch (std::exception const& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -5,6 +5,7 @@
 #include <string>
 #include <csignal>
 #include <chrono>
+#include <future>
 #include "db/db.h"
 
 using boost::algorithm::unhex;
@@ -12,13 +13,75 @@ using boost::algorithm::hex;
 using namespace keyvadb;
 using namespace std::chrono;
 
+// Checks the checksum of every node and value, scanning the keys and
+// values files in parallel.
+int verify(std::string const& keyFileName, std::string const& valueFileName)
+{
+    auto keys = CreateKeyStore<256>(keyFileName, 4096);
+    auto values = CreateValueStore<256>(valueFileName);
+    if (auto err = keys->Open())
+    {
+        std::cerr << keyFileName << ": " << err.message() << std::endl;
+        return 1;
+    }
+    if (auto err = values->Open())
+    {
+        std::cerr << valueFileName << ": " << err.message() << std::endl;
+        return 1;
+    }
+    NodeCache<256> cache;
+    Tree<256> tree(*keys, cache);
+    std::uint64_t nodes = 0, records = 0;
+    auto start = high_resolution_clock::now();
+    auto keysResult = std::async(std::launch::async, [&]
+                                 {
+                                     return tree.Verify(
+                                         [&](std::shared_ptr<Node<256>> const&,
+                                             std::uint32_t)
+                                         {
+                                             nodes++;
+                                             return std::error_condition();
+                                         });
+                                 });
+    auto valuesErr = values->Each([&](Slice, Slice)
+                                  {
+                                      records++;
+                                  });
+    auto keysErr = keysResult.get();
+    auto dur =
+        duration_cast<milliseconds>(high_resolution_clock::now() - start);
+    std::cout << "Nodes: " << nodes << " Values: " << records
+              << " Elapsed: " << dur.count() << "ms" << std::endl;
+    if (keysErr)
+        std::cerr << keyFileName << ": " << keysErr.message() << std::endl;
+    if (valuesErr)
+        std::cerr << valueFileName << ": " << valuesErr.message() << std::endl;
+    if (!valuesErr && values->Size() < keys->CommittedValuesSize())
+    {
+        std::cerr << valueFileName << ": "
+                  << make_error_condition(db_error::truncated).message()
+                  << std::endl;
+        return 1;
+    }
+    return keysErr || valuesErr ? 1 : 0;
+}
+
 // This tool is stupidly slow when compiled with libc++
 // http://llvm.org/bugs/show_bug.cgi?id=21192
-int main()
+//
+// Reads key:value lines in hex from stdin, or with "verify [keys] [values]"
+// checks the files of an existing database.
+int main(int argc, char* argv[])
 {
+    if (argc > 1 && std::string(argv[1]) == "verify")
+        return verify(argc > 2 ? argv[2] : "kvd.keys",
+                      argc > 3 ? argv[3] : "kvd.values");
+
     Options options;
     options.keyFileName = "kvd.keys";
     options.valueFileName = "kvd.values";
+    options.filterFileName = "kvd.filter";
+    options.cacheFileName = "kvd.cache";
     DB<256, StandardLog> db(options);
     if (auto err = db.Open())
     {